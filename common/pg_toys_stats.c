@@ -0,0 +1,326 @@
+/*
+ * Call counters shared by the toy modules
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ * See pg_toys_stats.h. Linked into every module, each copy knows its own
+ * module and reports and resets only the rows of it.
+ */
+
+#include "pg_toys_stats.h"
+
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/memutils.h>
+#include <utils/tuplestore.h>
+
+PG_FUNCTION_INFO_V1(pg_toys_stats);
+PG_FUNCTION_INFO_V1(pg_toys_stats_reset);
+Datum pg_toys_stats(PG_FUNCTION_ARGS);
+Datum pg_toys_stats_reset(PG_FUNCTION_ARGS);
+
+bool toys_stats_track_timing = false;
+
+static const char *toys_stats_module = NULL;
+
+static ToysStats **toys_stats_local = NULL;
+static ToysStats **toys_stats_shared = NULL;
+
+static shmem_request_hook_type toys_stats_prev_shmem_request = NULL;
+static shmem_startup_hook_type toys_stats_prev_shmem_startup = NULL;
+
+static void
+toys_stats_setup(ToysStats *stats)
+{
+	int					i;
+
+	memset(stats, 0, sizeof(ToysStats));
+	SpinLockInit(&stats->mutex);
+
+	for (i = 0; i < TOYS_STATS_SLOTS; i++) {
+		pg_atomic_init_u64(&stats->slots[i].calls, 0);
+		pg_atomic_init_u64(&stats->slots[i].total_time, 0);
+		pg_atomic_init_u64(&stats->slots[i].max_time, 0);
+		pg_atomic_init_u64(&stats->slots[i].bytes, 0);
+		pg_atomic_init_u64(&stats->slots[i].items, 0);
+	}
+}
+
+/* every preloaded module asks, the first one to start up allocates */
+static void
+toys_stats_shmem_request(void)
+{
+	if (toys_stats_prev_shmem_request)
+		toys_stats_prev_shmem_request();
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(ToysStats)));
+}
+
+static void
+toys_stats_shmem_startup(void)
+{
+	ToysStats			*stats;
+	bool				found;
+
+	if (toys_stats_prev_shmem_startup)
+		toys_stats_prev_shmem_startup();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	stats = ShmemInitStruct("pg_toys_stats", sizeof(ToysStats), &found);
+	if (!found)
+		toys_stats_setup(stats);
+
+	LWLockRelease(AddinShmemInitLock);
+
+	*toys_stats_shared = stats;
+}
+
+void
+toys_stats_init(const char *module, const char *guc_prefix)
+{
+	toys_stats_module = module;
+
+	toys_stats_local = (ToysStats **)find_rendezvous_variable(
+			"pg_toys_stats local");
+	toys_stats_shared = (ToysStats **)find_rendezvous_variable(
+			"pg_toys_stats shared");
+
+	DefineCustomBoolVariable(psprintf("%s.track_timing", guc_prefix),
+							 "Collects the time spent in the functions "
+							 "of the module for pg_toys_stats.",
+							 "Reads the clock twice a call.",
+							 &toys_stats_track_timing,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	toys_stats_prev_shmem_request = shmem_request_hook;
+	shmem_request_hook = toys_stats_shmem_request;
+	toys_stats_prev_shmem_startup = shmem_startup_hook;
+	shmem_startup_hook = toys_stats_shmem_startup;
+}
+
+static ToysStats *
+toys_stats_backend(void)
+{
+	if (*toys_stats_local == NULL) {
+		ToysStats	*stats = (ToysStats *)MemoryContextAlloc(
+				TopMemoryContext, sizeof(ToysStats));
+
+		toys_stats_setup(stats);
+		*toys_stats_local = stats;
+	}
+
+	return *toys_stats_local;
+}
+
+/* the slot of module.function, or NULL when all are taken */
+static ToysStatsSlot *
+toys_stats_claim(ToysStats *stats, const char *function)
+{
+	ToysStatsSlot		*slot = NULL;
+	int					i;
+
+	SpinLockAcquire(&stats->mutex);
+
+	for (i = 0; i < stats->nslots; i++) {
+		if (strcmp(stats->slots[i].module, toys_stats_module) == 0
+			&& strcmp(stats->slots[i].function, function) == 0) {
+			slot = &stats->slots[i];
+			break;
+		}
+	}
+
+	if (slot == NULL && stats->nslots < TOYS_STATS_SLOTS) {
+		slot = &stats->slots[stats->nslots];
+		strlcpy(slot->module, toys_stats_module, TOYS_STATS_NAMELEN);
+		strlcpy(slot->function, function, TOYS_STATS_NAMELEN);
+		stats->nslots++;
+	}
+
+	SpinLockRelease(&stats->mutex);
+
+	return slot;
+}
+
+static inline void
+toys_stats_max(pg_atomic_uint64 *max, uint64 value)
+{
+	uint64				old = pg_atomic_read_u64(max);
+
+	while (value > old && !pg_atomic_compare_exchange_u64(max, &old, value))
+		;
+}
+
+/* the backend set has no other writer, it does without locked adds */
+static inline void
+toys_stats_add_local(pg_atomic_uint64 *counter, uint64 value)
+{
+	pg_atomic_write_u64(counter, pg_atomic_read_u64(counter) + value);
+}
+
+/* count a call begun at start, which is zero without track_timing */
+void
+toys_stats_end(ToysStatsEntry *entry, instr_time *start, uint64 bytes,
+		uint64 items)
+{
+	uint64				elapsed = 0;
+
+	if (!entry->resolved) {
+		entry->local = toys_stats_claim(toys_stats_backend(), entry->function);
+		if (*toys_stats_shared)
+			entry->shared = toys_stats_claim(*toys_stats_shared,
+					entry->function);
+		entry->resolved = true;
+	}
+
+	if (!INSTR_TIME_IS_ZERO(*start)) {
+		instr_time		now;
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, *start);
+		elapsed = (uint64)(INSTR_TIME_GET_DOUBLE(now) * 1e9);
+	}
+
+	if (entry->local) {
+		ToysStatsSlot	*slot = entry->local;
+
+		toys_stats_add_local(&slot->calls, 1);
+		toys_stats_add_local(&slot->total_time, elapsed);
+		toys_stats_add_local(&slot->bytes, bytes);
+		toys_stats_add_local(&slot->items, items);
+		if (elapsed > pg_atomic_read_u64(&slot->max_time))
+			pg_atomic_write_u64(&slot->max_time, elapsed);
+	}
+
+	if (entry->shared) {
+		ToysStatsSlot	*slot = entry->shared;
+
+		pg_atomic_fetch_add_u64(&slot->calls, 1);
+		if (elapsed > 0) {
+			pg_atomic_fetch_add_u64(&slot->total_time, elapsed);
+			toys_stats_max(&slot->max_time, elapsed);
+		}
+		if (bytes > 0)
+			pg_atomic_fetch_add_u64(&slot->bytes, bytes);
+		if (items > 0)
+			pg_atomic_fetch_add_u64(&slot->items, items);
+	}
+}
+
+static void
+toys_stats_emit(ReturnSetInfo *rsinfo, ToysStats *stats, const char *scope)
+{
+	Datum				values[8];
+	bool				nulls[8] = {false};
+	int					nslots, i;
+
+	SpinLockAcquire(&stats->mutex);
+	nslots = stats->nslots;
+	SpinLockRelease(&stats->mutex);
+
+	/* names of a claimed slot never change */
+	for (i = 0; i < nslots; i++) {
+		ToysStatsSlot	*slot = &stats->slots[i];
+
+		if (strcmp(slot->module, toys_stats_module) != 0)
+			continue;
+
+		values[0] = CStringGetTextDatum(scope);
+		values[1] = CStringGetTextDatum(slot->module);
+		values[2] = CStringGetTextDatum(slot->function);
+		values[3] = Int64GetDatum((int64)pg_atomic_read_u64(&slot->calls));
+		values[4] = Float8GetDatum(
+				pg_atomic_read_u64(&slot->total_time) / 1e6);
+		values[5] = Float8GetDatum(
+				pg_atomic_read_u64(&slot->max_time) / 1e6);
+		values[6] = Int64GetDatum((int64)pg_atomic_read_u64(&slot->bytes));
+		values[7] = Int64GetDatum((int64)pg_atomic_read_u64(&slot->items));
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+				values, nulls);
+	}
+}
+
+/* the counters of this module, times in milliseconds */
+Datum pg_toys_stats(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "pg_toys_stats: "
+
+	ReturnSetInfo		*rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc			tupdesc;
+	MemoryContext		oldcxt;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		elog(ERROR, EPREFIX "context does not accept a set result");
+
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		elog(ERROR, EPREFIX "materialize mode required, but it is not "
+				"allowed in this context");
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, EPREFIX "return type must be a row type");
+
+	oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setDesc = CreateTupleDescCopy(tupdesc);
+	rsinfo->setResult = tuplestore_begin_heap(
+			rsinfo->allowedModes & SFRM_Materialize_Random, false, work_mem);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	if (*toys_stats_shared)
+		toys_stats_emit(rsinfo, *toys_stats_shared, "cluster");
+	toys_stats_emit(rsinfo, toys_stats_backend(), "backend");
+
+	return (Datum)0;
+
+	#undef EPREFIX
+}
+
+static void
+toys_stats_zero(ToysStats *stats)
+{
+	int					nslots, i;
+
+	SpinLockAcquire(&stats->mutex);
+	nslots = stats->nslots;
+	SpinLockRelease(&stats->mutex);
+
+	for (i = 0; i < nslots; i++) {
+		if (strcmp(stats->slots[i].module, toys_stats_module) != 0)
+			continue;
+
+		pg_atomic_write_u64(&stats->slots[i].calls, 0);
+		pg_atomic_write_u64(&stats->slots[i].total_time, 0);
+		pg_atomic_write_u64(&stats->slots[i].max_time, 0);
+		pg_atomic_write_u64(&stats->slots[i].bytes, 0);
+		pg_atomic_write_u64(&stats->slots[i].items, 0);
+	}
+}
+
+/*
+ * The cluster counters of this module and those of this backend, other
+ * backends keep theirs.
+ */
+Datum pg_toys_stats_reset(PG_FUNCTION_ARGS)
+{
+	if (*toys_stats_shared)
+		toys_stats_zero(*toys_stats_shared);
+	toys_stats_zero(toys_stats_backend());
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,86 @@
+/*
+ * Call counters shared by the toy modules
+ *
+ * Every module links pg_toys_stats.c, calls toys_stats_init() from
+ * _PG_init and declares <module>_stats() and <module>_stats_reset() on
+ * its copies of pg_toys_stats() and pg_toys_stats_reset(), which see the
+ * rows of that module only. The view pg_toys_stats unions the functions of
+ * the modules installed, each install and uninstall script rebuilds it.
+ *
+ * Counters are kept twice. The backend set lives in TopMemoryContext and
+ * is found by all modules of a backend through a rendezvous variable. The
+ * cluster set lives in shared memory, set up by whichever module is loaded
+ * by shared_preload_libraries, and is missing otherwise. A slot is claimed
+ * per module and function under a spinlock on first use, after that a call
+ * costs a few atomic increments, plus two clock reads with track_timing.
+ *
+ * A call is one invocation through fmgr, so a value-per-call set returning
+ * function counts one per row and once more at the end of the set.
+ */
+
+#ifndef PG_TOYS_STATS_H
+#define PG_TOYS_STATS_H
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <port/atomics.h>
+#include <portability/instr_time.h>
+#include <storage/spin.h>
+
+#define TOYS_STATS_SLOTS	128
+#define TOYS_STATS_NAMELEN	32
+
+/*
+ * Every module has its own copy of these, which must not be bound to the
+ * copy of a module loaded before it.
+ */
+#ifdef __GNUC__
+#define TOYS_STATS_LOCAL	__attribute__((visibility("hidden")))
+#else
+#define TOYS_STATS_LOCAL
+#endif
+
+typedef struct {
+	char				module[TOYS_STATS_NAMELEN];
+	char				function[TOYS_STATS_NAMELEN];
+	pg_atomic_uint64	calls;
+	pg_atomic_uint64	total_time;	/* nanoseconds */
+	pg_atomic_uint64	max_time;
+	pg_atomic_uint64	bytes;		/* of the arguments */
+	pg_atomic_uint64	items;		/* trigrams, tags or prefixes */
+} ToysStatsSlot;
+
+typedef struct {
+	slock_t				mutex;		/* taken to claim a slot only */
+	int					nslots;
+	ToysStatsSlot		slots[TOYS_STATS_SLOTS];
+} ToysStats;
+
+/* a function of the module, resolved to its slots on first use */
+typedef struct {
+	const char			*function;
+	bool				resolved;
+	ToysStatsSlot		*local;
+	ToysStatsSlot		*shared;
+} ToysStatsEntry;
+
+#define TOYS_STATS_ENTRY(F)		{ (F), false, NULL, NULL }
+
+/* <module>.track_timing */
+extern TOYS_STATS_LOCAL bool toys_stats_track_timing;
+
+extern TOYS_STATS_LOCAL void toys_stats_init(const char *module,
+		const char *guc_prefix);
+extern TOYS_STATS_LOCAL void toys_stats_end(ToysStatsEntry *entry,
+		instr_time *start, uint64 bytes, uint64 items);
+
+static inline void
+toys_stats_begin(instr_time *start)
+{
+	if (toys_stats_track_timing)
+		INSTR_TIME_SET_CURRENT(*start);
+	else
+		INSTR_TIME_SET_ZERO(*start);
+}
+
+#endif
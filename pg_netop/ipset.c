@@ -0,0 +1,789 @@
+/* author: jianing yang <jianingy.yang@gmail.com> */
+
+/*
+ * ipset: a set of addresses kept as the ranges netblock_merge_compact
+ * leaves, sorted, disjoint and not touching, IPv4 ones first. Ranges are
+ * inclusive, the end of ::/0 would not fit in 128 bits otherwise. An IPv4
+ * range takes two uint32, an IPv6 one four uint64: first high, first low,
+ * last high, last low. Being canonical, two sets are equal when their
+ * bytes are.
+ */
+
+#include <ctype.h>
+#include <math.h>
+
+#include "pg_netop.h"
+
+#include <access/gist.h>
+#include <access/stratnum.h>
+#include <catalog/pg_type.h>
+#include <lib/stringinfo.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+
+typedef struct {
+    int32 vl_len_;      /* varlena header (do not touch directly!) */
+    int32 nv4, nv6;
+    int32 unused;       /* keeps the IPv6 ranges 8-byte aligned */
+    char data[FLEXIBLE_ARRAY_MEMBER];
+} IpSet;
+
+#define IPSET_HDRSZ offsetof(IpSet, data)
+#define IPSET_SIZE(nv4, nv6) \
+    (IPSET_HDRSZ + sizeof(uint32) * 2 * (nv4) + sizeof(uint64) * 4 * (nv6))
+#define IPSET_V4(set) ((uint32 *) (set)->data)
+#define IPSET_V6(set) \
+    ((uint64 *) ((set)->data + sizeof(uint32) * 2 * (set)->nv4))
+#define IPSET_NRANGES(set) ((set)->nv4 + (set)->nv6)
+
+#define DatumGetIpSetP(X) ((IpSet *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_IPSET_P(N) DatumGetIpSetP(PG_GETARG_DATUM(N))
+#define PG_RETURN_IPSET_P(X) PG_RETURN_POINTER(X)
+
+/* a GiST key is the set with its smallest gaps closed, down to this */
+#define IPSET_GIST_MAXRANGES 8
+
+/* range i of the set, IPv4 ones numbered first */
+static inline
+void ipset_range(IpSet *set, int i, netblock_merge_range *r) {
+    if (i < set->nv4) {
+        uint32 *v = IPSET_V4(set) + 2 * i;
+
+        r->first = v[0];
+        r->last = v[1];
+        r->family = PGSQL_AF_INET;
+    } else {
+        uint64 *v = IPSET_V6(set) + 4 * (i - set->nv4);
+
+        r->first = (uint128) v[0] << 64 | v[1];
+        r->last = (uint128) v[2] << 64 | v[3];
+        r->family = PGSQL_AF_INET6;
+    }
+}
+
+/*
+ * Sizes and gaps of the two families made comparable: an IPv4 range is
+ * weighed as the IPv6 range taking the same share of its address space.
+ */
+static inline
+uint128 ipset_scale(int family, uint128 n) {
+    return family == PGSQL_AF_INET ? n << 96 : n;
+}
+
+static netblock_merge_state*
+ipset_ranges(IpSet *set)
+{
+    netblock_merge_state *state;
+    int i;
+
+    state = netblock_merge_state_new(CurrentMemoryContext,
+                                     IPSET_NRANGES(set));
+
+    for (i = 0; i < IPSET_NRANGES(set); i++)
+        ipset_range(set, i, &state->ranges[i]);
+    state->nranges = IPSET_NRANGES(set);
+
+    return state;
+}
+
+static IpSet*
+ipset_make(netblock_merge_state *state)
+{
+    IpSet *set;
+    uint32 *v4;
+    uint64 *v6;
+    netblock_merge_range *r;
+    int i, nv4 = 0;
+
+    netblock_merge_compact(state);
+
+    for (i = 0; i < state->nranges; i++)
+        if (state->ranges[i].family == PGSQL_AF_INET)
+            nv4++;
+
+    set = palloc0(IPSET_SIZE(nv4, state->nranges - nv4));
+    SET_VARSIZE(set, IPSET_SIZE(nv4, state->nranges - nv4));
+    set->nv4 = nv4;
+    set->nv6 = state->nranges - nv4;
+
+    v4 = IPSET_V4(set);
+    v6 = IPSET_V6(set);
+
+    for (i = 0; i < state->nranges; i++) {
+        r = &state->ranges[i];
+
+        if (r->family == PGSQL_AF_INET) {
+            *v4++ = (uint32) r->first;
+            *v4++ = (uint32) r->last;
+        } else {
+            *v6++ = (uint64) (r->first >> 64);
+            *v6++ = (uint64) r->first;
+            *v6++ = (uint64) (r->last >> 64);
+            *v6++ = (uint64) r->last;
+        }
+    }
+
+    return set;
+}
+
+/*
+ * Walk the ranges of both sets in step. With out, every overlap is added
+ * to it; without, the walk stops at the first. Returns whether any range
+ * overlaps.
+ */
+static bool
+ipset_walk(IpSet *a, IpSet *b, netblock_merge_state *out)
+{
+    netblock_merge_range ra, rb;
+    int i = 0, j = 0;
+    bool found = false;
+
+    while (i < IPSET_NRANGES(a) && j < IPSET_NRANGES(b)) {
+        ipset_range(a, i, &ra);
+        ipset_range(b, j, &rb);
+
+        if (ra.family != rb.family) {
+            if (ra.family < rb.family)
+                i++;
+            else
+                j++;
+            continue;
+        }
+
+        if (ra.first <= rb.last && rb.first <= ra.last) {
+            if (out == NULL)
+                return true;
+
+            netblock_merge_add(out, ra.family, Max(ra.first, rb.first),
+                               Min(ra.last, rb.last));
+            found = true;
+        }
+
+        if (ra.last <= rb.last)
+            i++;
+        if (rb.last <= ra.last)
+            j++;
+    }
+
+    return found;
+}
+
+/* whether one range of the set holds all of first..last */
+static bool
+ipset_holds(IpSet *set, int family, uint128 first, uint128 last)
+{
+    netblock_merge_range r;
+    int start = family == PGSQL_AF_INET ? 0 : set->nv4;
+    int lo = start, hi, mid;
+
+    hi = family == PGSQL_AF_INET ? set->nv4 : IPSET_NRANGES(set);
+
+    /* lo ends past the last range starting at or before first */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        ipset_range(set, mid, &r);
+
+        if (r.first <= first)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == start)
+        return false;
+
+    ipset_range(set, lo - 1, &r);
+
+    return r.last >= last;
+}
+
+/* parts of a not in b, as a state */
+static netblock_merge_state*
+ipset_minus_ranges(IpSet *a, IpSet *b)
+{
+    netblock_merge_state *state, *excl;
+    netblock_merge_range r;
+    int i, j = 0;
+
+    state = netblock_merge_state_new(CurrentMemoryContext, IPSET_NRANGES(a));
+    excl = ipset_ranges(b);
+
+    for (i = 0; i < IPSET_NRANGES(a); i++) {
+        ipset_range(a, i, &r);
+        j += netblock_add_gaps(state, r.family, r.first, r.last,
+                               excl->ranges + j, excl->nranges - j);
+    }
+
+    return state;
+}
+
+static char*
+ipset_trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char) *s))
+        s++;
+
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1]))
+        *--end = '\0';
+
+    return s;
+}
+
+PG_FUNCTION_INFO_V1(ipset_in);
+Datum ipset_in(PG_FUNCTION_ARGS);
+
+/* '{cidr, ...}', in any order, overlapping or not */
+Datum
+ipset_in(PG_FUNCTION_ARGS)
+{
+    char *str = PG_GETARG_CSTRING(0);
+    netblock_merge_state *state;
+    char *buf, *p, *comma, *tok;
+    inet *block;
+    uint128 first, last;
+    size_t len;
+
+    buf = ipset_trim(pstrdup(str));
+    len = strlen(buf);
+
+    if (len < 2 || buf[0] != '{' || buf[len - 1] != '}')
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                 errmsg("invalid input syntax for type %s: \"%s\"",
+                        "ipset", str),
+                 errdetail("Set value must start with \"{\" and end with \"}\".")));
+
+    buf[len - 1] = '\0';
+    p = buf + 1;
+
+    state = netblock_merge_state_new(CurrentMemoryContext, 0);
+
+    if (*ipset_trim(p) == '\0')
+        PG_RETURN_IPSET_P(ipset_make(state));
+
+    for (;;) {
+        comma = strchr(p, ',');
+        if (comma)
+            *comma = '\0';
+
+        tok = ipset_trim(p);
+        if (*tok == '\0')
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                     errmsg("invalid input syntax for type %s: \"%s\"",
+                            "ipset", str),
+                     errdetail("Empty set element.")));
+
+        block = DatumGetInetPP(DirectFunctionCall1(cidr_in,
+                                                   CStringGetDatum(tok)));
+        netblock_range(block, &first, &last);
+        netblock_merge_add(state, ip_family(block), first, last);
+
+        if (comma == NULL)
+            break;
+        p = comma + 1;
+    }
+
+    PG_RETURN_IPSET_P(ipset_make(state));
+}
+
+PG_FUNCTION_INFO_V1(ipset_out);
+Datum ipset_out(PG_FUNCTION_ARGS);
+
+/* the fewest blocks covering the set, as netblock_merge gives them */
+Datum
+ipset_out(PG_FUNCTION_ARGS)
+{
+    IpSet *set = PG_GETARG_IPSET_P(0);
+    StringInfoData buf;
+    netblock_merge_range r;
+    inet *block;
+    uint128 current;
+    int i;
+    bool more, first = true;
+
+    initStringInfo(&buf);
+    appendStringInfoChar(&buf, '{');
+
+    for (i = 0; i < IPSET_NRANGES(set); i++) {
+        ipset_range(set, i, &r);
+        current = r.first;
+
+        do {
+            more = netblock_cut(&current, r.last, r.family, &block);
+
+            if (!first)
+                appendStringInfoChar(&buf, ',');
+            appendStringInfoString(&buf, DatumGetCString(
+                    DirectFunctionCall1(cidr_out, InetPGetDatum(block))));
+            pfree(block);
+            first = false;
+        } while (more);
+    }
+
+    appendStringInfoChar(&buf, '}');
+
+    PG_RETURN_CSTRING(buf.data);
+}
+
+PG_FUNCTION_INFO_V1(ipset_from_cidr);
+Datum ipset_from_cidr(PG_FUNCTION_ARGS);
+
+Datum
+ipset_from_cidr(PG_FUNCTION_ARGS)
+{
+    inet *block = PG_GETARG_INET_PP(0);
+    netblock_merge_state *state;
+    uint128 first, last;
+
+    netblock_range(block, &first, &last);
+
+    state = netblock_merge_state_new(CurrentMemoryContext, 1);
+    netblock_merge_add(state, ip_family(block), first, last);
+
+    PG_RETURN_IPSET_P(ipset_make(state));
+}
+
+PG_FUNCTION_INFO_V1(ipset_from_array);
+Datum ipset_from_array(PG_FUNCTION_ARGS);
+
+/* NULL elements add nothing */
+Datum
+ipset_from_array(PG_FUNCTION_ARGS)
+{
+    ArrayType *arr = PG_GETARG_ARRAYTYPE_P(0);
+    netblock_merge_state *state;
+    Datum *elems;
+    bool *nulls;
+    inet *block;
+    uint128 first, last;
+    int i, n;
+
+    deconstruct_array(arr, CIDROID, -1, false, TYPALIGN_INT,
+                      &elems, &nulls, &n);
+
+    state = netblock_merge_state_new(CurrentMemoryContext, n);
+
+    for (i = 0; i < n; i++) {
+        if (nulls[i])
+            continue;
+
+        block = DatumGetInetPP(elems[i]);
+        netblock_range(block, &first, &last);
+        netblock_merge_add(state, ip_family(block), first, last);
+    }
+
+    PG_RETURN_IPSET_P(ipset_make(state));
+}
+
+PG_FUNCTION_INFO_V1(ipset_agg_final);
+Datum ipset_agg_final(PG_FUNCTION_ARGS);
+
+/* final function of ipset_agg, on the state of netblock_merge */
+Datum
+ipset_agg_final(PG_FUNCTION_ARGS)
+{
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+
+    PG_RETURN_IPSET_P(ipset_make(
+            (netblock_merge_state *) PG_GETARG_POINTER(0)));
+}
+
+PG_FUNCTION_INFO_V1(ipset_union);
+Datum ipset_union(PG_FUNCTION_ARGS);
+
+Datum
+ipset_union(PG_FUNCTION_ARGS)
+{
+    IpSet *a = PG_GETARG_IPSET_P(0);
+    IpSet *b = PG_GETARG_IPSET_P(1);
+    netblock_merge_state *state = ipset_ranges(a);
+    netblock_merge_range r;
+    int i;
+
+    for (i = 0; i < IPSET_NRANGES(b); i++) {
+        ipset_range(b, i, &r);
+        netblock_merge_add(state, r.family, r.first, r.last);
+    }
+
+    PG_RETURN_IPSET_P(ipset_make(state));
+}
+
+PG_FUNCTION_INFO_V1(ipset_intersect);
+Datum ipset_intersect(PG_FUNCTION_ARGS);
+
+Datum
+ipset_intersect(PG_FUNCTION_ARGS)
+{
+    IpSet *a = PG_GETARG_IPSET_P(0);
+    IpSet *b = PG_GETARG_IPSET_P(1);
+    netblock_merge_state *state;
+
+    state = netblock_merge_state_new(CurrentMemoryContext,
+                                     Min(IPSET_NRANGES(a), IPSET_NRANGES(b)));
+    ipset_walk(a, b, state);
+
+    PG_RETURN_IPSET_P(ipset_make(state));
+}
+
+PG_FUNCTION_INFO_V1(ipset_minus);
+Datum ipset_minus(PG_FUNCTION_ARGS);
+
+Datum
+ipset_minus(PG_FUNCTION_ARGS)
+{
+    IpSet *a = PG_GETARG_IPSET_P(0);
+    IpSet *b = PG_GETARG_IPSET_P(1);
+
+    PG_RETURN_IPSET_P(ipset_make(ipset_minus_ranges(a, b)));
+}
+
+PG_FUNCTION_INFO_V1(ipset_contains);
+Datum ipset_contains(PG_FUNCTION_ARGS);
+
+/* every address of the network of the inet is in the set */
+Datum
+ipset_contains(PG_FUNCTION_ARGS)
+{
+    IpSet *set = PG_GETARG_IPSET_P(0);
+    inet *ip = PG_GETARG_INET_PP(1);
+    uint128 first, last;
+
+    netblock_range(ip, &first, &last);
+
+    PG_RETURN_BOOL(ipset_holds(set, ip_family(ip), first, last));
+}
+
+PG_FUNCTION_INFO_V1(ipset_overlaps);
+Datum ipset_overlaps(PG_FUNCTION_ARGS);
+
+Datum
+ipset_overlaps(PG_FUNCTION_ARGS)
+{
+    IpSet *a = PG_GETARG_IPSET_P(0);
+    IpSet *b = PG_GETARG_IPSET_P(1);
+
+    PG_RETURN_BOOL(ipset_walk(a, b, NULL));
+}
+
+PG_FUNCTION_INFO_V1(ipset_eq);
+Datum ipset_eq(PG_FUNCTION_ARGS);
+
+Datum
+ipset_eq(PG_FUNCTION_ARGS)
+{
+    IpSet *a = PG_GETARG_IPSET_P(0);
+    IpSet *b = PG_GETARG_IPSET_P(1);
+
+    PG_RETURN_BOOL(VARSIZE(a) == VARSIZE(b) &&
+                   memcmp(a, b, VARSIZE(a)) == 0);
+}
+
+/*
+ * GiST support. Keys are ipsets too: a leaf key is the set itself, or
+ * when it has more than IPSET_GIST_MAXRANGES ranges, the set with its
+ * smallest gaps filled in, so every key covers what it stands for and
+ * matches are always rechecked.
+ */
+typedef struct {
+    uint128 size;
+    int pos;
+} ipset_gap;
+
+static int
+ipset_gap_cmp(const void *lhs, const void *rhs)
+{
+    const ipset_gap *l = lhs, *r = rhs;
+
+    if (l->size != r->size)
+        return l->size < r->size ? -1 : 1;
+    return l->pos < r->pos ? -1 : (l->pos > r->pos);
+}
+
+/* close the smallest gaps of a compacted state, never one between families */
+static void
+ipset_simplify(netblock_merge_state *state, int maxranges)
+{
+    netblock_merge_range *r = state->ranges;
+    ipset_gap *gaps;
+    bool *close;
+    int i, k, ngaps = 0;
+
+    if (state->nranges <= maxranges)
+        return;
+
+    gaps = palloc(sizeof(ipset_gap) * state->nranges);
+    close = palloc0(sizeof(bool) * state->nranges);
+
+    for (i = 1; i < state->nranges; i++) {
+        if (r[i].family != r[i - 1].family)
+            continue;
+
+        gaps[ngaps].size = ipset_scale(r[i].family,
+                                       r[i].first - r[i - 1].last);
+        gaps[ngaps].pos = i;
+        ngaps++;
+    }
+
+    qsort(gaps, ngaps, sizeof(ipset_gap), ipset_gap_cmp);
+
+    for (i = 0; i < ngaps && i < state->nranges - maxranges; i++)
+        close[gaps[i].pos] = true;
+
+    for (i = 1, k = 0; i < state->nranges; i++) {
+        if (close[i])
+            r[k].last = r[i].last;
+        else
+            r[++k] = r[i];
+    }
+
+    state->nranges = k + 1;
+
+    pfree(gaps);
+    pfree(close);
+}
+
+/* share of the address space of its family a state covers, summed */
+static double
+ipset_coverage(netblock_merge_state *state)
+{
+    netblock_merge_range *r;
+    double total = 0.0;
+    int i;
+
+    for (i = 0; i < state->nranges; i++) {
+        r = &state->ranges[i];
+        total += ldexp((double) (r->last - r->first) + 1.0,
+                       r->family == PGSQL_AF_INET ? -32 : -128);
+    }
+
+    return total;
+}
+
+static IpSet*
+ipset_gist_merge(GistEntryVector *entryvec, OffsetNumber *list, int n)
+{
+    netblock_merge_state *state;
+    netblock_merge_range r;
+    IpSet *key;
+    int i, k;
+
+    state = netblock_merge_state_new(CurrentMemoryContext,
+                                     n * IPSET_GIST_MAXRANGES);
+
+    for (i = 0; i < n; i++) {
+        key = (IpSet *) DatumGetPointer(
+                entryvec->vector[list ? list[i] : i].key);
+
+        for (k = 0; k < IPSET_NRANGES(key); k++) {
+            ipset_range(key, k, &r);
+            netblock_merge_add(state, r.family, r.first, r.last);
+        }
+    }
+
+    netblock_merge_compact(state);
+    ipset_simplify(state, IPSET_GIST_MAXRANGES);
+
+    return ipset_make(state);
+}
+
+PG_FUNCTION_INFO_V1(ipset_gist_consistent);
+PG_FUNCTION_INFO_V1(ipset_gist_union);
+PG_FUNCTION_INFO_V1(ipset_gist_compress);
+PG_FUNCTION_INFO_V1(ipset_gist_decompress);
+PG_FUNCTION_INFO_V1(ipset_gist_penalty);
+PG_FUNCTION_INFO_V1(ipset_gist_picksplit);
+PG_FUNCTION_INFO_V1(ipset_gist_same);
+Datum ipset_gist_consistent(PG_FUNCTION_ARGS);
+Datum ipset_gist_union(PG_FUNCTION_ARGS);
+Datum ipset_gist_compress(PG_FUNCTION_ARGS);
+Datum ipset_gist_decompress(PG_FUNCTION_ARGS);
+Datum ipset_gist_penalty(PG_FUNCTION_ARGS);
+Datum ipset_gist_picksplit(PG_FUNCTION_ARGS);
+Datum ipset_gist_same(PG_FUNCTION_ARGS);
+
+/* an inner key covers its children, so one test serves both levels */
+Datum
+ipset_gist_consistent(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+    StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
+    /* Oid subtype = PG_GETARG_OID(3); */
+    bool *recheck = (bool *) PG_GETARG_POINTER(4);
+    IpSet *key = (IpSet *) DatumGetPointer(entry->key);
+    inet *ip;
+    uint128 first, last;
+
+    *recheck = true;
+
+    switch (strategy) {
+    case RTOverlapStrategyNumber:
+        PG_RETURN_BOOL(ipset_walk(key, PG_GETARG_IPSET_P(1), NULL));
+
+    case RTContainsElemStrategyNumber:
+        ip = PG_GETARG_INET_PP(1);
+        netblock_range(ip, &first, &last);
+        PG_RETURN_BOOL(ipset_holds(key, ip_family(ip), first, last));
+
+    default:
+        elog(ERROR, "ipset_gist_consistent: unrecognized strategy number: %d",
+             strategy);
+    }
+
+    PG_RETURN_BOOL(false);
+}
+
+Datum
+ipset_gist_union(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+    int *size = (int *) PG_GETARG_POINTER(1);
+    IpSet *key = ipset_gist_merge(entryvec, NULL, entryvec->n);
+
+    *size = VARSIZE(key);
+
+    PG_RETURN_POINTER(key);
+}
+
+Datum
+ipset_gist_compress(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+    GISTENTRY *retval = entry;
+    netblock_merge_state *state;
+    IpSet *set;
+
+    if (entry->leafkey) {
+        set = DatumGetIpSetP(entry->key);
+
+        if (IPSET_NRANGES(set) > IPSET_GIST_MAXRANGES) {
+            state = ipset_ranges(set);
+            ipset_simplify(state, IPSET_GIST_MAXRANGES);
+
+            retval = (GISTENTRY *) palloc(sizeof(GISTENTRY));
+            gistentryinit(*retval, PointerGetDatum(ipset_make(state)),
+                          entry->rel, entry->page, entry->offset, false);
+        }
+    }
+
+    PG_RETURN_POINTER(retval);
+}
+
+Datum
+ipset_gist_decompress(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+    GISTENTRY *retval;
+    IpSet *key;
+
+    key = DatumGetIpSetP(entry->key);
+
+    if (key != (IpSet *) DatumGetPointer(entry->key)) {
+        retval = (GISTENTRY *) palloc(sizeof(GISTENTRY));
+        gistentryinit(*retval, PointerGetDatum(key),
+                      entry->rel, entry->page, entry->offset, entry->leafkey);
+        PG_RETURN_POINTER(retval);
+    }
+
+    PG_RETURN_POINTER(entry);
+}
+
+/*
+ * The share of address space the new key has outside the original. It is
+ * measured directly rather than as a difference of two coverages, which
+ * would lose a small IPv6 growth next to a large key.
+ */
+Datum
+ipset_gist_penalty(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *origentry = (GISTENTRY *) PG_GETARG_POINTER(0);
+    GISTENTRY *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
+    float *penalty = (float *) PG_GETARG_POINTER(2);
+    IpSet *orig = (IpSet *) DatumGetPointer(origentry->key);
+    IpSet *newkey = (IpSet *) DatumGetPointer(newentry->key);
+
+    *penalty = (float) ipset_coverage(ipset_minus_ranges(newkey, orig));
+
+    PG_RETURN_POINTER(penalty);
+}
+
+static int
+ipset_gist_first_cmp(const void *lhs, const void *rhs, void *arg)
+{
+    GistEntryVector *entryvec = arg;
+    IpSet *l = (IpSet *) DatumGetPointer(
+            entryvec->vector[*(const OffsetNumber *) lhs].key);
+    IpSet *r = (IpSet *) DatumGetPointer(
+            entryvec->vector[*(const OffsetNumber *) rhs].key);
+    netblock_merge_range rl, rr;
+
+    if (IPSET_NRANGES(l) == 0 || IPSET_NRANGES(r) == 0)
+        return (IPSET_NRANGES(l) != 0) - (IPSET_NRANGES(r) != 0);
+
+    ipset_range(l, 0, &rl);
+    ipset_range(r, 0, &rr);
+
+    if (rl.family != rr.family)
+        return rl.family < rr.family ? -1 : 1;
+    if (rl.first != rr.first)
+        return rl.first < rr.first ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Sets of an address plan mostly lie in one stretch of it, so the keys
+ * are ordered by their lowest address and cut in two halves.
+ */
+Datum
+ipset_gist_picksplit(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+    GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
+    OffsetNumber maxoff = entryvec->n - 1;
+    OffsetNumber *order;
+    int i, n = maxoff, half;
+
+    order = palloc(sizeof(OffsetNumber) * n);
+    for (i = 0; i < n; i++)
+        order[i] = FirstOffsetNumber + i;
+
+    qsort_arg(order, n, sizeof(OffsetNumber), ipset_gist_first_cmp, entryvec);
+
+    half = n / 2;
+
+    v->spl_left = (OffsetNumber *) palloc(sizeof(OffsetNumber) * (maxoff + 1));
+    v->spl_right = (OffsetNumber *) palloc(sizeof(OffsetNumber) * (maxoff + 1));
+    v->spl_nleft = half;
+    v->spl_nright = n - half;
+
+    memcpy(v->spl_left, order, sizeof(OffsetNumber) * half);
+    memcpy(v->spl_right, order + half, sizeof(OffsetNumber) * (n - half));
+
+    v->spl_ldatum = PointerGetDatum(ipset_gist_merge(entryvec, v->spl_left,
+                                                     v->spl_nleft));
+    v->spl_rdatum = PointerGetDatum(ipset_gist_merge(entryvec, v->spl_right,
+                                                     v->spl_nright));
+
+    pfree(order);
+
+    PG_RETURN_POINTER(v);
+}
+
+Datum
+ipset_gist_same(PG_FUNCTION_ARGS)
+{
+    IpSet *a = (IpSet *) PG_GETARG_POINTER(0);
+    IpSet *b = (IpSet *) PG_GETARG_POINTER(1);
+    bool *result = (bool *) PG_GETARG_POINTER(2);
+
+    *result = (VARSIZE(a) == VARSIZE(b) &&
+               memcmp(a, b, VARSIZE(a)) == 0);
+
+    PG_RETURN_POINTER(result);
+}
+
+// vim: ts=4 sw=4 et cindent
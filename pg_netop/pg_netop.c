@@ -1,27 +1,41 @@
 /* author: jianing yang <jianingy.yang@gmail.com> */
 
-#include <postgres.h>
-#include <fmgr.h>
-#include <utils/inet.h>
+#include "pg_netop.h"
+
+#include <miscadmin.h>
+#include <access/relation.h>
+#include <access/xact.h>
+#include <catalog/pg_language.h>
+#include <commands/trigger.h>
 #include <nodes/execnodes.h>
+#include <port/pg_bitutils.h>
+#include <catalog/pg_type.h>
+#include <executor/spi.h>
+#include <libpq/pqformat.h>
+#include <storage/proc.h>
+#include <utils/acl.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/inval.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+#include <utils/rls.h>
+
+#include "pg_toys_stats.h"
 
+/*
+ * The state of a set returning call lives in fn_extra between calls, and
+ * a call site may see IPv4 and IPv6 rows in turn; family tells the two
+ * contexts apart, so a path never takes over the state of the other.
+ */
 typedef struct {
+    int family;                 /* PGSQL_AF_INET */
     uint32_t start[2], end[2];
     uint32_t current, size, shift;
 } netblock_context;
 
-#define ip_family(inetptr) \
-	(((inet_struct *) VARDATA_ANY(inetptr))->family)
-
-#define ip_bits(inetptr) \
-	(((inet_struct *) VARDATA_ANY(inetptr))->bits)
-
-#define ip_addr(inetptr) \
-	(((inet_struct *) VARDATA_ANY(inetptr))->ipaddr)
-
-#define ip_maxbits(inetptr) \
-	(ip_family(inetptr) == PGSQL_AF_INET ? 32 : 128)
-
 #define reverse_shift(x) (32 - (x))
 
 static inline
@@ -66,8 +80,220 @@ netblock_split(netblock_context *ctx, ReturnSetInfo *resultInfo)
     return inet_ip;
 }
 
+/*
+ * IPv6 blocks are kept as inclusive ranges, the end of ::/0 would not fit
+ * in 128 bits otherwise. netblock_acc leaves one or two ranges to split,
+ * netblock_sub the parts before and after the subtracted block.
+ */
+typedef struct {
+    int family;                 /* PGSQL_AF_INET6 */
+    uint128 current[2], last[2];
+    int nranges, range;
+} netblock_context6;
+
+/* fn_extra as a context of family, dropping one left by the other path */
+static void*
+netblock_context_get(FmgrInfo *fmgr_info, int family)
+{
+    int *ctx = (int *)fmgr_info->fn_extra;
+
+    if (ctx != NULL && *ctx != family) {
+        pfree(ctx);
+        fmgr_info->fn_extra = ctx = NULL;
+    }
+
+    return ctx;
+}
+
+static inline
+uint128 ip_to_int128(unsigned char ip[], int n) {
+    uint128 retval = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        retval = retval << 8 | ip[i];
+    return retval;
+}
+
+static inline
+void int128_to_ip(uint128 int_ip, uint32_t cidr, int family, inet* inet_ip) {
+    unsigned char *ip = ip_addr(inet_ip);
+    int i;
+
+    for (i = (family == PGSQL_AF_INET ? 4 : 16) - 1; i >= 0; i--) {
+        ip[i] = int_ip & 0xff;
+        int_ip >>= 8;
+    }
+
+    ip_bits(inet_ip) = cidr;
+    ip_family(inet_ip) = family;
+    SET_INET_VARSIZE(inet_ip);
+}
+
+/* trailing zero bits, 128 for 0 */
+static inline
+int ctz128(uint128 x) {
+    uint64 lo = (uint64) x, hi = (uint64) (x >> 64);
+
+    if (lo)
+        return pg_rightmost_one_pos64(lo);
+    if (hi)
+        return 64 + pg_rightmost_one_pos64(hi);
+    return 128;
+}
+
+/* position of the highest bit set, x must not be 0 */
+static inline
+int msb128(uint128 x) {
+    uint64 hi = (uint64) (x >> 64);
+
+    if (hi)
+        return 64 + pg_leftmost_one_pos64(hi);
+    return pg_leftmost_one_pos64((uint64) x);
+}
+
+/* an IPv4 block is a range below 2^32; host bits of an inet are dropped */
+void
+netblock_range(inet *block, uint128 *first, uint128 *last)
+{
+    int hostbits = ip_maxbits(block) - ip_bits(block);
+    uint128 hostmask = hostbits == 128 ? ~(uint128) 0
+                                       : ((uint128) 1 << hostbits) - 1;
+
+    *first = ip_to_int128(ip_addr(block),
+                          ip_family(block) == PGSQL_AF_INET ? 4 : 16);
+    *first &= ~hostmask;
+    *last = *first | hostmask;
+}
+
+static void
+netblock_add_range6(netblock_context6 *ctx, uint128 first, uint128 last)
+{
+    ctx->current[ctx->nranges] = first;
+    ctx->last[ctx->nranges] = last;
+    ctx->nranges++;
+}
+
+/*
+ * Cut the largest block off the front of the range from *current to last:
+ * as many host bits as *current has trailing zeros, but no more than the
+ * size of the range. Advances *current, returns false once the range is
+ * used up.
+ */
+bool
+netblock_cut(uint128 *current, uint128 last, int family, inet **block)
+{
+    uint128 left = last - *current;
+    int shift = ctz128(*current);
+    int fit = left == ~(uint128) 0 ? 128 : msb128(left + 1);
+
+    shift = Min(shift, fit);
+
+    *block = palloc0(sizeof(inet));
+    int128_to_ip(*current, (family == PGSQL_AF_INET ? 32 : 128) - shift,
+                 family, *block);
+
+    if (shift == 128 || left == ((uint128) 1 << shift) - 1)
+        return false;
+
+    *current += (uint128) 1 << shift;
+    return true;
+}
+
+static inet*
+netblock_split6(netblock_context6 *ctx)
+{
+    inet *inet_ip;
+
+    if (!netblock_cut(&ctx->current[ctx->range], ctx->last[ctx->range],
+                      PGSQL_AF_INET6, &inet_ip))
+        ctx->range++;
+
+    return inet_ip;
+}
+
+/*
+ * IPv6 counterpart of netblock_acc and netblock_sub, returning the next
+ * block, or NULL after the last one. *bytes is set on the first call.
+ */
+static inet*
+netblock_next6(FunctionCallInfo fcinfo, bool sub, uint64 *bytes,
+               const char *prefix)
+{
+    FmgrInfo *fmgr_info = fcinfo->flinfo;
+    netblock_context6 *ctx = netblock_context_get(fmgr_info, PGSQL_AF_INET6);
+
+    if (ctx == NULL) {
+        inet *block[2];
+        uint128 first[2], last[2], tmp;
+
+        block[0] = PG_GETARG_INET_PP(0);
+        block[1] = PG_GETARG_INET_PP(1);
+        *bytes = VARSIZE_ANY_EXHDR(block[0]) + VARSIZE_ANY_EXHDR(block[1]);
+
+        if (ip_family(block[0]) != ip_family(block[1]))
+            elog(ERROR, "%scannot mix IPv4 and IPv6 blocks", prefix);
+
+        netblock_range(block[0], &first[0], &last[0]);
+        netblock_range(block[1], &first[1], &last[1]);
+
+        ctx = MemoryContextAllocZero(fmgr_info->fn_mcxt,
+                                     sizeof(netblock_context6));
+        ctx->family = PGSQL_AF_INET6;
+        fmgr_info->fn_extra = ctx;
+
+        if (sub) {
+            /* nothing unless the second block is inside the first */
+            if (first[1] >= first[0] && last[1] <= last[0]) {
+                if (first[1] > first[0])
+                    netblock_add_range6(ctx, first[0], first[1] - 1);
+                if (last[1] < last[0])
+                    netblock_add_range6(ctx, last[1] + 1, last[0]);
+            }
+        } else {
+            if (first[0] > first[1]) {
+                tmp = first[0]; first[0] = first[1]; first[1] = tmp;
+                tmp = last[0]; last[0] = last[1]; last[1] = tmp;
+            }
+
+            /* overlapping or adjacent blocks merge into one range */
+            if (first[1] <= last[0] || first[1] - 1 == last[0]) {
+                netblock_add_range6(ctx, first[0], Max(last[0], last[1]));
+            } else {
+                netblock_add_range6(ctx, first[0], last[0]);
+                netblock_add_range6(ctx, first[1], last[1]);
+            }
+        }
+    }
+
+    if (ctx->range < ctx->nranges)
+        return netblock_split6(ctx);
+
+    pfree(ctx);
+    fmgr_info->fn_extra = NULL;
+
+    return NULL;
+}
+
 PG_MODULE_MAGIC;
 
+void _PG_init(void);
+
+static ToysStatsEntry netblock_acc_stats = TOYS_STATS_ENTRY("netblock_acc");
+static ToysStatsEntry netblock_sub_stats = TOYS_STATS_ENTRY("netblock_sub");
+static ToysStatsEntry netblock_merge_stats = TOYS_STATS_ENTRY("netblock_merge");
+static ToysStatsEntry netblock_lpm_stats = TOYS_STATS_ENTRY("netblock_lpm");
+static ToysStatsEntry netblock_lpm_load_stats =
+    TOYS_STATS_ENTRY("netblock_lpm_load");
+
+void
+_PG_init(void)
+{
+    toys_stats_init("pg_netop", "pg_netop");
+
+    MarkGUCPrefixReserved("pg_netop");
+}
+
 PG_FUNCTION_INFO_V1(netblock_acc);
 Datum netblock_acc(PG_FUNCTION_ARGS);
 
@@ -79,6 +305,11 @@ netblock_acc(PG_FUNCTION_ARGS)
     FmgrInfo *fmgr_info = fcinfo->flinfo;
     ReturnSetInfo *resultInfo = (ReturnSetInfo *)fcinfo->resultinfo;
     netblock_context *ctx;
+    inet *result;
+    uint64 bytes = 0;
+    instr_time start;
+
+    toys_stats_begin(&start);
 
     if( fcinfo->resultinfo == NULL )
         elog(ERROR, EPREFIX "context does not accept a set result");
@@ -86,22 +317,31 @@ netblock_acc(PG_FUNCTION_ARGS)
     if( !IsA( fcinfo->resultinfo, ReturnSetInfo ))
         elog(ERROR, EPREFIX "context does not accept a set result");
 
-    if (fmgr_info->fn_extra == NULL) {
+    if ((ip_family(PG_GETARG_INET_PP(0)) != PGSQL_AF_INET) ||
+        (ip_family(PG_GETARG_INET_PP(1)) != PGSQL_AF_INET)) {
+        result = netblock_next6(fcinfo, false, &bytes, EPREFIX);
+        toys_stats_end(&netblock_acc_stats, &start, bytes, result != NULL);
+        if (result == NULL) {
+            resultInfo->isDone = ExprEndResult;
+            PG_RETURN_NULL();
+        }
+        resultInfo->isDone = ExprMultipleResult;
+        PG_RETURN_INET_P(result);
+    }
+
+    if (netblock_context_get(fmgr_info, PGSQL_AF_INET) == NULL) {
 
         inet *block[2], *tmp;
         int num[2];
 
         block[0] = DatumGetInetP(PG_GETARG_INET_P(0));
         block[1] = DatumGetInetP(PG_GETARG_INET_P(1));
+        bytes = VARSIZE_ANY_EXHDR(block[0]) + VARSIZE_ANY_EXHDR(block[1]);
 
-        if ((ip_family(block[0]) != PGSQL_AF_INET) ||
-            (ip_family(block[1]) != PGSQL_AF_INET)) {
-            elog(ERROR, EPREFIX "only IPv4 is supported");
-        }
-
-        fmgr_info->fn_extra = MemoryContextAlloc(fmgr_info->fn_mcxt,
-                                                 sizeof(netblock_context));
+        fmgr_info->fn_extra = MemoryContextAllocZero(fmgr_info->fn_mcxt,
+                                                     sizeof(netblock_context));
         ctx = (netblock_context *)fmgr_info->fn_extra;
+        ctx->family = PGSQL_AF_INET;
 
         num[0] = ip_to_int32(ip_addr(block[0]));
         num[1] = ip_to_int32(ip_addr(block[1]));
@@ -151,12 +391,15 @@ netblock_acc(PG_FUNCTION_ARGS)
         ctx->size = ctx->end[1] - ctx->start[1];
         ctx->shift = 0;
     }
-    if (ctx->current >= Max(ctx->end[0], ctx->end[1])) {
-        resultInfo->isDone = ExprEndResult;
-        PG_RETURN_NULL();
-    }
-    PG_RETURN_INET_P(netblock_split(ctx, resultInfo));
+    if (ctx->current >= Max(ctx->end[0], ctx->end[1]))
+        goto out;
+
+    result = netblock_split(ctx, resultInfo);
+    toys_stats_end(&netblock_acc_stats, &start, bytes, 1);
+    PG_RETURN_INET_P(result);
+
 out:
+    toys_stats_end(&netblock_acc_stats, &start, bytes, 0);
     pfree(fmgr_info->fn_extra);
     fmgr_info->fn_extra = NULL;
     resultInfo->isDone = ExprEndResult;
@@ -177,6 +420,11 @@ netblock_sub(PG_FUNCTION_ARGS)
     FmgrInfo *fmgr_info = fcinfo->flinfo;
     ReturnSetInfo *resultInfo = (ReturnSetInfo *)fcinfo->resultinfo;
     netblock_context *ctx;
+    inet *result;
+    uint64 bytes = 0;
+    instr_time start;
+
+    toys_stats_begin(&start);
 
     if( fcinfo->resultinfo == NULL )
         elog(ERROR, EPREFIX "context does not accept a set result");
@@ -184,20 +432,29 @@ netblock_sub(PG_FUNCTION_ARGS)
     if( !IsA( fcinfo->resultinfo, ReturnSetInfo ))
         elog(ERROR, EPREFIX "context does not accept a set result");
 
-    if (fmgr_info->fn_extra == NULL) {
+    if ((ip_family(PG_GETARG_INET_PP(0)) != PGSQL_AF_INET) ||
+        (ip_family(PG_GETARG_INET_PP(1)) != PGSQL_AF_INET)) {
+        result = netblock_next6(fcinfo, true, &bytes, EPREFIX);
+        toys_stats_end(&netblock_sub_stats, &start, bytes, result != NULL);
+        if (result == NULL) {
+            resultInfo->isDone = ExprEndResult;
+            PG_RETURN_NULL();
+        }
+        resultInfo->isDone = ExprMultipleResult;
+        PG_RETURN_INET_P(result);
+    }
+
+    if (netblock_context_get(fmgr_info, PGSQL_AF_INET) == NULL) {
         inet *block[2];
 
         block[0] = DatumGetInetP(PG_GETARG_INET_P(0));
         block[1] = DatumGetInetP(PG_GETARG_INET_P(1));
+        bytes = VARSIZE_ANY_EXHDR(block[0]) + VARSIZE_ANY_EXHDR(block[1]);
 
-        if ((ip_family(block[0]) != PGSQL_AF_INET) ||
-            (ip_family(block[1]) != PGSQL_AF_INET)) {
-            elog(ERROR, EPREFIX "only IPv4 is supported");
-        }
-
-        fmgr_info->fn_extra = MemoryContextAlloc(fmgr_info->fn_mcxt,
-                                                 sizeof(netblock_context));
+        fmgr_info->fn_extra = MemoryContextAllocZero(fmgr_info->fn_mcxt,
+                                                     sizeof(netblock_context));
         ctx = (netblock_context *)fmgr_info->fn_extra;
+        ctx->family = PGSQL_AF_INET;
 
         ctx->start[0] = ip_to_int32(ip_addr(block[0]));
         ctx->start[1] = ip_to_int32(ip_addr(block[1]));
@@ -233,9 +490,12 @@ netblock_sub(PG_FUNCTION_ARGS)
         elog(ERROR, EPREFIX "BUG");
     }
 
-    PG_RETURN_INET_P(netblock_split(ctx, resultInfo));
+    result = netblock_split(ctx, resultInfo);
+    toys_stats_end(&netblock_sub_stats, &start, bytes, 1);
+    PG_RETURN_INET_P(result);
 
 out:
+    toys_stats_end(&netblock_sub_stats, &start, bytes, 0);
     pfree(fmgr_info->fn_extra);
     fmgr_info->fn_extra = NULL;
     resultInfo->isDone = ExprEndResult;
@@ -244,4 +504,1013 @@ out:
     #undef EPREFIX
 }
 
+/*
+ * netblock_merge appends the blocks to a buffer of ranges and sorts and
+ * coalesces it when it is full, growing it only when that leaves it more
+ * than half full, so that the buffer stays near the size of the result.
+ * Combining two states is an append of one to the other.
+ */
+netblock_merge_state*
+netblock_merge_state_new(MemoryContext cxt, int maxranges)
+{
+    netblock_merge_state *state;
+
+    state = MemoryContextAlloc(cxt, sizeof(netblock_merge_state));
+    state->nranges = 0;
+    state->maxranges = Max(maxranges, NETBLOCK_MERGE_INIT);
+    state->ranges = MemoryContextAlloc(cxt,
+            sizeof(netblock_merge_range) * state->maxranges);
+
+    return state;
+}
+
+static int
+netblock_merge_cmp(const void *lhs, const void *rhs)
+{
+    const netblock_merge_range *l = lhs, *r = rhs;
+
+    if (l->family != r->family)
+        return l->family < r->family ? -1 : 1;
+    if (l->first != r->first)
+        return l->first < r->first ? -1 : 1;
+    return 0;
+}
+
+/* sort by family and start, then fold overlapping and adjacent ranges */
+void
+netblock_merge_compact(netblock_merge_state *state)
+{
+    netblock_merge_range *r = state->ranges, *last;
+    int i;
+
+    if (state->nranges < 2)
+        return;
+
+    qsort(r, state->nranges, sizeof(netblock_merge_range), netblock_merge_cmp);
+
+    for (i = 1, last = r; i < state->nranges; i++) {
+        if (r[i].family == last->family &&
+            (r[i].first <= last->last || r[i].first - 1 == last->last)) {
+            last->last = Max(last->last, r[i].last);
+        } else {
+            *++last = r[i];
+        }
+    }
+
+    state->nranges = last - r + 1;
+}
+
+void
+netblock_merge_add(netblock_merge_state *state, int family,
+                   uint128 first, uint128 last)
+{
+    if (state->nranges == state->maxranges) {
+        netblock_merge_compact(state);
+
+        if (state->nranges > state->maxranges / 2) {
+            if ((Size) state->maxranges * 2 * sizeof(netblock_merge_range)
+                    > MaxAllocSize)
+                elog(ERROR, "netblock_merge: too many disjoint blocks");
+
+            state->maxranges *= 2;
+            state->ranges = repalloc(state->ranges,
+                    sizeof(netblock_merge_range) * state->maxranges);
+        }
+    }
+
+    state->ranges[state->nranges].first = first;
+    state->ranges[state->nranges].last = last;
+    state->ranges[state->nranges].family = family;
+    state->nranges++;
+}
+
+/*
+ * Add the parts of first..last that no range of excl covers, excl being
+ * compacted. Returns how many ranges of excl lie before last, which a
+ * caller walking ranges in order no longer needs to look at.
+ */
+int
+netblock_add_gaps(netblock_merge_state *state, int family,
+                  uint128 first, uint128 last,
+                  const netblock_merge_range *excl, int n)
+{
+    uint128 current = first;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (excl[i].family < family ||
+            (excl[i].family == family && excl[i].last < current))
+            continue;
+
+        if (excl[i].family > family || excl[i].first > last)
+            break;
+
+        if (excl[i].first > current)
+            netblock_merge_add(state, family, current, excl[i].first - 1);
+
+        if (excl[i].last >= last)
+            return i;
+
+        current = excl[i].last + 1;
+    }
+
+    netblock_merge_add(state, family, current, last);
+
+    return i;
+}
+
+PG_FUNCTION_INFO_V1(netblock_merge_trans);
+PG_FUNCTION_INFO_V1(netblock_merge_combine);
+PG_FUNCTION_INFO_V1(netblock_merge_serialize);
+PG_FUNCTION_INFO_V1(netblock_merge_deserialize);
+PG_FUNCTION_INFO_V1(netblock_merge_final);
+Datum netblock_merge_trans(PG_FUNCTION_ARGS);
+Datum netblock_merge_combine(PG_FUNCTION_ARGS);
+Datum netblock_merge_serialize(PG_FUNCTION_ARGS);
+Datum netblock_merge_deserialize(PG_FUNCTION_ARGS);
+Datum netblock_merge_final(PG_FUNCTION_ARGS);
+
+Datum
+netblock_merge_trans(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcxt;
+    netblock_merge_state *state;
+    inet *block;
+    uint128 first, last;
+
+    if (!AggCheckCallContext(fcinfo, &aggcxt))
+        elog(ERROR, "netblock_merge_trans: called in non-aggregate context");
+
+    if (PG_ARGISNULL(0))
+        state = netblock_merge_state_new(aggcxt, 0);
+    else
+        state = (netblock_merge_state *)PG_GETARG_POINTER(0);
+
+    if (PG_ARGISNULL(1))
+        PG_RETURN_POINTER(state);
+
+    block = PG_GETARG_INET_PP(1);
+    netblock_range(block, &first, &last);
+    netblock_merge_add(state, ip_family(block), first, last);
+
+    PG_RETURN_POINTER(state);
+}
+
+Datum
+netblock_merge_combine(PG_FUNCTION_ARGS)
+{
+    MemoryContext aggcxt;
+    netblock_merge_state *state[2];
+    int i;
+
+    if (!AggCheckCallContext(fcinfo, &aggcxt))
+        elog(ERROR, "netblock_merge_combine: called in non-aggregate context");
+
+    state[0] = PG_ARGISNULL(0) ? NULL
+                               : (netblock_merge_state *)PG_GETARG_POINTER(0);
+    state[1] = PG_ARGISNULL(1) ? NULL
+                               : (netblock_merge_state *)PG_GETARG_POINTER(1);
+
+    if (state[1] == NULL)
+        PG_RETURN_POINTER(state[0]);
+
+    if (state[0] == NULL)
+        state[0] = netblock_merge_state_new(aggcxt, state[1]->nranges);
+
+    for (i = 0; i < state[1]->nranges; i++)
+        netblock_merge_add(state[0], state[1]->ranges[i].family,
+                           state[1]->ranges[i].first,
+                           state[1]->ranges[i].last);
+
+    PG_RETURN_POINTER(state[0]);
+}
+
+/* the number of ranges, then family, first and last of each, coalesced */
+Datum
+netblock_merge_serialize(PG_FUNCTION_ARGS)
+{
+    netblock_merge_state *state = (netblock_merge_state *)PG_GETARG_POINTER(0);
+    StringInfoData buf;
+    int i;
+
+    netblock_merge_compact(state);
+
+    pq_begintypsend(&buf);
+    pq_sendint32(&buf, state->nranges);
+
+    for (i = 0; i < state->nranges; i++) {
+        pq_sendbyte(&buf, state->ranges[i].family);
+        pq_sendint64(&buf, (uint64) (state->ranges[i].first >> 64));
+        pq_sendint64(&buf, (uint64) state->ranges[i].first);
+        pq_sendint64(&buf, (uint64) (state->ranges[i].last >> 64));
+        pq_sendint64(&buf, (uint64) state->ranges[i].last);
+    }
+
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+Datum
+netblock_merge_deserialize(PG_FUNCTION_ARGS)
+{
+    bytea *sstate = PG_GETARG_BYTEA_PP(0);
+    MemoryContext aggcxt;
+    netblock_merge_state *state;
+    StringInfoData buf;
+    uint128 first, last;
+    int family, nranges;
+
+    if (!AggCheckCallContext(fcinfo, &aggcxt))
+        elog(ERROR, "netblock_merge_deserialize: called in non-aggregate context");
+
+    initStringInfo(&buf);
+    appendBinaryStringInfo(&buf,
+            VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
+
+    nranges = (int) pq_getmsgint(&buf, 4);
+    state = netblock_merge_state_new(aggcxt, nranges);
+
+    while (nranges-- > 0) {
+        family = pq_getmsgbyte(&buf);
+        first = (uint128) (uint64) pq_getmsgint64(&buf) << 64;
+        first |= (uint64) pq_getmsgint64(&buf);
+        last = (uint128) (uint64) pq_getmsgint64(&buf) << 64;
+        last |= (uint64) pq_getmsgint64(&buf);
+
+        netblock_merge_add(state, family, first, last);
+    }
+
+    pq_getmsgend(&buf);
+    pfree(buf.data);
+
+    PG_RETURN_POINTER(state);
+}
+
+/* the fewest blocks covering the same addresses, IPv4 first, as cidr[] */
+Datum
+netblock_merge_final(PG_FUNCTION_ARGS)
+{
+    netblock_merge_state *state;
+    netblock_merge_range *r;
+    Datum *elems;
+    inet *inet_ip;
+    uint128 current;
+    int i, n = 0, maxelems;
+    bool more;
+    instr_time start;
+
+    if (PG_ARGISNULL(0))
+        PG_RETURN_NULL();
+
+    toys_stats_begin(&start);
+
+    state = (netblock_merge_state *)PG_GETARG_POINTER(0);
+    netblock_merge_compact(state);
+
+    maxelems = Max(state->nranges, 1);
+    elems = palloc(sizeof(Datum) * maxelems);
+
+    for (i = 0; i < state->nranges; i++) {
+        r = &state->ranges[i];
+        current = r->first;
+
+        do {
+            if (n == maxelems) {
+                maxelems *= 2;
+                elems = repalloc(elems, sizeof(Datum) * maxelems);
+            }
+
+            more = netblock_cut(&current, r->last, r->family, &inet_ip);
+            elems[n++] = InetPGetDatum(inet_ip);
+        } while (more);
+    }
+
+    toys_stats_end(&netblock_merge_stats, &start, 0, n);
+
+    PG_RETURN_ARRAYTYPE_P(construct_array(elems, n, CIDROID,
+                                          -1, false, TYPALIGN_INT));
+}
+
+/*
+ * netblock_sub with many exclusions: they are clipped to the block, merged
+ * as by netblock_merge, and the gaps between them are split in one walk.
+ * Exclusions of the other family, or NULL, exclude nothing.
+ */
+typedef struct {
+    netblock_merge_state *gaps;
+    int range, family;
+    uint128 current;
+} netblock_sub_context;
+
+static netblock_sub_context*
+netblock_sub_gaps(FunctionCallInfo fcinfo, uint64 *bytes)
+{
+    MemoryContext cxt = fcinfo->flinfo->fn_mcxt;
+    netblock_sub_context *ctx;
+    netblock_merge_state *excl;
+    inet *block, *ex;
+    ArrayType *arr;
+    Datum *elems;
+    bool *nulls;
+    uint128 first, last, exfirst, exlast;
+    int i, n;
+
+    block = PG_GETARG_INET_PP(0);
+    arr = PG_GETARG_ARRAYTYPE_P(1);
+    *bytes = VARSIZE_ANY_EXHDR(block) + VARSIZE_ANY_EXHDR(arr);
+
+    netblock_range(block, &first, &last);
+
+    deconstruct_array(arr, CIDROID, -1, false, TYPALIGN_INT,
+                      &elems, &nulls, &n);
+
+    excl = netblock_merge_state_new(CurrentMemoryContext, n);
+
+    for (i = 0; i < n; i++) {
+        if (nulls[i])
+            continue;
+
+        ex = DatumGetInetPP(elems[i]);
+        if (ip_family(ex) != ip_family(block))
+            continue;
+
+        netblock_range(ex, &exfirst, &exlast);
+        if (exlast < first || exfirst > last)
+            continue;
+
+        netblock_merge_add(excl, ip_family(block),
+                           Max(exfirst, first), Min(exlast, last));
+    }
+
+    netblock_merge_compact(excl);
+
+    ctx = MemoryContextAlloc(cxt, sizeof(netblock_sub_context));
+    ctx->gaps = netblock_merge_state_new(cxt, excl->nranges + 1);
+    ctx->range = 0;
+    ctx->family = ip_family(block);
+
+    netblock_add_gaps(ctx->gaps, ctx->family, first, last,
+                      excl->ranges, excl->nranges);
+
+    if (ctx->gaps->nranges > 0)
+        ctx->current = ctx->gaps->ranges[0].first;
+
+    return ctx;
+}
+
+PG_FUNCTION_INFO_V1(netblock_sub_array);
+Datum netblock_sub_array(PG_FUNCTION_ARGS);
+
+Datum
+netblock_sub_array(PG_FUNCTION_ARGS)
+{
+    #define EPREFIX "netblock_sub: "
+
+    FmgrInfo *fmgr_info = fcinfo->flinfo;
+    ReturnSetInfo *resultInfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    netblock_sub_context *ctx;
+    netblock_merge_range *r;
+    inet *result;
+    uint64 bytes = 0;
+    instr_time start;
+
+    toys_stats_begin(&start);
+
+    if( fcinfo->resultinfo == NULL )
+        elog(ERROR, EPREFIX "context does not accept a set result");
+
+    if( !IsA( fcinfo->resultinfo, ReturnSetInfo ))
+        elog(ERROR, EPREFIX "context does not accept a set result");
+
+    if (fmgr_info->fn_extra == NULL)
+        fmgr_info->fn_extra = netblock_sub_gaps(fcinfo, &bytes);
+
+    ctx = (netblock_sub_context *)fmgr_info->fn_extra;
+
+    if (ctx->range >= ctx->gaps->nranges) {
+        toys_stats_end(&netblock_sub_stats, &start, bytes, 0);
+        pfree(ctx->gaps->ranges);
+        pfree(ctx->gaps);
+        pfree(ctx);
+        fmgr_info->fn_extra = NULL;
+        resultInfo->isDone = ExprEndResult;
+        PG_RETURN_NULL();
+    }
+
+    r = &ctx->gaps->ranges[ctx->range];
+    if (!netblock_cut(&ctx->current, r->last, ctx->family, &result)) {
+        if (++ctx->range < ctx->gaps->nranges)
+            ctx->current = ctx->gaps->ranges[ctx->range].first;
+    }
+
+    toys_stats_end(&netblock_sub_stats, &start, bytes, 1);
+    resultInfo->isDone = ExprMultipleResult;
+    PG_RETURN_INET_P(result);
+
+    #undef EPREFIX
+}
+
+/*
+ * Longest prefix match against a table of prefixes, in a path-compressed
+ * binary trie per family built once per table and backend. A node holds
+ * the bits all prefixes below it share; a lookup goes down by the bit
+ * after them, keeps the key of the last node carrying one, and stops at
+ * the first node whose bits the address does not share. The depth is at
+ * most the number of distinct prefix lengths, 33 for IPv4.
+ *
+ * A table is tracked once netblock_lpm_load has put its statement trigger
+ * on it: every write then invalidates the relcache entry of the table, as
+ * ALTER, TRUNCATE and DROP do anyway, and the invalidation marks the trie
+ * stale in every backend, to be rebuilt at the next lookup. The trie of a
+ * tracked table is kept for the backend, that of any other table is built
+ * for the call site and lasts the query. Whoever fetches a trie needs
+ * SELECT on the table, and tables under row level security are refused,
+ * as a trie built by one user would answer for the rows of another.
+ */
+typedef struct {
+    uint128 prefix;             /* left-aligned, the bits past bits zero */
+    int32 child[2];             /* -1 for none */
+    int bits;
+    bool has_key;
+    int64 key;
+} netblock_lpm_node;
+
+typedef struct netblock_lpm_trie {
+    struct netblock_lpm_trie *next;
+    MemoryContext cxt;
+    Oid relid;
+    NameData prefixcol, keycol;
+    bool stale;
+    LocalTransactionId lxid;    /* of a build on a transaction snapshot */
+    int32 root[2];              /* IPv4, IPv6 */
+    int nnodes, maxnodes;
+    netblock_lpm_node *nodes;
+    int64 nprefixes;
+} netblock_lpm_trie;
+
+/* what a call site keeps of the trie it used last */
+typedef struct {
+    Oid relid;
+    Oid userid;
+    uint64 generation;
+    bool owned;                 /* built for the call site, not tracked */
+    netblock_lpm_trie *trie;
+} netblock_lpm_cache;
+
+#define NETBLOCK_LPM_FETCH 10000
+
+static netblock_lpm_trie *netblock_lpm_tries = NULL;
+static uint64 netblock_lpm_generation = 0;
+static bool netblock_lpm_callback = false;
+
+/* the table being read into a trie, and whether it changed meanwhile */
+static Oid netblock_lpm_building = InvalidOid;
+static bool netblock_lpm_building_stale = false;
+
+/* a trie is only marked here, it may be in use by a lookup */
+static void
+netblock_lpm_relcache_callback(Datum arg, Oid relid)
+{
+    netblock_lpm_trie *trie;
+
+    if (relid == InvalidOid || relid == netblock_lpm_building)
+        netblock_lpm_building_stale = true;
+
+    for (trie = netblock_lpm_tries; trie != NULL; trie = trie->next) {
+        if (relid == InvalidOid || relid == trie->relid) {
+            trie->stale = true;
+            netblock_lpm_generation++;
+        }
+    }
+}
+
+static inline
+int lpm_bit(uint128 x, int pos) {
+    return (int) (x >> (127 - pos)) & 1;
+}
+
+static inline
+uint128 lpm_mask(int bits) {
+    return bits == 0 ? 0 : ~(uint128) 0 << (128 - bits);
+}
+
+static int32
+netblock_lpm_node_new(netblock_lpm_trie *trie, uint128 prefix, int bits)
+{
+    netblock_lpm_node *node;
+
+    if (trie->nnodes == trie->maxnodes) {
+        if ((Size) trie->maxnodes * 2 * sizeof(netblock_lpm_node)
+                > MaxAllocSize)
+            elog(ERROR, "netblock_lpm_load: too many prefixes");
+
+        trie->maxnodes *= 2;
+        trie->nodes = repalloc(trie->nodes,
+                sizeof(netblock_lpm_node) * trie->maxnodes);
+    }
+
+    node = &trie->nodes[trie->nnodes];
+    node->prefix = prefix;
+    node->bits = bits;
+    node->child[0] = node->child[1] = -1;
+    node->has_key = false;
+    node->key = 0;
+
+    return trie->nnodes++;
+}
+
+/* of a prefix in the table twice, the lower key is kept */
+static inline
+void lpm_set_key(netblock_lpm_node *node, int64 key) {
+    if (!node->has_key || key < node->key) {
+        node->has_key = true;
+        node->key = key;
+    }
+}
+
+/*
+ * Indexes rather than pointers link the nodes, the array moves as it
+ * grows; the slot a new node goes to is a child of parent, or the root.
+ */
+static void
+netblock_lpm_insert(netblock_lpm_trie *trie, int f, uint128 prefix,
+                    int bits, int64 key)
+{
+    netblock_lpm_node *node;
+    uint128 diff;
+    int32 parent = -1, idx, branch, leaf;
+    int side = 0, common;
+
+    for (;;) {
+        idx = parent < 0 ? trie->root[f] : trie->nodes[parent].child[side];
+
+        if (idx < 0) {
+            branch = netblock_lpm_node_new(trie, prefix, bits);
+            lpm_set_key(&trie->nodes[branch], key);
+            break;
+        }
+
+        node = &trie->nodes[idx];
+        diff = prefix ^ node->prefix;
+        common = diff == 0 ? 128 : 127 - msb128(diff);
+        common = Min(common, Min(bits, node->bits));
+
+        if (common == node->bits) {
+            if (bits == node->bits) {
+                lpm_set_key(node, key);
+                return;
+            }
+
+            parent = idx;
+            side = lpm_bit(prefix, node->bits);
+            continue;
+        }
+
+        /* the prefix parts from the node above it */
+        if (common == bits) {
+            branch = netblock_lpm_node_new(trie, prefix, bits);
+            lpm_set_key(&trie->nodes[branch], key);
+        } else {
+            branch = netblock_lpm_node_new(trie, prefix & lpm_mask(common),
+                                           common);
+            leaf = netblock_lpm_node_new(trie, prefix, bits);
+            lpm_set_key(&trie->nodes[leaf], key);
+            trie->nodes[branch].child[lpm_bit(prefix, common)] = leaf;
+        }
+
+        trie->nodes[branch].child[lpm_bit(trie->nodes[idx].prefix, common)]
+            = idx;
+        break;
+    }
+
+    if (parent < 0)
+        trie->root[f] = branch;
+    else
+        trie->nodes[parent].child[side] = branch;
+}
+
+/* the key of the longest prefix holding the network addr/bits */
+static bool
+netblock_lpm_find(netblock_lpm_trie *trie, int f, uint128 addr, int bits,
+                  int64 *key)
+{
+    netblock_lpm_node *node;
+    int32 idx = trie->root[f];
+    bool found = false;
+
+    while (idx >= 0) {
+        node = &trie->nodes[idx];
+
+        if (node->bits > bits ||
+            ((addr ^ node->prefix) & lpm_mask(node->bits)) != 0)
+            break;
+
+        if (node->has_key) {
+            *key = node->key;
+            found = true;
+        }
+
+        if (node->bits == 128)
+            break;
+
+        idx = node->child[lpm_bit(addr, node->bits)];
+    }
+
+    return found;
+}
+
+/*
+ * Read the table through a cursor into a new trie, made in the current
+ * context so that an error leaves nothing behind; the caller moves it to
+ * where it is kept. The cursor takes a snapshot of its own, and a write to
+ * the table seen by the relcache callback while it is read leaves the trie
+ * stale from the start. A trie read on a transaction snapshot is only good
+ * for the transaction.
+ */
+static netblock_lpm_trie*
+netblock_lpm_build(Oid relid, const char *prefixcol, const char *keycol,
+                   const char *prefix)
+{
+    MemoryContext cxt;
+    netblock_lpm_trie *trie;
+    SPIPlanPtr plan;
+    Portal portal;
+    inet *block;
+    uint128 first, last;
+    int64 key;
+    uint64 row;
+    bool isnull;
+    char *query;
+
+    if (get_attnum(relid, prefixcol) == InvalidAttrNumber ||
+        get_attnum(relid, keycol) == InvalidAttrNumber)
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_COLUMN),
+                 errmsg("%scolumn \"%s\" of relation \"%s\" does not exist",
+                        prefix,
+                        get_attnum(relid, prefixcol) == InvalidAttrNumber
+                            ? prefixcol : keycol,
+                        get_rel_name(relid))));
+
+    cxt = AllocSetContextCreate(CurrentMemoryContext, "pg_netop lpm",
+                                ALLOCSET_DEFAULT_SIZES);
+
+    trie = MemoryContextAllocZero(cxt, sizeof(netblock_lpm_trie));
+    trie->cxt = cxt;
+    trie->relid = relid;
+    namestrcpy(&trie->prefixcol, prefixcol);
+    namestrcpy(&trie->keycol, keycol);
+    trie->root[0] = trie->root[1] = -1;
+    trie->maxnodes = NETBLOCK_MERGE_INIT;
+    trie->nodes = MemoryContextAlloc(cxt,
+            sizeof(netblock_lpm_node) * trie->maxnodes);
+
+    query = psprintf("select %s::cidr, %s::int8 from %s "
+                     "where %s is not null and %s is not null",
+                     quote_identifier(prefixcol), quote_identifier(keycol),
+                     quote_qualified_identifier(
+                         get_namespace_name(get_rel_namespace(relid)),
+                         get_rel_name(relid)),
+                     quote_identifier(prefixcol), quote_identifier(keycol));
+
+    netblock_lpm_building = relid;
+    netblock_lpm_building_stale = false;
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        elog(ERROR, "%sSPI_connect failed", prefix);
+
+    if ((plan = SPI_prepare(query, 0, NULL)) == NULL)
+        elog(ERROR, "%sSPI_prepare(\"%s\") failed", prefix, query);
+
+    portal = SPI_cursor_open(NULL, plan, NULL, NULL, false);
+
+    for (;;) {
+        SPI_cursor_fetch(portal, true, NETBLOCK_LPM_FETCH);
+        if (SPI_processed == 0)
+            break;
+
+        for (row = 0; row < SPI_processed; row++) {
+            HeapTuple tuple = SPI_tuptable->vals[row];
+            TupleDesc tupdesc = SPI_tuptable->tupdesc;
+
+            block = DatumGetInetPP(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+            key = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+
+            netblock_range(block, &first, &last);
+            netblock_lpm_insert(trie,
+                                ip_family(block) == PGSQL_AF_INET ? 0 : 1,
+                                ip_family(block) == PGSQL_AF_INET
+                                    ? first << 96 : first,
+                                ip_bits(block), key);
+            trie->nprefixes++;
+        }
+
+        SPI_freetuptable(SPI_tuptable);
+    }
+
+    SPI_cursor_close(portal);
+    SPI_finish();
+
+    trie->stale = netblock_lpm_building_stale;
+    trie->lxid = IsolationUsesXactSnapshot() ? MyProc->lxid
+                                             : InvalidLocalTransactionId;
+    netblock_lpm_building = InvalidOid;
+
+    return trie;
+}
+
+PG_FUNCTION_INFO_V1(netblock_lpm_invalidate);
+Datum netblock_lpm_invalidate(PG_FUNCTION_ARGS);
+
+/*
+ * AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE FOR EACH STATEMENT trigger
+ * made by netblock_lpm_load, with the prefix and key columns as arguments.
+ * The invalidation reaches the other backends when the transaction
+ * commits, and this one at the end of the statement.
+ */
+Datum
+netblock_lpm_invalidate(PG_FUNCTION_ARGS)
+{
+    TriggerData *trigdata = (TriggerData *)fcinfo->context;
+
+    if (!CALLED_AS_TRIGGER(fcinfo))
+        elog(ERROR, "netblock_lpm_invalidate: not called by trigger manager");
+
+    CacheInvalidateRelcache(trigdata->tg_relation);
+
+    return PointerGetDatum(NULL);
+}
+
+/*
+ * Whether rel carries a netblock_lpm_invalidate trigger firing on every
+ * write, also in replication, and the columns it names if so.
+ */
+static bool
+netblock_lpm_tracked(Relation rel, char **prefixcol, char **keycol)
+{
+    TriggerDesc *trigdesc = rel->trigdesc;
+    Trigger *trigger;
+    FmgrInfo flinfo;
+    int i;
+
+    for (i = 0; trigdesc != NULL && i < trigdesc->numtriggers; i++) {
+        trigger = &trigdesc->triggers[i];
+
+        if (trigger->tgenabled != TRIGGER_FIRES_ALWAYS ||
+            trigger->tgnargs != 2 ||
+            !TRIGGER_FOR_AFTER(trigger->tgtype) ||
+            TRIGGER_FOR_ROW(trigger->tgtype) ||
+            !TRIGGER_FOR_INSERT(trigger->tgtype) ||
+            !TRIGGER_FOR_UPDATE(trigger->tgtype) ||
+            !TRIGGER_FOR_DELETE(trigger->tgtype) ||
+            !TRIGGER_FOR_TRUNCATE(trigger->tgtype) ||
+            get_func_lang(trigger->tgfoid) != ClanguageId)
+            continue;
+
+        fmgr_info(trigger->tgfoid, &flinfo);
+        if (flinfo.fn_addr != netblock_lpm_invalidate)
+            continue;
+
+        *prefixcol = pstrdup(trigger->tgargs[0]);
+        *keycol = pstrdup(trigger->tgargs[1]);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * The trie of the table, for a user who may read it. That of a tracked
+ * table is kept for the backend and built when missing, stale or asked
+ * to, of the columns its trigger names. That of any other table, of the
+ * columns prefix and id, is built under cxt and *owned is set.
+ */
+static netblock_lpm_trie*
+netblock_lpm_get(Oid relid, bool rebuild, MemoryContext cxt, bool *owned,
+                 const char *prefix)
+{
+    netblock_lpm_trie *trie, *old, **link;
+    Relation rel;
+    AclResult aclresult;
+    char *prefixcol = "prefix", *keycol = "id";
+    bool tracked;
+
+    if (!netblock_lpm_callback) {
+        CacheRegisterRelcacheCallback(netblock_lpm_relcache_callback,
+                                      (Datum) 0);
+        netblock_lpm_callback = true;
+    }
+
+    AcceptInvalidationMessages();
+
+    rel = try_relation_open(relid, AccessShareLock);
+    if (rel == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_TABLE),
+                 errmsg("%srelation with OID %u does not exist",
+                        prefix, relid)));
+
+    aclresult = pg_class_aclcheck(relid, GetUserId(), ACL_SELECT);
+    if (aclresult != ACLCHECK_OK)
+        aclcheck_error(aclresult, get_relkind_objtype(rel->rd_rel->relkind),
+                       RelationGetRelationName(rel));
+
+    if (check_enable_rls(relid, InvalidOid, true) == RLS_ENABLED)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("%srelation \"%s\" has row level security enabled",
+                        prefix, RelationGetRelationName(rel))));
+
+    tracked = netblock_lpm_tracked(rel, &prefixcol, &keycol);
+
+    relation_close(rel, NoLock);
+
+    *owned = !tracked;
+    if (!tracked) {
+        trie = netblock_lpm_build(relid, prefixcol, keycol, prefix);
+        MemoryContextSetParent(trie->cxt, cxt);
+        return trie;
+    }
+
+    for (link = &netblock_lpm_tries; *link != NULL; link = &(*link)->next)
+        if ((*link)->relid == relid)
+            break;
+
+    old = *link;
+    if (old != NULL && !rebuild && !old->stale &&
+        (old->lxid == InvalidLocalTransactionId || old->lxid == MyProc->lxid) &&
+        strcmp(NameStr(old->prefixcol), prefixcol) == 0 &&
+        strcmp(NameStr(old->keycol), keycol) == 0)
+        return old;
+
+    trie = netblock_lpm_build(relid, prefixcol, keycol, prefix);
+    MemoryContextSetParent(trie->cxt, CacheMemoryContext);
+
+    /* the query of the build may have loaded the table, find it again */
+    for (link = &netblock_lpm_tries; *link != NULL; link = &(*link)->next)
+        if ((*link)->relid == relid)
+            break;
+
+    trie->next = *link ? (*link)->next : NULL;
+    if (*link != NULL)
+        MemoryContextDelete((*link)->cxt);
+    *link = trie;
+
+    netblock_lpm_generation++;
+
+    return trie;
+}
+
+PG_FUNCTION_INFO_V1(netblock_lpm_load);
+Datum netblock_lpm_load(PG_FUNCTION_ARGS);
+
+/*
+ * Track the table with its prefix and key columns, putting the trigger on
+ * it unless it is there already, and (re)build its trie, returning the
+ * number of prefixes.
+ */
+Datum
+netblock_lpm_load(PG_FUNCTION_ARGS)
+{
+    #define EPREFIX "netblock_lpm_load: "
+
+    Oid relid = PG_GETARG_OID(0);
+    char *prefixcol = NameStr(*PG_GETARG_NAME(1));
+    char *keycol = NameStr(*PG_GETARG_NAME(2));
+    char *oldprefixcol, *oldkeycol, *relname, *function;
+    netblock_lpm_trie *trie;
+    Relation rel;
+    int64 nprefixes;
+    bool tracked, owned;
+    instr_time start;
+
+    toys_stats_begin(&start);
+
+    rel = try_relation_open(relid, AccessShareLock);
+    if (rel == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_TABLE),
+                 errmsg(EPREFIX "relation with OID %u does not exist",
+                        relid)));
+
+    tracked = netblock_lpm_tracked(rel, &oldprefixcol, &oldkeycol);
+    relname = quote_qualified_identifier(
+            get_namespace_name(RelationGetNamespace(rel)),
+            RelationGetRelationName(rel));
+
+    relation_close(rel, NoLock);
+
+    if (get_attnum(relid, prefixcol) == InvalidAttrNumber ||
+        get_attnum(relid, keycol) == InvalidAttrNumber)
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_COLUMN),
+                 errmsg(EPREFIX "column \"%s\" of relation \"%s\" does not "
+                        "exist",
+                        get_attnum(relid, prefixcol) == InvalidAttrNumber
+                            ? prefixcol : keycol,
+                        get_rel_name(relid))));
+
+    if (!tracked || strcmp(oldprefixcol, prefixcol) != 0 ||
+        strcmp(oldkeycol, keycol) != 0) {
+        function = quote_qualified_identifier(
+                get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)),
+                "netblock_lpm_invalidate");
+
+        if (SPI_connect() != SPI_OK_CONNECT)
+            elog(ERROR, EPREFIX "SPI_connect failed");
+
+        if (SPI_execute(psprintf("drop trigger if exists "
+                                 "netblock_lpm_invalidate on %s", relname),
+                        false, 0) != SPI_OK_UTILITY ||
+            SPI_execute(psprintf("create trigger netblock_lpm_invalidate "
+                                 "after insert or update or delete or "
+                                 "truncate on %s for each statement execute "
+                                 "function %s(%s, %s)", relname, function,
+                                 quote_literal_cstr(prefixcol),
+                                 quote_literal_cstr(keycol)),
+                        false, 0) != SPI_OK_UTILITY ||
+            SPI_execute(psprintf("alter table %s enable always trigger "
+                                 "netblock_lpm_invalidate", relname),
+                        false, 0) != SPI_OK_UTILITY)
+            elog(ERROR, EPREFIX "cannot put the trigger on %s", relname);
+
+        SPI_finish();
+
+        CommandCounterIncrement();
+    }
+
+    trie = netblock_lpm_get(relid, true, CurrentMemoryContext, &owned,
+                            EPREFIX);
+    nprefixes = trie->nprefixes;
+
+    if (owned)
+        MemoryContextDelete(trie->cxt);
+
+    toys_stats_end(&netblock_lpm_load_stats, &start, 0, nprefixes);
+
+    PG_RETURN_INT64(nprefixes);
+
+    #undef EPREFIX
+}
+
+PG_FUNCTION_INFO_V1(netblock_lpm);
+Datum netblock_lpm(PG_FUNCTION_ARGS);
+
+/*
+ * The key of the longest prefix of the table holding the inet, as
+ * inet <<= prefix order by masklen(prefix) desc limit 1 finds it, or NULL.
+ */
+Datum
+netblock_lpm(PG_FUNCTION_ARGS)
+{
+    #define EPREFIX "netblock_lpm: "
+
+    FmgrInfo *fmgr_info = fcinfo->flinfo;
+    netblock_lpm_cache *cache = (netblock_lpm_cache *)fmgr_info->fn_extra;
+    Oid relid = PG_GETARG_OID(0);
+    inet *ip = PG_GETARG_INET_PP(1);
+    uint128 first, last;
+    int64 key;
+    bool found;
+    instr_time start;
+
+    toys_stats_begin(&start);
+
+    if (cache == NULL) {
+        cache = MemoryContextAllocZero(fmgr_info->fn_mcxt,
+                                       sizeof(netblock_lpm_cache));
+        fmgr_info->fn_extra = cache;
+    }
+
+    if (cache->trie == NULL || cache->relid != relid ||
+        cache->userid != GetUserId() ||
+        cache->generation != netblock_lpm_generation) {
+        if (cache->trie != NULL && cache->owned)
+            MemoryContextDelete(cache->trie->cxt);
+        cache->trie = NULL;
+
+        cache->trie = netblock_lpm_get(relid, false, fmgr_info->fn_mcxt,
+                                       &cache->owned, EPREFIX);
+        cache->relid = relid;
+        cache->userid = GetUserId();
+        cache->generation = netblock_lpm_generation;
+    }
+
+    netblock_range(ip, &first, &last);
+
+    if (ip_family(ip) == PGSQL_AF_INET)
+        found = netblock_lpm_find(cache->trie, 0, first << 96, ip_bits(ip),
+                                  &key);
+    else
+        found = netblock_lpm_find(cache->trie, 1, first, ip_bits(ip), &key);
+
+    toys_stats_end(&netblock_lpm_stats, &start, VARSIZE_ANY_EXHDR(ip), found);
+
+    if (!found)
+        PG_RETURN_NULL();
+
+    PG_RETURN_INT64(key);
+
+    #undef EPREFIX
+}
+
 // vim: ts=4 sw=4 et cindent
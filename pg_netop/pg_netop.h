@@ -0,0 +1,59 @@
+/* author: jianing yang <jianingy.yang@gmail.com> */
+
+#ifndef PG_NETOP_H
+#define PG_NETOP_H
+
+#include <postgres.h>
+#include <fmgr.h>
+#include <utils/inet.h>
+
+/* IPv6 blocks, and merged blocks of either family, are 128-bit ranges */
+#ifndef HAVE_INT128
+#error "pg_netop needs a compiler with 128-bit integers"
+#endif
+
+#define ip_family(inetptr) \
+	(((inet_struct *) VARDATA_ANY(inetptr))->family)
+
+#define ip_bits(inetptr) \
+	(((inet_struct *) VARDATA_ANY(inetptr))->bits)
+
+#define ip_addr(inetptr) \
+	(((inet_struct *) VARDATA_ANY(inetptr))->ipaddr)
+
+#define ip_maxbits(inetptr) \
+	(ip_family(inetptr) == PGSQL_AF_INET ? 32 : 128)
+
+/*
+ * An inclusive range of addresses of one family, and a buffer of them as
+ * kept by netblock_merge. Compacted, the ranges are sorted by family, IPv4
+ * first, then by start, and neither overlap nor touch.
+ */
+typedef struct {
+    uint128 first, last;
+    int family;
+} netblock_merge_range;
+
+typedef struct {
+    int nranges, maxranges;
+    netblock_merge_range *ranges;
+} netblock_merge_state;
+
+#define NETBLOCK_MERGE_INIT 64
+
+extern void netblock_range(inet *block, uint128 *first, uint128 *last);
+extern bool netblock_cut(uint128 *current, uint128 last, int family,
+                         inet **block);
+
+extern netblock_merge_state *netblock_merge_state_new(MemoryContext cxt,
+                                                      int maxranges);
+extern void netblock_merge_compact(netblock_merge_state *state);
+extern void netblock_merge_add(netblock_merge_state *state, int family,
+                               uint128 first, uint128 last);
+extern int netblock_add_gaps(netblock_merge_state *state, int family,
+                             uint128 first, uint128 last,
+                             const netblock_merge_range *excl, int n);
+
+#endif
+
+// vim: ts=4 sw=4 et cindent
@@ -1,5 +1,60 @@
 select netblock_sub('1.0.0.0/8'::cidr, '1.0.4.0/26'::cidr);
 select netblock_sub('218.88.0.0/13'::cidr, '218.94.0.0/17'::cidr);
+select netblock_sub('10.0.0.0/8'::cidr, array['10.0.0.0/24', '10.0.0.128/25', '10.255.255.255/32', '9.0.0.0/7', '2001:db8::/32', NULL]::cidr[]);
+select netblock_sub('10.0.0.0/24'::cidr, array['10.0.0.0/16']::cidr[]);
+select netblock_sub('10.0.0.0/30'::cidr, '{}'::cidr[]);
+select netblock_sub('2001:db8::/32'::cidr, array['2001:db8::/48', '2001:db8:1::/48', '2001:db8:ffff::/48']::cidr[]);
 select netblock_acc('192.168.1.0/24'::cidr, '192.168.0.0/24'::cidr);
 select netblock_acc('192.168.1.0/25'::cidr, '192.168.1.128/25'::cidr);
 select netblock_acc(NULL::cidr, '192.168.1.128/25'::cidr);
+select netblock_sub('2001:db8::/32'::cidr, '2001:db8:0:4::/64'::cidr);
+select netblock_sub('::/0'::cidr, '::/1'::cidr);
+select netblock_acc('2001:db8::/33'::cidr, '2001:db8:8000::/33'::cidr);
+select netblock_acc('2001:db8:1::/48'::cidr, '2001:db8::/48'::cidr);
+select netblock_acc('2001:db8::/48'::cidr, '2001:db8:5::/48'::cidr);
+select netblock_acc(a, b) from (values ('10.0.0.0/24'::cidr, '10.0.1.0/24'::cidr), ('2001:db8::/33', '2001:db8:8000::/33'), ('192.168.0.0/24', '192.168.2.0/24')) v(a, b);
+select netblock_sub(a, b) from (values ('10.0.0.0/24'::cidr, '10.0.0.0/26'::cidr), ('2001:db8::/32', '2001:db8::/34'), ('10.0.0.0/30', '10.0.0.1/32')) v(a, b);
+select netblock_merge(b) from (values ('192.168.0.0/24'::cidr), ('192.168.1.0/24'), ('192.168.3.0/24'), ('192.168.3.128/25'), (NULL)) t(b);
+select netblock_merge(b) from (values ('10.0.0.0/8'::cidr), ('2001:db8::/33'), ('2001:db8:8000::/33'), ('11.0.0.0/8')) t(b);
+select netblock_merge(b) from (values (NULL::cidr)) t(b);
+select '{10.0.1.0/24, 10.0.0.0/24, 2001:db8::/32, 10.0.0.128/25}'::ipset;
+select '{}'::ipset, '{0.0.0.0/0, ::/0}'::ipset;
+select ipset(array['192.168.0.0/24', NULL, '192.168.1.0/24']::cidr[]), '10.0.0.0/8'::cidr::ipset;
+select ipset_agg(b) from (values ('192.168.0.0/24'::cidr), ('192.168.1.0/24'), ('2001:db8::/33'), ('2001:db8:8000::/33')) t(b);
+select '{10.0.0.0/24, 2001:db8::/64}'::ipset + '{10.0.1.0/24}'::ipset;
+select '{10.0.0.0/16, 2001:db8::/32}'::ipset * '{10.0.5.0/24, 10.1.0.0/16, 2001:db8::/48}'::ipset;
+select '{10.0.0.0/16, 2001:db8::/32}'::ipset - '{10.0.0.0/24, 10.0.128.0/17, ::/0}'::ipset;
+select '{10.0.0.0/16}'::ipset >> '10.0.4.1'::inet, '{10.0.0.0/16}'::ipset >> '10.0.0.0/8'::inet, '{10.0.0.0/16}'::ipset >> '2001:db8::1'::inet;
+select '{10.0.0.0/16}'::ipset && '{10.0.255.0/24}'::ipset, '{10.0.0.0/16}'::ipset && '{10.1.0.0/16}'::ipset;
+select '{10.0.0.0/25, 10.0.0.128/25}'::ipset = '{10.0.0.0/24}'::ipset;
+create temp table ipset_pools (id int, pool ipset);
+insert into ipset_pools select i, ipset(array[format('10.%s.0.0/16', i % 256)::cidr, format('172.16.%s.0/24', i % 256)::cidr, format('2001:db8:%s::/48', to_hex(i))::cidr]) from generate_series(1, 2000) i;
+create index on ipset_pools using gist (pool);
+set enable_seqscan = off;
+select id from ipset_pools where pool >> '10.7.1.1'::inet order by id limit 3;
+select count(*) from ipset_pools where pool && '{2001:db8:10::/44}'::ipset;
+reset enable_seqscan;
+create temp table lpm_routes (id bigint, prefix cidr);
+insert into lpm_routes values (1, '0.0.0.0/0'), (2, '10.0.0.0/8'), (3, '10.1.0.0/16'), (4, '10.1.2.0/24'), (5, '10.1.2.0/24'), (6, '2001:db8::/32'), (7, '2001:db8:1::/48'), (8, NULL);
+select netblock_lpm_load('lpm_routes');
+select a, netblock_lpm('lpm_routes', a), (select id from lpm_routes where a <<= prefix order by masklen(prefix) desc, id limit 1) from (values ('10.1.2.3'::inet), ('10.1.3.3'), ('10.2.0.1'), ('192.168.0.1'), ('10.1.0.0/12'), ('2001:db8:1::1'), ('2001:db8:2::1'), ('2001:db9::1')) t(a);
+create temp table lpm_geo (net cidr, geo_id int);
+insert into lpm_geo values ('192.168.0.0/16', 10), ('192.168.1.0/24', 11);
+select netblock_lpm_load('lpm_geo', 'net', 'geo_id');
+select netblock_lpm('lpm_geo', '192.168.1.7'), netblock_lpm('lpm_geo', '192.168.2.7'), netblock_lpm('lpm_geo', '10.0.0.1');
+insert into lpm_geo values ('10.0.0.0/8', 12);
+select netblock_lpm('lpm_geo', '10.0.0.1');
+begin;
+delete from lpm_geo where geo_id = 11;
+select netblock_lpm('lpm_geo', '192.168.1.7');
+rollback;
+select netblock_lpm('lpm_geo', '192.168.1.7');
+truncate lpm_geo;
+select netblock_lpm('lpm_geo', '192.168.1.7');
+drop table lpm_geo;
+create temp table lpm_geo (prefix cidr, id int);
+insert into lpm_geo values ('192.168.0.0/16', 20);
+select netblock_lpm('lpm_geo', '192.168.1.7');
+update lpm_routes set id = 9 where id = 4;
+select a, netblock_lpm('lpm_routes', a), (select id from lpm_routes where a <<= prefix order by masklen(prefix) desc, id limit 1) from (values ('10.1.2.3'::inet), ('10.1.3.3')) t(a);
+select * from pg_toys_stats where module = 'pg_netop';
@@ -1,2 +1,40 @@
 drop function netblock_sub(cidr, cidr);
+drop function netblock_sub(cidr, cidr[]);
 drop function netblock_acc(cidr, cidr);
+drop function netblock_lpm_load(regclass, name, name);
+drop function netblock_lpm(regclass, inet);
+drop function netblock_lpm_invalidate() cascade;
+drop operator class gist_ipset_ops using gist;
+drop function ipset_gist_consistent(internal, ipset, smallint, oid, internal);
+drop function ipset_gist_union(internal, internal);
+drop function ipset_gist_compress(internal);
+drop function ipset_gist_decompress(internal);
+drop function ipset_gist_penalty(internal, internal, internal);
+drop function ipset_gist_picksplit(internal, internal);
+drop function ipset_gist_same(ipset, ipset, internal);
+drop aggregate ipset_agg(cidr);
+drop function ipset_agg_final(internal);
+drop type ipset cascade;
+drop aggregate netblock_merge(cidr);
+drop function netblock_merge_trans(internal, cidr);
+drop function netblock_merge_combine(internal, internal);
+drop function netblock_merge_serialize(internal);
+drop function netblock_merge_deserialize(bytea, internal);
+drop function netblock_merge_final(internal);
+drop view if exists pg_toys_stats;
+drop function pg_netop_stats();
+drop function pg_netop_stats_reset();
+
+-- pg_toys_stats unions the <module>_stats() of the toy modules installed
+do $$
+declare
+	q text;
+begin
+	select string_agg(format('select * from public.%I()', proname), ' union all ' order by proname) into q
+		from pg_proc where pronamespace = 'public'::regnamespace and proname in ('pg_netop_stats', 'pg_strip_tags_stats', 'pg_trgm_sml_stats');
+	drop view if exists pg_toys_stats;
+	if q is not null then
+		execute 'create view pg_toys_stats as ' || q;
+	end if;
+end
+$$;
@@ -7,6 +7,9 @@
 
 #include <postgres.h>
 #include <fmgr.h>
+#include <utils/guc.h>
+
+#include "pg_toys_stats.h"
 
 
 #define TRIM_SCRIPT         1
@@ -19,6 +22,10 @@ PG_MODULE_MAGIC;
 PG_FUNCTION_INFO_V1(strip_tags);
 Datum strip_tags(PG_FUNCTION_ARGS);
 
+void _PG_init(void);
+
+static ToysStatsEntry strip_tags_stats = TOYS_STATS_ENTRY("strip_tags");
+
 struct html_replace {
     char        *from;
     size_t      fsize;
@@ -26,7 +33,7 @@ struct html_replace {
 };
 
 
-static text* _strip_tags(const char *src, size_t srclen, int flag)
+static text* _strip_tags(const char *src, size_t srclen, int flag, int *ntags)
 {
     const char      *sp;
     char            *dst, *dp, *tp;
@@ -110,6 +117,7 @@ static text* _strip_tags(const char *src, size_t srclen, int flag)
         // elog("sp = %c, state = %d", *sp, state);
         if ((state == RS_BRACKET_END) && (last != state)) 
         {
+            ++*ntags;
             *(tp) = '\0';
             if ((flag & CONVERT_BR) && strcmp("br", tagname) == 0)
                 *(dp++) = ' ';
@@ -181,12 +189,26 @@ static text* _strip_tags(const char *src, size_t srclen, int flag)
 #undef IN_QUOTE
 }
 
+void
+_PG_init(void)
+{
+	toys_stats_init("pg_strip_tags", "pg_strip_tags");
+
+	MarkGUCPrefixReserved("pg_strip_tags");
+}
+
 Datum strip_tags(PG_FUNCTION_ARGS)
 {
 	text			*in, *out;
+	int				ntags = 0;
+	instr_time		start;
+
+	toys_stats_begin(&start);
 
 	in = PG_GETARG_TEXT_P(0);
-	out = _strip_tags(VARDATA(in), VARSIZE(in) - VARHDRSZ, TRIM_SCRIPT | CONVERT_BR | CONVERT_P);
+	out = _strip_tags(VARDATA(in), VARSIZE(in) - VARHDRSZ, TRIM_SCRIPT | CONVERT_BR | CONVERT_P, &ntags);
+
+	toys_stats_end(&strip_tags_stats, &start, VARSIZE(in) - VARHDRSZ, ntags);
 
 	PG_RETURN_TEXT_P(out);
 }
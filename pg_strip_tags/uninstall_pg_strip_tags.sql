@@ -1 +1,18 @@
 drop function strip_tags(text);
+drop view if exists pg_toys_stats;
+drop function pg_strip_tags_stats();
+drop function pg_strip_tags_stats_reset();
+
+-- pg_toys_stats unions the <module>_stats() of the toy modules installed
+do $$
+declare
+	q text;
+begin
+	select string_agg(format('select * from public.%I()', proname), ' union all ' order by proname) into q
+		from pg_proc where pronamespace = 'public'::regnamespace and proname in ('pg_netop_stats', 'pg_strip_tags_stats', 'pg_trgm_sml_stats');
+	drop view if exists pg_toys_stats;
+	if q is not null then
+		execute 'create view pg_toys_stats as ' || q;
+	end if;
+end
+$$;
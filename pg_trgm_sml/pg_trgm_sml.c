@@ -1,4 +1,4 @@
-/* 
+/*
  * Text Similarity using Trigram
  *
  * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
@@ -9,160 +9,677 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
-#include "tree.h"
+#include <stddef.h>
+#include <limits.h>
+#include "pg_trgm_sml.h"
 
 #ifndef CLI_DEBUG
 
-#include <postgres.h>
-#include <fmgr.h>
+#include <access/detoast.h>
+#include <access/htup_details.h>
+#include <funcapi.h>
+#include <libpq/pqformat.h>
+#include <mb/pg_wchar.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/lsyscache.h>
+#include <utils/tuplestore.h>
+#include <utils/typcache.h>
+
+#include "pg_toys_stats.h"
 
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(trgm_sml);
 PG_FUNCTION_INFO_V1(trgm_tag);
+PG_FUNCTION_INFO_V1(trgm_vector_in);
+PG_FUNCTION_INFO_V1(trgm_vector_out);
+PG_FUNCTION_INFO_V1(to_trgm_vector);
+PG_FUNCTION_INFO_V1(trgm_vector_sml);
+PG_FUNCTION_INFO_V1(trgm_sml_op);
+PG_FUNCTION_INFO_V1(trgm_sml_dist);
+PG_FUNCTION_INFO_V1(trgm_tag_agg_trans);
+PG_FUNCTION_INFO_V1(trgm_tag_agg_combine);
+PG_FUNCTION_INFO_V1(trgm_tag_agg_serialize);
+PG_FUNCTION_INFO_V1(trgm_tag_agg_deserialize);
+PG_FUNCTION_INFO_V1(trgm_tag_agg_final);
+PG_FUNCTION_INFO_V1(trgm_tags);
+PG_FUNCTION_INFO_V1(trgm_sml_char);
+PG_FUNCTION_INFO_V1(trgm_tags_char);
+PG_FUNCTION_INFO_V1(trgm_sml_above);
 Datum trgm_sml(PG_FUNCTION_ARGS);
 Datum trgm_tag(PG_FUNCTION_ARGS);
+Datum trgm_vector_in(PG_FUNCTION_ARGS);
+Datum trgm_vector_out(PG_FUNCTION_ARGS);
+Datum to_trgm_vector(PG_FUNCTION_ARGS);
+Datum trgm_vector_sml(PG_FUNCTION_ARGS);
+Datum trgm_sml_op(PG_FUNCTION_ARGS);
+Datum trgm_sml_dist(PG_FUNCTION_ARGS);
+Datum trgm_tag_agg_trans(PG_FUNCTION_ARGS);
+Datum trgm_tag_agg_combine(PG_FUNCTION_ARGS);
+Datum trgm_tag_agg_serialize(PG_FUNCTION_ARGS);
+Datum trgm_tag_agg_deserialize(PG_FUNCTION_ARGS);
+Datum trgm_tag_agg_final(PG_FUNCTION_ARGS);
+Datum trgm_tags(PG_FUNCTION_ARGS);
+Datum trgm_sml_char(PG_FUNCTION_ARGS);
+Datum trgm_tags_char(PG_FUNCTION_ARGS);
+Datum trgm_sml_above(PG_FUNCTION_ARGS);
+
+void _PG_init(void);
+
+double trgm_sml_threshold = 0.3;
+
+/* trgm_sml.slice_size, in kB */
+static int trgm_slice_size = 1024;
+
+static ToysStatsEntry trgm_stats_sml = TOYS_STATS_ENTRY("trgm_sml");
+static ToysStatsEntry trgm_stats_sml_above = TOYS_STATS_ENTRY("trgm_sml_above");
+static ToysStatsEntry trgm_stats_sml_char = TOYS_STATS_ENTRY("trgm_sml_char");
+static ToysStatsEntry trgm_stats_tag = TOYS_STATS_ENTRY("trgm_tag");
+static ToysStatsEntry trgm_stats_tags = TOYS_STATS_ENTRY("trgm_tags");
+static ToysStatsEntry trgm_stats_tags_char = TOYS_STATS_ENTRY("trgm_tags_char");
+static ToysStatsEntry trgm_stats_vector = TOYS_STATS_ENTRY("to_trgm_vector");
+static ToysStatsEntry trgm_stats_vector_sml =
+	TOYS_STATS_ENTRY("trgm_sml(trgm_vector)");
+static ToysStatsEntry trgm_stats_op = TOYS_STATS_ENTRY("trgm_sml_op");
+static ToysStatsEntry trgm_stats_dist = TOYS_STATS_ENTRY("trgm_sml_dist");
 
 #endif
 
-struct term_vector {
-	RB_ENTRY(term_vector) ptr;
+/*
+ * Memory of a term space comes from trgm_malloc. Inside the server that is
+ * palloc in the current memory context, which still returns NULL when out
+ * of memory and is released with the context should anything error out.
+ */
+#ifdef CLI_DEBUG
+#ifndef trgm_malloc
+#define trgm_malloc(S)		malloc(S)
+#define trgm_free(P)		free(P)
+#endif
+#else
+#define trgm_malloc(S)		palloc_extended((S), MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM)
+#define trgm_free(P)		pfree(P)
+#endif
+
+/* the command line build traces tokenizing and scoring, the bench does not */
+#if defined(CLI_DEBUG) && !defined(TRGM_BENCH)
+#define TRGM_TRACE
+#endif
+
+#define TERM_ARENA_BLOCK	8192
+#define TERM_SPACE_SLOTS	64
 
+struct term_vector {
+	uint32_t	hash;
+	size_t		order;		/* first seen order, breaks ties in ranking */
 	size_t		lhs;
 	size_t		rhs;
 	double		lscore;
 	double		rscore;
+	size_t		len;
 	char		trgm[1];
 };
 
 struct term_seq {
 	struct term_vector	**tv;
 	struct term_vector	**last;
+	struct term_vector	**end;
+};
+
+/* bump allocator, the whole arena goes away at once */
+struct term_arena_block {
+	struct term_arena_block	*next;
+	size_t					used;
+	size_t					size;
+	char					data[1];
+};
+
+/* open addressing with linear probing, the hash is kept next to the term
+ * so a probe only touches the term on a full hash match */
+struct term_slot {
+	uint32_t			hash;
+	struct term_vector	*tv;
 };
 
-/* Self defined RB_HEAD(term_space, term_vector); */
 struct term_space {
-	struct term_vector	*rbh_root; /* root of the tree */
-	struct term_seq		seq;
+	struct term_arena_block	*arena;
+	struct term_slot		*slot;
+	size_t					nslots;		/* power of two */
+	size_t					nused;
+	struct term_seq			seq;
 };
 
-RB_PROTOTYPE(term_space, term_vector, ptr, term_cmp);
+static void *term_arena_alloc(struct term_space *ts, size_t size)
+{
+	struct term_arena_block	*b = ts->arena;
+	void					*p;
+
+	/* keep every term aligned for its size_t and double members */
+	size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+
+	if (b == NULL || b->size - b->used < size) {
+		size_t		bsize = size > TERM_ARENA_BLOCK ? size : TERM_ARENA_BLOCK;
+
+		b = (struct term_arena_block *)trgm_malloc(
+				offsetof(struct term_arena_block, data) + bsize);
+		if (b == NULL) return NULL;
+
+		b->next = ts->arena;
+		b->used = 0;
+		b->size = bsize;
+		ts->arena = b;
+	}
+
+	p = b->data + b->used;
+	b->used += size;
+
+	return p;
+}
+
+static int term_space_init(struct term_space *ts)
+{
+	ts->arena = NULL;
+	ts->nslots = TERM_SPACE_SLOTS;
+	ts->nused = 0;
+
+	ts->slot = (struct term_slot *)trgm_malloc(sizeof(struct term_slot) *
+			ts->nslots);
+	ts->seq.tv = (struct term_vector **)trgm_malloc(
+			sizeof(struct term_vector *) * ts->nslots);
+
+	if (ts->slot == NULL || ts->seq.tv == NULL) {
+		if (ts->slot) trgm_free(ts->slot);
+		if (ts->seq.tv) trgm_free(ts->seq.tv);
+		return -1;
+	}
+
+	memset(ts->slot, 0, sizeof(struct term_slot) * ts->nslots);
+	ts->seq.last = ts->seq.tv;
+	ts->seq.end = ts->seq.tv + ts->nslots;
+
+	return 0;
+}
 
-static int 
-term_cmp(const struct term_vector *lhs, const struct term_vector *rhs)
+static void term_space_free(struct term_space *ts)
 {
-	return strcmp(lhs->trgm, rhs->trgm);
+	struct term_arena_block	*b, *next;
+
+	for (b = ts->arena; b; b = next) {
+		next = b->next;
+		trgm_free(b);
+	}
+
+	trgm_free(ts->slot);
+	trgm_free(ts->seq.tv);
 }
 
-RB_GENERATE(term_space, term_vector, ptr, term_cmp);
+/* double the table, seq keeps the same capacity as the slots */
+static int term_space_grow(struct term_space *ts)
+{
+	struct term_slot	*slot, *old = ts->slot;
+	struct term_vector	**tv;
+	size_t				i, j, mask, nslots = ts->nslots * 2;
+
+	slot = (struct term_slot *)trgm_malloc(sizeof(struct term_slot) * nslots);
+	if (slot == NULL) return -1;
+
+	tv = (struct term_vector **)trgm_malloc(sizeof(struct term_vector *) *
+			nslots);
+	if (tv == NULL) {
+		trgm_free(slot);
+		return -1;
+	}
+
+	memset(slot, 0, sizeof(struct term_slot) * nslots);
+	mask = nslots - 1;
+
+	for (i = 0; i < ts->nslots; i++) {
+		if (old[i].tv == NULL) continue;
+
+		for (j = old[i].hash & mask; slot[j].tv; j = (j + 1) & mask)
+			;
+		slot[j] = old[i];
+	}
+
+	memcpy(tv, ts->seq.tv, sizeof(struct term_vector *) * ts->nused);
+
+	trgm_free(old);
+	trgm_free(ts->seq.tv);
+
+	ts->slot = slot;
+	ts->nslots = nslots;
+	ts->seq.tv = tv;
+	ts->seq.last = tv + ts->nused;
+	ts->seq.end = tv + nslots;
 
+	return 0;
+}
+
+/* count a term n times on the given side */
 static int
-term_space_add(struct term_space *ts, const char *s, int side)
+term_space_add_n(struct term_space *ts, const char *s, size_t len,
+		uint32_t hash, int side, size_t n)
 {
-	struct term_vector		*tv = NULL;
-	struct term_vector		*found = NULL;
-	size_t					size;
+	struct term_vector		*tv;
+	struct term_slot		*slot;
+	size_t					i, mask;
+
+	/* keep the load factor under 3/4 */
+	if ((ts->nused + 1) * 4 > ts->nslots * 3 && term_space_grow(ts) == -1)
+		return -1;
+
+	mask = ts->nslots - 1;
+	for (i = hash & mask;; i = (i + 1) & mask) {
+		slot = &ts->slot[i];
+
+		if (slot->tv == NULL)
+			break;
+
+		if (slot->hash == hash && slot->tv->len == len
+			&& memcmp(slot->tv->trgm, s, len) == 0) {
+			/* count old one */
 
+			if (side)
+				slot->tv->rhs += n;
+			else
+				slot->tv->lhs += n;
 
-	size = sizeof(struct term_vector) + strlen(s) + 1;
-	tv = (struct term_vector *)malloc(size);
+			return 0;
+		}
+	}
+
+	/* insert a new term */
+
+	tv = (struct term_vector *)term_arena_alloc(ts,
+			offsetof(struct term_vector, trgm) + len + 1);
 	if (tv == NULL) return -1;
-	
-	memset(tv, 0, size);
-	strcpy(tv->trgm, s);
+
+	memset(tv, 0, offsetof(struct term_vector, trgm));
+	memcpy(tv->trgm, s, len);
+	tv->trgm[len] = '\0';
+	tv->len = len;
+	tv->hash = hash;
+	tv->order = ts->nused;
 	if (side)
-		tv->rhs = 1;
+		tv->rhs = n;
 	else
-		tv->lhs = 1;
-	
-	if ((found = RB_FIND(term_space, ts, tv))) {
-		/* count old one */
+		tv->lhs = n;
 
-		if (side)
-			found->rhs++;
-		else
-			found->lhs++;
+	slot->hash = hash;
+	slot->tv = tv;
+	ts->nused++;
 
-		free(tv);
+	*(ts->seq.last++) = tv;
 
-	} else {
-		/* insert a new term */
-		
-		if (RB_INSERT(term_space, ts, tv)) 
-			return -1;
-		
-		*(ts->seq.last++) = tv;
+	return 0;
+}
+
+static int
+term_space_add(struct term_space *ts, const char *s, size_t len,
+		uint32_t hash, int side)
+{
+	return term_space_add_n(ts, s, len, hash, side, 1);
+}
+
+static void trgm_swap(char *a, char *b, size_t size)
+{
+	char		c;
 
+	while (size-- > 0) {
+		c = *a;
+		*a++ = *b;
+		*b++ = c;
 	}
-	
-	return 0;
 }
 
+/*
+ * Order base so that its first k elements are the k smallest ones, sorted,
+ * and leave the rest in no particular order. Quickselect narrows down on
+ * the k-th element first, so only the head has to be sorted. cmp has to be
+ * a total order.
+ */
+static void trgm_partial_sort(void *base, size_t n, size_t size, size_t k,
+		int (*cmp)(const void *, const void *))
+{
+	char		*b = (char *)base, *pivot;
+	size_t		lo = 0, hi = n, mid, store, i;
+
+	if (k >= n) {
+		qsort(base, n, size, cmp);
+		return;
+	}
+
+	if (k == 0)
+		return;
+
+	while (hi - lo > 1) {
+		/* median of three, moved to the front as the pivot */
+		mid = lo + (hi - lo) / 2;
+		if (cmp(b + mid * size, b + lo * size) < 0)
+			trgm_swap(b + mid * size, b + lo * size, size);
+		if (cmp(b + (hi - 1) * size, b + lo * size) < 0)
+			trgm_swap(b + (hi - 1) * size, b + lo * size, size);
+		if (cmp(b + (hi - 1) * size, b + mid * size) < 0)
+			trgm_swap(b + (hi - 1) * size, b + mid * size, size);
+		trgm_swap(b + lo * size, b + mid * size, size);
+
+		pivot = b + lo * size;
+		for (store = lo, i = lo + 1; i < hi; i++)
+			if (cmp(b + i * size, pivot) < 0)
+				trgm_swap(b + (++store) * size, b + i * size, size);
+		trgm_swap(pivot, b + store * size, size);
+
+		if (store == k)
+			break;
+		else if (store < k)
+			lo = store + 1;
+		else
+			hi = store;
+	}
+
+	qsort(base, k, size, cmp);
+}
+
+/* more frequent first, then in the order the terms were seen */
 static int term_vector_cmp(const void *lhs, const void *rhs)
 {
 	struct term_vector	*lv, *rv;
+	size_t				lsum, rsum;
 	
 	lv = (struct term_vector *)*(struct term_vector **)lhs;
 	rv = (struct term_vector *)*(struct term_vector **)rhs;
 
-	return -(((lv->lhs + lv->rhs) - (rv->lhs + rv->rhs )));
+	lsum = lv->lhs + lv->rhs;
+	rsum = rv->lhs + rv->rhs;
+
+	if (lsum != rsum)
+		return lsum > rsum ? -1 : 1;
+
+	return lv->order < rv->order ? -1 : (lv->order > rv->order);
 }
 
-static void term_space_sort(struct term_space *ts)
+/* rank the k most frequent terms, k < 0 ranks all of them */
+static void term_space_sort(struct term_space *ts, long k)
 {
-	qsort(ts->seq.tv, 
-		(ts->seq.last - ts->seq.tv),
-		sizeof(struct term_vector **),
+	size_t		n = ts->seq.last - ts->seq.tv;
+
+	trgm_partial_sort(ts->seq.tv, n, sizeof(struct term_vector *),
+		(k < 0 || (size_t)k > n) ? n : (size_t)k,
 		term_vector_cmp);
 }
 
-static int term_space_add_trgm(struct term_space *ts, char *s, int side)
+/* FNV-1a over the trigram as stored in term_vector ("w1 w2 w3 ") */
+static uint32_t trgm_hash(const char *s, size_t len)
+{
+	uint32_t	h = 2166136261u;
+
+	while (len-- > 0) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+/*
+ * Words are separated by ASCII white space, whatever the locale says. When
+ * SSE2 or AVX2 is available the separators are looked for a vector at a
+ * time, the scalar loops only finish the tail of the input.
+ */
+#define TRGM_ISSPACE(C)		((C) == ' ' || ((C) >= '\t' && (C) <= '\r'))
+
+#if defined(__GNUC__) && (defined(__AVX2__) || defined(__SSE2__))
+
+#ifdef __AVX2__
+#include <immintrin.h>
+
+#define TRGM_SIMD_WIDTH		32
+
+/* bit i is set if p[i] is white space */
+static inline uint32_t trgm_space_mask(const char *p)
+{
+	__m256i		v = _mm256_loadu_si256((const __m256i *)p);
+	__m256i		sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+	__m256i		c = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+	__m256i		ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(c, _mm256_set1_epi8(4)), c);
+
+	return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(sp, ctl));
+}
+#else
+#include <emmintrin.h>
+
+#define TRGM_SIMD_WIDTH		16
+
+/* bit i is set if p[i] is white space */
+static inline uint32_t trgm_space_mask(const char *p)
+{
+	__m128i		v = _mm_loadu_si128((const __m128i *)p);
+	__m128i		sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+	__m128i		c = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+	__m128i		ctl = _mm_cmpeq_epi8(_mm_min_epu8(c, _mm_set1_epi8(4)), c);
+
+	return (uint32_t)_mm_movemask_epi8(_mm_or_si128(sp, ctl));
+}
+#endif
+
+#define TRGM_SIMD_FULL		((uint32_t)(((uint64_t)1 << TRGM_SIMD_WIDTH) - 1))
+
+#endif
+
+static inline const char *trgm_skip_space(const char *p, const char *end)
+{
+#ifdef TRGM_SIMD_WIDTH
+	uint32_t	m;
+
+	for (; end - p >= TRGM_SIMD_WIDTH; p += TRGM_SIMD_WIDTH)
+		if ((m = ~trgm_space_mask(p) & TRGM_SIMD_FULL) != 0)
+			return p + __builtin_ctz(m);
+#endif
+
+	while (p < end && TRGM_ISSPACE(*p))
+		p++;
+
+	return p;
+}
+
+static inline const char *trgm_skip_word(const char *p, const char *end)
 {
-	size_t		off, len;
-	char 		*p = NULL, *q = NULL, *r = NULL;
-	int			error = -1, i;
+#ifdef TRGM_SIMD_WIDTH
+	uint32_t	m;
+
+	for (; end - p >= TRGM_SIMD_WIDTH; p += TRGM_SIMD_WIDTH)
+		if ((m = trgm_space_mask(p)) != 0)
+			return p + __builtin_ctz(m);
+#endif
 
-	len = strlen(s);
-	if ((p = malloc(len + 1)) == NULL) goto safe_exit;
-	if ((q = malloc(len * 4 + 1)) == NULL) goto safe_exit;
-	*q = '\0';
+	while (p < end && !TRGM_ISSPACE(*p))
+		p++;
+
+	return p;
+}
+
+struct trgm_word {
+	const char	*p;
+	size_t		len;
+};
 
-	for (off = 0, i = 0;; off += strlen(p), ++i) {
-		off += strspn(s + off, " \t");
-		if (sscanf(s + off, "%s", p) < 1) break;
+/*
+ * Add every word trigram of s[0 .. len) to the term space. A trigram is
+ * keyed as "w1 w2 w3 ", which is usually a slice of the input already;
+ * only when the words are not separated by single spaces is the key put
+ * together in a scratch buffer.
+ *
+ * Unless final, s is a chunk of a longer input: the word running into the
+ * end of the chunk is left alone, and *consumed tells where the last two
+ * whole words start. Passing s[*consumed .. len) on in front of the next
+ * chunk continues the trigrams as if the input had not been cut, the two
+ * words only serve as context again.
+ */
+static int term_space_add_words(struct term_space *ts, const char *s,
+		size_t len, int side, int final, size_t *consumed)
+{
+	const char			*p = s, *q, *end = s + len, *key;
+	struct trgm_word	w[3] = {{NULL, 0}, {NULL, 0}, {NULL, 0}};
+	char				*buf = NULL;
+	size_t				bufsize = 0, klen, n;
+	int					error = -1;
+
+	for (n = 0;; ++n, p = q) {
+		p = trgm_skip_space(p, end);
+		if (p == end) break;
+		q = trgm_skip_word(p, end);
+		if (q == end && !final) break;
+
+		w[0] = w[1];
+		w[1] = w[2];
+		w[2].p = p;
+		w[2].len = q - p;
 		
-#ifdef CLI_DEBUG			
-		fprintf(stderr, "term => %s\n", p);
+#ifdef TRGM_TRACE
+		fprintf(stderr, "term => %.*s\n", (int)w[2].len, w[2].p);
 #endif
-		strcat(q, p);
-		strcat(q, " ");
-		if (i > 2) {
-			r = strchr(q, ' ') + 1;
-			if (*r) {
-				len = strlen(r);
-				memmove(q, r, len);
-				*(q + len) = '\0';
+		if (n < 2)
+			continue;
+
+		klen = w[0].len + w[1].len + w[2].len + 3;
+
+		if (w[0].p + w[0].len + 1 == w[1].p && w[0].p[w[0].len] == ' '
+			&& w[1].p + w[1].len + 1 == w[2].p && w[1].p[w[1].len] == ' '
+			&& q < end && *q == ' ') {
+			key = w[0].p;
+		} else {
+			char	*r;
+
+			if (klen > bufsize) {
+				if (buf) trgm_free(buf);
+				bufsize = klen * 2;
+				if ((buf = trgm_malloc(bufsize)) == NULL) goto safe_exit;
 			}
+
+			r = buf;
+			memcpy(r, w[0].p, w[0].len);
+			r += w[0].len;
+			*r++ = ' ';
+			memcpy(r, w[1].p, w[1].len);
+			r += w[1].len;
+			*r++ = ' ';
+			memcpy(r, w[2].p, w[2].len);
+			r += w[2].len;
+			*r = ' ';
+			key = buf;
 		}
-		if (i > 1) {
-#ifdef CLI_DEBUG			
-			fprintf(stderr, "trgm => %s\n", q);
+
+#ifdef TRGM_TRACE
+		fprintf(stderr, "trgm => %.*s\n", (int)klen, key);
 #endif
-			if (term_space_add(ts, q, side) == -1)
-				goto safe_exit;
-		}
+		if (term_space_add(ts, key, klen, trgm_hash(key, klen), side) == -1)
+			goto safe_exit;
 	}
 
+	if (consumed)
+		*consumed = (n >= 2 ? w[1].p : n == 1 ? w[2].p : p) - s;
 
 	error = 0;
 
 safe_exit:
-	if (p) free(p);	
-	if (q) free(q);	
+	if (buf) trgm_free(buf);	
 
 	return error;
 }
 
+static int term_space_add_trgm(struct term_space *ts, const char *s,
+		size_t len, int side)
+{
+	return term_space_add_words(ts, s, len, side, 1, NULL);
+}
+
+/* longest character n-gram, so that a window fits on the stack */
+#define TRGM_MAX_GRAM		32
+
+/* UTF-8 sequence length by the high nibble of its lead byte, a stray
+ * continuation byte counts as a character of its own */
+static const unsigned char trgm_utf8_len[16] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4
+};
+
+/* whether s[0 .. len) is all ASCII, eight bytes at a time */
+static inline int trgm_is_ascii(const char *s, size_t len)
+{
+	uint64_t	w, acc = 0;
+	size_t		i = 0;
+
+	for (; i + sizeof(w) <= len; i += sizeof(w)) {
+		memcpy(&w, s + i, sizeof(w));
+		acc |= w;
+	}
+	for (; i < len; i++)
+		acc |= (unsigned char)s[i];
+
+	return (acc & UINT64_C(0x8080808080808080)) == 0;
+}
+
+/*
+ * Add the character n-grams of every word of s[0 .. len) to the term
+ * space. A gram never spans words, and a word shorter than gram characters
+ * is a gram by itself. The key is the slice of the input the gram covers.
+ * Characters are decoded as UTF-8, or taken a byte each unless utf8; an
+ * ASCII word needs no decoding at all.
+ */
+static int term_space_add_chars(struct term_space *ts, const char *s,
+		size_t len, int side, int gram, int utf8)
+{
+	const char		*p = s, *q, *r, *end = s + len;
+	const char		*start[TRGM_MAX_GRAM];
+	size_t			nchars, i;
+
+	for (;; p = q) {
+		p = trgm_skip_space(p, end);
+		if (p == end) break;
+		q = trgm_skip_word(p, end);
+
+		if (!utf8 || trgm_is_ascii(p, q - p)) {
+			if (q - p <= gram) {
+				if (term_space_add(ts, p, q - p, trgm_hash(p, q - p),
+							side) == -1)
+					return -1;
+				continue;
+			}
+
+			for (r = p; r + gram <= q; r++)
+				if (term_space_add(ts, r, gram, trgm_hash(r, gram),
+							side) == -1)
+					return -1;
+			continue;
+		}
+
+		/* start[] keeps where the last gram characters began */
+		for (r = p, nchars = 0; r < q; nchars++) {
+			start[nchars % gram] = r;
+
+			if ((unsigned char)*r < 0x80)
+				r++;
+			else {
+				r += trgm_utf8_len[(unsigned char)*r >> 4];
+				if (r > q) r = q;
+			}
+
+			if (nchars + 1 >= (size_t)gram) {
+				i = (nchars + 1 - gram) % gram;
+				if (term_space_add(ts, start[i], r - start[i],
+							trgm_hash(start[i], r - start[i]), side) == -1)
+					return -1;
+			}
+		}
+
+		if (nchars < (size_t)gram
+			&& term_space_add(ts, p, q - p, trgm_hash(p, q - p), side) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
 static double cosine_angle(struct term_space *ts, int top)
 {
 	struct term_vector	**v;
@@ -186,178 +703,1415 @@ static double cosine_angle(struct term_space *ts, int top)
 	return prod / denominator;
 }
 
-static char *
-_trgm_tag(const char *s, size_t max)
+/*
+ * Whether the cosine over all terms reaches threshold, without computing
+ * it unless it has to. Counts are integers, so the norms and the partial
+ * dot product are exact; what is left of the dot product can not exceed
+ * the product of the norms left on either side, and the walk stops as
+ * soon as the dot product so far settles the answer either way. No
+ * ranking is needed for all terms, so they are taken in first-seen order.
+ */
+static int term_space_above(struct term_space *ts, double threshold)
 {
-	struct term_space	*ts = NULL;
-	char				*p = NULL, *q = NULL;
-	struct term_vector	**v, *tv;
-
-	if ((p = strdup(s)) == NULL) goto safe_exit;
-	if ((q = (char *)malloc(strlen(s) * 4)) == NULL) goto safe_exit;
-	*q = '\0';
+	struct term_vector	**v;
+	double				norm[2] = {0.0, 0.0}, rest[2], dot = 0.0, target;
+	double				l, r;
 
-	ts = (struct term_space *)malloc(sizeof(struct term_space));
-	if (ts == NULL) goto safe_exit;
-	
-	RB_INIT(ts);
+	for (v = ts->seq.tv; v < ts->seq.last; v++) {
+		norm[0] += (double)(*v)->lhs * (*v)->lhs;
+		norm[1] += (double)(*v)->rhs * (*v)->rhs;
+	}
 
-	ts->seq.tv = (struct term_vector **)malloc(sizeof(struct term_vector *) *
-			strlen(s));
-	if (ts->seq.tv == NULL) goto safe_exit;
-	ts->seq.last = ts->seq.tv;
+	/* the cosine of an empty side is NaN, which is not above anything */
+	if (norm[0] == 0.0 || norm[1] == 0.0)
+		return 0;
 
-	if (term_space_add_trgm(ts, p, 0) == -1)
-		goto safe_exit;
+	target = threshold * sqrt(norm[0] * norm[1]);
+	rest[0] = norm[0];
+	rest[1] = norm[1];
 
-	term_space_sort(ts);
+	for (v = ts->seq.tv; v < ts->seq.last; v++) {
+		l = (*v)->lhs;
+		r = (*v)->rhs;
 
-	for (v = ts->seq.tv; v < ts->seq.last && max-- > 0; v++) 
-		strcat(q, (*v)->trgm);
+		dot += l * r;
+		rest[0] -= l * l;
+		rest[1] -= r * r;
 
-	for(tv = RB_MIN(term_space, ts); tv; tv = RB_MIN(term_space, ts)) {
-		RB_REMOVE(term_space, ts, tv);
-		free(tv);
+		if (dot >= target)
+			return 1;
+		if (dot + sqrt(rest[0] * rest[1]) < target)
+			return 0;
 	}
 
-safe_exit:
-	if (ts->seq.tv) free(ts->seq.tv);
-	if (ts) free(ts);
-	if (p) free(p);
-	if (*q == '\0') { free(q); q = NULL; }
-	return q;
+	return dot >= target;
 }
 
-static int
-_trgm_sml(double *score, const char *s, const char *t, int n)
+/* the max most frequent trigrams run together, NULL when there are none */
+static char *
+term_space_tag(struct term_space *ts, size_t max)
 {
-	struct term_space	*ts = NULL;
-	struct term_vector	**v, *tv;
-	int					retval = -1;
-	char				*p = NULL, *q = NULL;
+	struct term_vector	**v, **last;
+	char				*q, *p;
+	size_t				size = 0;
 
-	if (s == NULL || t == NULL) return -1;
+	term_space_sort(ts, max > (size_t)LONG_MAX ? -1 : (long)max);
 
-	if ((p = strdup(s)) == NULL) goto safe_exit;
-	if ((q = strdup(t)) == NULL) goto safe_exit;
+	last = max > (size_t)(ts->seq.last - ts->seq.tv) ?
+		ts->seq.last : ts->seq.tv + max;
 
-	ts = (struct term_space *)malloc(sizeof(struct term_space));
-	if (ts == NULL) goto safe_exit;
+	for (v = ts->seq.tv; v < last; v++)
+		size += (*v)->len;
 
-	RB_INIT(ts);
+	if (size == 0 || (q = (char *)trgm_malloc(size + 1)) == NULL)
+		return NULL;
 
-	ts->seq.tv = (struct term_vector **)malloc(sizeof(struct term_vector *) *
-			(strlen(s) + strlen(t)));
-	if (ts->seq.tv == NULL) goto safe_exit;
-	ts->seq.last = ts->seq.tv;
+	for (v = ts->seq.tv, p = q; v < last; v++) {
+		memcpy(p, (*v)->trgm, (*v)->len);
+		p += (*v)->len;
+	}
+	*p = '\0';
+
+	return q;
+}
+
+/*
+ * Rank the terms and score the n most frequent of them, by their counts
+ * or, given a weight function, by the weights of their counts. The terms
+ * function, if any, sees the ranked terms before they are weighted.
+ */
+static double term_space_score(struct term_space *ts, int n,
+		trgm_terms_fn terms, trgm_weight_fn weight, void *arg)
+{
+	struct term_vector	**v, **last;
+	size_t				doclen[2] = {0, 0};
 
-	if (term_space_add_trgm(ts, p, 0) == -1
-		|| term_space_add_trgm(ts, q, 1) == -1)
-		goto safe_exit;
+	term_space_sort(ts, n);
 
-	term_space_sort(ts);
+	last = (n < 0 || n > ts->seq.last - ts->seq.tv) ?
+		ts->seq.last : ts->seq.tv + n;
 
-	for (v = ts->seq.tv; v < ts->seq.last; v++) {
-		(*v)->lscore = (*v)->lhs;
-		(*v)->rscore = (*v)->rhs;
-#if CLI_DEBUG
-		fprintf(stderr, "trgm >> %s %d %d\n", (*v)->trgm, (*v)->lhs, (*v)->rhs);
-#endif
-	}
+	if (weight) {
+		for (v = ts->seq.tv; v < ts->seq.last; v++) {
+			doclen[0] += (*v)->lhs;
+			doclen[1] += (*v)->rhs;
+		}
 
-	*score = cosine_angle(ts, n);
+		if (terms)
+			for (v = ts->seq.tv; v < last; v++)
+				terms((*v)->hash, v - ts->seq.tv, last - ts->seq.tv, arg);
+	}
 
-	/* RB_FOREACH uses RB_NEXT to acces next element.
-	 * this causes uninitialized value accessing with RB_REMOVE */
-	for(tv = RB_MIN(term_space, ts); tv; tv = RB_MIN(term_space, ts)) {
-		RB_REMOVE(term_space, ts, tv);
-		free(tv);
+	for (v = ts->seq.tv; v < last; v++) {
+		if (weight) {
+			(*v)->lscore = (*v)->lhs ? weight((*v)->hash, v - ts->seq.tv,
+					(*v)->lhs, doclen[0], arg) : 0.0;
+			(*v)->rscore = (*v)->rhs ? weight((*v)->hash, v - ts->seq.tv,
+					(*v)->rhs, doclen[1], arg) : 0.0;
+		} else {
+			(*v)->lscore = (*v)->lhs;
+			(*v)->rscore = (*v)->rhs;
+		}
+#ifdef TRGM_TRACE
+		fprintf(stderr, "trgm >> %s %zu %zu\n", (*v)->trgm, (*v)->lhs, (*v)->rhs);
+#endif
 	}
 
-	retval = 0;	
-		
-safe_exit:
-	if (ts->seq.tv) free(ts->seq.tv);
-	if (ts) free(ts);
-	if (p) free(p);
-	if (q) free(q);
-	return retval;
+	return cosine_angle(ts, n);
 }
 
-#ifdef CLI_DEBUG
+#ifndef CLI_DEBUG
 
-int main()
+/*
+ * The distinct trigrams of one side and their counts, in the order they
+ * were first seen. Replaying them into a term space is the same as
+ * tokenizing that side again, minus the tokenizing.
+ */
+struct term_cache_item {
+	uint32_t	hash;
+	size_t		count;
+	size_t		len;
+	const char	*trgm;
+};
+
+struct term_cache {
+	size_t					nterms;
+	struct term_cache_item	items[1];
+};
+
+/* the cache is a single trgm_malloc'ed block */
+static struct term_cache *term_cache_build(const char *s, size_t len)
 {
-        double score;
-		char *t = NULL;
+	struct term_space		ts;
+	struct term_vector		**v;
+	struct term_cache		*c = NULL;
+	struct term_cache_item	*item;
+	size_t					n, size;
+	char					*p;
+
+	if (term_space_init(&ts) == -1) return NULL;
+
+	if (term_space_add_trgm(&ts, s, len, 0) == -1)
+		goto free_space;
+
+	n = ts.seq.last - ts.seq.tv;
+	size = offsetof(struct term_cache, items) +
+		sizeof(struct term_cache_item) * n;
+	for (v = ts.seq.tv; v < ts.seq.last; v++)
+		size += (*v)->len;
+
+	if ((c = (struct term_cache *)trgm_malloc(size)) == NULL)
+		goto free_space;
+
+	c->nterms = n;
+	p = (char *)(c->items + n);
+	for (v = ts.seq.tv, item = c->items; v < ts.seq.last; v++, item++) {
+		item->hash = (*v)->hash;
+		item->count = (*v)->lhs;
+		item->len = (*v)->len;
+		item->trgm = p;
+		memcpy(p, (*v)->trgm, (*v)->len);
+		p += (*v)->len;
+	}
 
-        printf("retval = %d\n", _trgm_sml(&score, "我 喜欢 北京 天安门", "我 爱 北京 生活", -1));
-        printf("retval = %s\n", (t = _trgm_tag("我喜欢北京", -1)));
-        printf("score = %f\n", score );
-		free(t);
-        return 0;
+free_space:
+	term_space_free(&ts);
+
+	return c;
 }
 
-#else
+static int term_space_add_cache(struct term_space *ts,
+		const struct term_cache *c, int side)
+{
+	const struct term_cache_item	*item;
 
-#define VAR_STRLEN(S) (VARSIZE(S) - VARHDRSZ)
+	for (item = c->items; item < c->items + c->nterms; item++)
+		if (term_space_add_n(ts, item->trgm, item->len, item->hash,
+					side, item->count) == -1)
+			return -1;
 
-Datum trgm_tag(PG_FUNCTION_ARGS)
-{
-	text			*datum, *ret;
-	char			*s = NULL;
-	char			*t = NULL;
-	size_t			len;
-	int				max;
+	return 0;
+}
 
+#endif
 
-	datum = PG_GETARG_TEXT_P(0);
-	max = (int)PG_GETARG_INT32(1);
+static int trgm_entry_cmp(const void *lhs, const void *rhs)
+{
+	const struct trgm_entry	*le = lhs, *re = rhs;
 
-	s = strndup(VARDATA(datum), VAR_STRLEN(datum));
+	if (le->hash < re->hash) return -1;
+	if (le->hash > re->hash) return 1;
+	return 0;
+}
 
-	if ((t = _trgm_tag(s, max)) != NULL) {
-		len = strlen(t) + 1;
+/* sort entries by hash and fold duplicated hashes, returns the new length */
+static size_t trgm_entry_unique(struct trgm_entry *e, size_t n)
+{
+	struct trgm_entry	*p, *q;
 
-		ret = (text *)palloc(len + VARHDRSZ);
+	if (n == 0) return 0;
 
-		strcpy(VARDATA(ret), t);
-		SET_VARSIZE(ret, len);
+	qsort(e, n, sizeof(struct trgm_entry), trgm_entry_cmp);
 
-		free(t);
-	} else {
-		PG_RETURN_NULL();
+	for (p = e, q = e + 1; q < e + n; q++) {
+		if (q->hash == p->hash)
+			p->count += q->count;
+		else
+			*(++p) = *q;
 	}
 
-	free(s);
-
-	PG_RETURN_TEXT_P(ret);
+	return p - e + 1;
 }
 
-Datum trgm_sml(PG_FUNCTION_ARGS)
+/*
+ * Build the trgm_vector entries of s. The array comes from trgm_malloc and
+ * has to be released with trgm_free by the caller.
+ */
+static struct trgm_entry *
+_trgm_vector(const char *s, size_t len, size_t *nentries)
 {
-	text			*datum[2];
-	double			score = 0.0;
-	char			*lhs = NULL;
-	char			*rhs = NULL;
-	int 			max;
+	struct term_space	ts;
+	struct term_vector	**v;
+	struct trgm_entry	*e = NULL, *retval = NULL;
+	size_t				n;
 
+	if (term_space_init(&ts) == -1) return NULL;
 
-	datum[0] = PG_GETARG_TEXT_P(0);
-	datum[1] = PG_GETARG_TEXT_P(1);
-	max = (int)PG_GETARG_INT32(2);
+	if (term_space_add_trgm(&ts, s, len, 0) == -1)
+		goto free_space;
 
+	n = ts.seq.last - ts.seq.tv;
+	e = (struct trgm_entry *)trgm_malloc(sizeof(struct trgm_entry) * (n + 1));
+	if (e == NULL) goto free_space;
 
-	lhs = strndup(VARDATA(datum[0]), VAR_STRLEN(datum[0]));
-	rhs = strndup(VARDATA(datum[1]), VAR_STRLEN(datum[1]));
+	for (v = ts.seq.tv; v < ts.seq.last; v++) {
+		e[v - ts.seq.tv].hash = (*v)->hash;
+		e[v - ts.seq.tv].count = (uint32_t)(*v)->lhs;
+	}
 
+	*nentries = trgm_entry_unique(e, n);
+	retval = e;
 
-	_trgm_sml(&score, lhs, rhs, max);
+free_space:
+	term_space_free(&ts);
 
-	free(lhs);
-	free(rhs);
+	return retval;
+}
 
-	PG_RETURN_FLOAT8(score);
+struct trgm_pair {
+	uint32_t	hash;
+	double		lscore;
+	double		rscore;
+};
+
+static int trgm_pair_cmp(const void *lhs, const void *rhs)
+{
+	const struct trgm_pair	*lp = lhs, *rp = rhs;
+	double					lsum, rsum;
+
+	lsum = lp->lscore + lp->rscore;
+	rsum = rp->lscore + rp->rscore;
+
+	if (lsum > rsum) return -1;
+	if (lsum < rsum) return 1;
+	if (lp->hash < rp->hash) return -1;
+	if (lp->hash > rp->hash) return 1;
+	return 0;
+}
+
+/*
+ * The score of _trgm_sml computed from two hash sorted trgm_vector entry
+ * arrays. With n < 0 every trigram counts and the score falls out of a
+ * single merge pass; otherwise the merged pairs are ranked first so only
+ * the n most frequent trigrams are used, as cosine_angle does. A vector
+ * does not know the order its trigrams were seen in, so equally frequent
+ * trigrams rank by hash here and by first appearance there: at the cut of
+ * the top n the two may keep different trigrams and score differently.
+ */
+static int
+_trgm_vector_sml(double *score,
+				 const struct trgm_entry *a, size_t na,
+				 const struct trgm_entry *b, size_t nb, int n)
+{
+	const struct trgm_entry	*ea = a + na, *eb = b + nb;
+	struct trgm_pair		*pairs = NULL, *pp;
+	double					prod = 0.0;
+	double					len[2] = {0.0, 0.0};
+	double					l, r;
+
+	if (n >= 0) {
+		pairs = (struct trgm_pair *)trgm_malloc(sizeof(struct trgm_pair) *
+				(na + nb + 1));
+		if (pairs == NULL) return -1;
+	}
+
+	for (pp = pairs; a < ea || b < eb; ) {
+		uint32_t	hash;
+
+		if (b == eb || (a < ea && a->hash < b->hash)) {
+			hash = a->hash;
+			l = (a++)->count;
+			r = 0.0;
+		} else if (a == ea || b->hash < a->hash) {
+			hash = b->hash;
+			l = 0.0;
+			r = (b++)->count;
+		} else {
+			hash = a->hash;
+			l = (a++)->count;
+			r = (b++)->count;
+		}
+
+		if (pairs) {
+			pp->hash = hash;
+			pp->lscore = l;
+			(pp++)->rscore = r;
+		} else {
+			prod += l * r;
+			len[0] += l * l;
+			len[1] += r * r;
+		}
+	}
+
+	if (pairs) {
+		struct trgm_pair	*p;
+
+		trgm_partial_sort(pairs, pp - pairs, sizeof(struct trgm_pair),
+				(size_t)n, trgm_pair_cmp);
+
+		for (p = pairs; p < pp && n != 0; p++, n--) {
+			prod += p->lscore * p->rscore;
+			len[0] += p->lscore * p->lscore;
+			len[1] += p->rscore * p->rscore;
+		}
+
+		trgm_free(pairs);
+	}
+
+	*score = prod / sqrt(len[0] * len[1]);
+
+	return 0;
+}
+
+#ifdef CLI_DEBUG
+
+/* the server reads its arguments in place, these are for the command line */
+static char *
+_trgm_tag(const char *s, size_t max)
+{
+	struct term_space	ts;
+	char				*q = NULL;
+
+	if (term_space_init(&ts) == -1) return NULL;
+
+	if (term_space_add_trgm(&ts, s, strlen(s), 0) == 0)
+		q = term_space_tag(&ts, max);
+
+	term_space_free(&ts);
+
+	return q;
+}
+
+static int
+_trgm_sml(double *score, const char *s, const char *t, int n)
+{
+	struct term_space	ts;
+	int					retval = -1;
+
+	if (s == NULL || t == NULL) return -1;
+
+	if (term_space_init(&ts) == -1) return -1;
+
+	if (term_space_add_trgm(&ts, s, strlen(s), 0) == -1
+		|| term_space_add_trgm(&ts, t, strlen(t), 1) == -1)
+		goto free_space;
+
+	*score = term_space_score(&ts, n, NULL, NULL, NULL);
+
+	retval = 0;	
+
+free_space:
+	term_space_free(&ts);
+
+	return retval;
+}
+
+#ifndef TRGM_BENCH
+
+int main()
+{
+        double score;
+		char *t = NULL;
+
+        printf("retval = %d\n", _trgm_sml(&score, "我 喜欢 北京 天安门", "我 爱 北京 生活", -1));
+        printf("retval = %s\n", (t = _trgm_tag("我喜欢北京", -1)));
+        printf("score = %f\n", score );
+		free(t);
+
+		{
+			struct trgm_entry	*a, *b;
+			size_t				na = 0, nb = 0;
+
+			a = _trgm_vector("我 喜欢 北京 天安门", strlen("我 喜欢 北京 天安门"), &na);
+			b = _trgm_vector("我 爱 北京 生活", strlen("我 爱 北京 生活"), &nb);
+			_trgm_vector_sml(&score, a, na, b, nb, -1);
+			printf("vector score = %f\n", score );
+			trgm_free(a);
+			trgm_free(b);
+		}
+
+		{
+			const char			*a = "我喜欢北京天安门", *b = "我爱北京生活";
+			struct term_space	ts;
+
+			if (term_space_init(&ts) == 0) {
+				if (term_space_add_chars(&ts, a, strlen(a), 0, 2, 1) == 0
+					&& term_space_add_chars(&ts, b, strlen(b), 1, 2, 1) == 0) {
+					printf("bigram above 0.15 = %d\n",
+							term_space_above(&ts, 0.15));
+					printf("bigram score = %f\n",
+							term_space_score(&ts, -1, NULL, NULL, NULL));
+				}
+				term_space_free(&ts);
+			}
+		}
+        return 0;
+}
+
+#endif
+
+#else
+
+#define VAR_STRLEN(S) (VARSIZE(S) - VARHDRSZ)
+
+/* length of a text argument as stored, without detoasting it */
+#define TRGM_ARG_BYTES(N) \
+	((uint64)(toast_raw_datum_size(PG_GETARG_DATUM(N)) - VARHDRSZ))
+
+void
+_PG_init(void)
+{
+	DefineCustomRealVariable("trgm_sml.similarity_threshold",
+							 "Sets the threshold used by the %% operator.",
+							 "Valid range is 0.0 .. 1.0.",
+							 &trgm_sml_threshold,
+							 0.3,
+							 0.0,
+							 1.0,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("trgm_sml.slice_size",
+							"Sets the size of the slices in which large "
+							"uncompressed out-of-line values are read.",
+							"0 reads them whole.",
+							&trgm_slice_size,
+							1024,
+							0,
+							MaxAllocSize / 2 / 1024,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	trgm_idf_init();
+	trgm_dict_init();
+	trgm_worker_init();
+
+	toys_stats_init("pg_trgm_sml", "trgm_sml");
+
+	MarkGUCPrefixReserved("trgm_sml");
+}
+
+static TrgmVector *
+trgm_vector_make(const struct trgm_entry *e, size_t n)
+{
+	TrgmVector		*vec;
+
+	vec = (TrgmVector *)palloc(TRGMV_SIZE(n));
+	SET_VARSIZE(vec, TRGMV_SIZE(n));
+	vec->nentries = n;
+	if (n > 0)
+		memcpy(vec->entries, e, sizeof(struct trgm_entry) * n);
+
+	return vec;
+}
+
+/*
+ * Text form is a space separated list of "hash:count", hash in hex, e.g.
+ * '0c3f9a21:1 8a0b7d10:3'.
+ */
+Datum trgm_vector_in(PG_FUNCTION_ARGS)
+{
+	char				*s = PG_GETARG_CSTRING(0);
+	char				*p, *end;
+	struct trgm_entry	*e;
+	size_t				n = 0, max = 1;
+	unsigned long		hash, count;
+	TrgmVector			*vec;
+
+	for (p = s; *p; p++)
+		if (*p == ':')
+			max++;
+
+	e = (struct trgm_entry *)palloc(sizeof(struct trgm_entry) * max);
+
+	for (p = s;;) {
+		while (*p == ' ' || *p == '\t' || *p == '\n')
+			p++;
+		if (*p == '\0')
+			break;
+
+		hash = strtoul(p, &end, 16);
+		if (end == p || *end != ':' || hash > UINT32_MAX)
+			goto bad_input;
+		p = end + 1;
+
+		count = strtoul(p, &end, 10);
+		if (end == p || count > UINT32_MAX)
+			goto bad_input;
+		p = end;
+
+		if (*p && *p != ' ' && *p != '\t' && *p != '\n')
+			goto bad_input;
+
+		if (count > 0) {
+			e[n].hash = (uint32_t)hash;
+			e[n].count = (uint32_t)count;
+			n++;
+		}
+	}
+
+	vec = trgm_vector_make(e, trgm_entry_unique(e, n));
+	pfree(e);
+
+	PG_RETURN_TRGMVECTOR_P(vec);
+
+bad_input:
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+			 errmsg("invalid input syntax for type trgm_vector: \"%s\"", s)));
+	PG_RETURN_NULL();
+}
+
+Datum trgm_vector_out(PG_FUNCTION_ARGS)
+{
+	TrgmVector		*vec = PG_GETARG_TRGMVECTOR_P(0);
+	char			*s, *p;
+	uint32			i;
+
+	/* 8 hex digits, ':', up to 10 digits and a separator per entry */
+	p = s = (char *)palloc(vec->nentries * 20 + 1);
+	*p = '\0';
+
+	for (i = 0; i < vec->nentries; i++)
+		p += sprintf(p, "%s%08x:%u", (i ? " " : ""),
+					 vec->entries[i].hash, vec->entries[i].count);
+
+	PG_RETURN_CSTRING(s);
+}
+
+TrgmVector *
+trgm_vector_from_text(text *datum)
+{
+	struct trgm_entry	*e;
+	size_t				n = 0;
+	TrgmVector			*vec;
+
+	e = _trgm_vector(VARDATA_ANY(datum), VARSIZE_ANY_EXHDR(datum), &n);
+	if (e == NULL)
+		elog(ERROR, "to_trgm_vector: out of memory");
+
+	vec = trgm_vector_make(e, n);
+
+	trgm_free(e);
+
+	return vec;
+}
+
+/* cosine over all trigrams, an empty side is not similar to anything */
+double
+trgm_vector_similarity(const struct trgm_entry *a, size_t na,
+		const struct trgm_entry *b, size_t nb)
+{
+	double			score = 0.0;
+
+	if (na == 0 || nb == 0)
+		return 0.0;
+
+	/* the unlimited merge does not allocate and cannot fail */
+	_trgm_vector_sml(&score, a, na, b, nb, -1);
+
+	return score;
+}
+
+/* trgm_sml of two vectors, using the n most frequent trigrams */
+double
+trgm_vector_score(const struct trgm_entry *a, size_t na,
+		const struct trgm_entry *b, size_t nb, int n)
+{
+	double			score = 0.0;
+
+	if (_trgm_vector_sml(&score, a, na, b, nb, n) == -1)
+		elog(ERROR, "trgm_sml: out of memory");
+
+	return score;
+}
+
+/* trgm_sml of two texts with the counts of the terms weighted */
+double
+trgm_text_score(text *a, text *b, int n, trgm_terms_fn terms,
+		trgm_weight_fn weight, void *arg)
+{
+	struct term_space	ts;
+	double				score;
+
+	if (term_space_init(&ts) == -1)
+		elog(ERROR, "trgm_sml: out of memory");
+
+	if (term_space_add_trgm(&ts, VARDATA_ANY(a), VARSIZE_ANY_EXHDR(a), 0) == -1
+		|| term_space_add_trgm(&ts, VARDATA_ANY(b), VARSIZE_ANY_EXHDR(b), 1) == -1) {
+		term_space_free(&ts);
+		elog(ERROR, "trgm_sml: out of memory");
+	}
+
+	score = term_space_score(&ts, n, terms, weight, arg);
+
+	term_space_free(&ts);
+
+	return score;
+}
+
+/*
+ * The distinct trigrams of a text in first seen order, as palloc'ed C
+ * strings without the trailing space.
+ */
+char **
+trgm_text_trigrams(text *datum, int *n)
+{
+	struct term_space	ts;
+	struct term_vector	**v;
+	char				**trgm;
+	size_t				len;
+	int					i = 0;
+
+	if (term_space_init(&ts) == -1)
+		elog(ERROR, "trgm_sml: out of memory");
+
+	if (term_space_add_trgm(&ts, VARDATA_ANY(datum), VARSIZE_ANY_EXHDR(datum),
+				0) == -1) {
+		term_space_free(&ts);
+		elog(ERROR, "trgm_sml: out of memory");
+	}
+
+	trgm = (char **)palloc(sizeof(char *) * (ts.seq.last - ts.seq.tv + 1));
+
+	for (v = ts.seq.tv; v < ts.seq.last; v++) {
+		len = (*v)->len;
+		if (len > 0 && (*v)->trgm[len - 1] == ' ')
+			len--;
+		trgm[i++] = pnstrdup((*v)->trgm, len);
+	}
+
+	term_space_free(&ts);
+
+	*n = i;
+
+	return trgm;
+}
+
+Datum to_trgm_vector(PG_FUNCTION_ARGS)
+{
+	TrgmVector		*vec;
+	instr_time		start;
+
+	toys_stats_begin(&start);
+
+	vec = trgm_vector_from_text(PG_GETARG_TEXT_PP(0));
+
+	toys_stats_end(&trgm_stats_vector, &start, TRGM_ARG_BYTES(0),
+			vec->nentries);
+
+	PG_RETURN_TRGMVECTOR_P(vec);
+}
+
+Datum trgm_vector_sml(PG_FUNCTION_ARGS)
+{
+	TrgmVector		*vec[2];
+	double			score = 0.0;
+	int				max;
+	instr_time		start;
+
+	toys_stats_begin(&start);
+
+	vec[0] = PG_GETARG_TRGMVECTOR_P(0);
+	vec[1] = PG_GETARG_TRGMVECTOR_P(1);
+	max = (int)PG_GETARG_INT32(2);
+
+	score = trgm_vector_score(vec[0]->entries, vec[0]->nentries,
+			vec[1]->entries, vec[1]->nentries, max);
+
+	toys_stats_end(&trgm_stats_vector_sml, &start,
+			TRGM_ARG_BYTES(0) + TRGM_ARG_BYTES(1),
+			vec[0]->nentries + vec[1]->nentries);
+
+	PG_RETURN_FLOAT8(score);
+}
+
+/*
+ * Tokenize a value stored out of line without compression slice by slice,
+ * carrying the words cut by the end of a slice over to the next one, so
+ * that only a slice and a few words are in memory at a time.
+ */
+static int
+term_space_add_slices(struct term_space *ts, Datum d, size_t size, int side)
+{
+	size_t			slice = (size_t)trgm_slice_size * 1024;
+	size_t			off, carry = 0, n, used, winsize = 0;
+	char			*win = NULL, *p;
+	text			*t;
+	int				error = -1;
+
+	for (off = 0; off < size; off += n) {
+		t = DatumGetTextPSlice(d, (int32)off, (int32)slice);
+		n = VARSIZE_ANY_EXHDR(t);
+
+		if (carry + n > winsize) {
+			winsize = (carry + n) * 2;
+			if ((p = (char *)trgm_malloc(winsize)) == NULL) goto safe_exit;
+			if (carry) memcpy(p, win, carry);
+			if (win) trgm_free(win);
+			win = p;
+		}
+
+		memcpy(win + carry, VARDATA_ANY(t), n);
+		pfree(t);
+
+		if (n == 0) break;
+
+		if (term_space_add_words(ts, win, carry + n, side,
+					off + n >= size, &used) == -1)
+			goto safe_exit;
+
+		carry = carry + n - used;
+		memmove(win, win + used, carry);
+	}
+
+	error = 0;
+
+safe_exit:
+	if (win) trgm_free(win);
+
+	return error;
+}
+
+/*
+ * Tokenize a text argument where it lies, only detoasting it when it has
+ * to be, or in slices when it is large and stored out of line uncompressed.
+ */
+static int
+term_space_add_datum(struct term_space *ts, Datum d, int side)
+{
+	struct varlena	*attr = (struct varlena *)DatumGetPointer(d);
+	text			*t;
+	int				rc;
+
+	if (trgm_slice_size > 0 && VARATT_IS_EXTERNAL_ONDISK(attr)) {
+		struct varatt_external	toast_pointer;
+
+		VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+
+		if (!VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer) &&
+			VARATT_EXTERNAL_GET_EXTSIZE(toast_pointer) >
+				(size_t)trgm_slice_size * 1024)
+			return term_space_add_slices(ts, d,
+					VARATT_EXTERNAL_GET_EXTSIZE(toast_pointer), side);
+	}
+
+	t = DatumGetTextPP(d);
+	rc = term_space_add_trgm(ts, VARDATA_ANY(t), VARSIZE_ANY_EXHDR(t), side);
+
+	if ((Pointer)t != DatumGetPointer(d))
+		pfree(t);
+
+	return rc;
+}
+
+Datum trgm_tag(PG_FUNCTION_ARGS)
+{
+	struct term_space	ts;
+	text				*ret;
+	char				*t;
+	size_t				len, nterms;
+	int					max = PG_GETARG_INT32(1);
+	instr_time			start;
+
+	toys_stats_begin(&start);
+
+	if (term_space_init(&ts) == -1)
+		elog(ERROR, "trgm_tag: out of memory");
+
+	if (term_space_add_datum(&ts, PG_GETARG_DATUM(0), 0) == -1)
+		elog(ERROR, "trgm_tag: out of memory");
+
+	t = term_space_tag(&ts, (size_t)max);
+	nterms = ts.nused;
+	term_space_free(&ts);
+
+	toys_stats_end(&trgm_stats_tag, &start, TRGM_ARG_BYTES(0), nterms);
+
+	if (t == NULL)
+		PG_RETURN_NULL();
+
+	len = strlen(t);
+	ret = (text *)palloc(len + VARHDRSZ);
+	memcpy(VARDATA(ret), t, len);
+	SET_VARSIZE(ret, len + VARHDRSZ);
+
+	trgm_free(t);
+
+	PG_RETURN_TEXT_P(ret);
+}
+
+/*
+ * In a scan like trgm_sml(body, $1, n) one argument is the same on every
+ * row. Its trigrams are kept in fn_extra for the rest of the query, and
+ * the argument is compared with the cached copy on every call in case the
+ * planner's idea of a stable argument is off.
+ */
+typedef struct {
+	int					argno;		/* cached argument, -1 if none is stable */
+	text				*datum;
+	struct term_cache	*terms;
+} TrgmSmlCache;
+
+static TrgmSmlCache *
+trgm_sml_cache(FunctionCallInfo fcinfo)
+{
+	FmgrInfo			*flinfo = fcinfo->flinfo;
+	TrgmSmlCache		*cache = (TrgmSmlCache *)flinfo->fn_extra;
+	MemoryContext		oldcxt;
+	text				*datum;
+
+	if (cache == NULL) {
+		cache = (TrgmSmlCache *)MemoryContextAllocZero(flinfo->fn_mcxt,
+				sizeof(TrgmSmlCache));
+
+		if (get_fn_expr_arg_stable(flinfo, 1))
+			cache->argno = 1;
+		else if (get_fn_expr_arg_stable(flinfo, 0))
+			cache->argno = 0;
+		else
+			cache->argno = -1;
+
+		flinfo->fn_extra = cache;
+	}
+
+	if (cache->argno < 0)
+		return NULL;
+
+	datum = PG_GETARG_TEXT_PP(cache->argno);
+
+	if (cache->datum != NULL
+		&& VARSIZE_ANY_EXHDR(cache->datum) == VARSIZE_ANY_EXHDR(datum)
+		&& memcmp(VARDATA_ANY(cache->datum), VARDATA_ANY(datum),
+				  VARSIZE_ANY_EXHDR(datum)) == 0)
+		return cache;
+
+	if (cache->datum) {
+		pfree(cache->datum);
+		trgm_free(cache->terms);
+		cache->datum = NULL;
+	}
+
+	oldcxt = MemoryContextSwitchTo(flinfo->fn_mcxt);
+
+	cache->terms = term_cache_build(VARDATA_ANY(datum),
+			VARSIZE_ANY_EXHDR(datum));
+	if (cache->terms == NULL)
+		elog(ERROR, "trgm_sml: out of memory");
+
+	cache->datum = (text *)palloc(VARSIZE_ANY(datum));
+	memcpy(cache->datum, datum, VARSIZE_ANY(datum));
+
+	MemoryContextSwitchTo(oldcxt);
+
+	return cache;
+}
+
+/* both text arguments into a term space, one of them from the cache */
+static void
+trgm_sml_fill(FunctionCallInfo fcinfo, struct term_space *ts,
+		const char *prefix)
+{
+	TrgmSmlCache		*cache = trgm_sml_cache(fcinfo);
+	int					rc;
+
+	if (term_space_init(ts) == -1)
+		elog(ERROR, "%sout of memory", prefix);
+
+	/* left side first either way, so that ties rank the same */
+	if (cache == NULL)
+		rc = (term_space_add_datum(ts, PG_GETARG_DATUM(0), 0) == -1
+			|| term_space_add_datum(ts, PG_GETARG_DATUM(1), 1) == -1);
+	else if (cache->argno == 0)
+		rc = (term_space_add_cache(ts, cache->terms, 0) == -1
+			|| term_space_add_datum(ts, PG_GETARG_DATUM(1), 1) == -1);
+	else
+		rc = (term_space_add_datum(ts, PG_GETARG_DATUM(0), 0) == -1
+			|| term_space_add_cache(ts, cache->terms, 1) == -1);
+
+	if (rc)
+		elog(ERROR, "%sout of memory", prefix);
+}
+
+Datum trgm_sml(PG_FUNCTION_ARGS)
+{
+	struct term_space	ts;
+	double				score;
+	int					max = PG_GETARG_INT32(2);
+	instr_time			start;
+
+	toys_stats_begin(&start);
+
+	trgm_sml_fill(fcinfo, &ts, "trgm_sml: ");
+
+	score = term_space_score(&ts, max, NULL, NULL, NULL);
+
+	toys_stats_end(&trgm_stats_sml, &start,
+			TRGM_ARG_BYTES(0) + TRGM_ARG_BYTES(1), ts.nused);
+
+	term_space_free(&ts);
+
+	PG_RETURN_FLOAT8(score);
+}
+
+/* trgm_sml(a, b, -1) >= threshold, mostly without the whole cosine */
+Datum trgm_sml_above(PG_FUNCTION_ARGS)
+{
+	struct term_space	ts;
+	double				threshold = PG_GETARG_FLOAT8(2);
+	bool				above;
+	instr_time			start;
+
+	toys_stats_begin(&start);
+
+	trgm_sml_fill(fcinfo, &ts, "trgm_sml_above: ");
+
+	above = term_space_above(&ts, threshold);
+
+	toys_stats_end(&trgm_stats_sml_above, &start,
+			TRGM_ARG_BYTES(0) + TRGM_ARG_BYTES(1), ts.nused);
+
+	term_space_free(&ts);
+
+	PG_RETURN_BOOL(above);
+}
+
+/*
+ * The operators work on the hashed trigram vectors, so that they agree with
+ * what the GiST and GIN operator classes can index. Apart from hash
+ * collisions the score is trgm_sml(a, b, -1). In doc %% 'query' and in an
+ * ORDER BY doc <-> 'query' one side is the same on every row and heap
+ * recheck; its vector is kept in fn_extra, as TrgmSmlCache keeps terms.
+ */
+typedef struct {
+	int					argno;		/* cached argument, -1 if none is stable */
+	text				*datum;
+	TrgmVector			*vec;
+} TrgmOpCache;
+
+static double
+trgm_op_score(FunctionCallInfo fcinfo, ToysStatsEntry *stats)
+{
+	FmgrInfo			*flinfo = fcinfo->flinfo;
+	TrgmOpCache			*cache = (TrgmOpCache *)flinfo->fn_extra;
+	TrgmVector			*vec[2] = {NULL, NULL};
+	MemoryContext		oldcxt;
+	text				*datum;
+	double				score;
+	int					i;
+	instr_time			start;
+
+	toys_stats_begin(&start);
+
+	if (cache == NULL) {
+		cache = (TrgmOpCache *)MemoryContextAllocZero(flinfo->fn_mcxt,
+				sizeof(TrgmOpCache));
+
+		if (get_fn_expr_arg_stable(flinfo, 1))
+			cache->argno = 1;
+		else if (get_fn_expr_arg_stable(flinfo, 0))
+			cache->argno = 0;
+		else
+			cache->argno = -1;
+
+		flinfo->fn_extra = cache;
+	}
+
+	if (cache->argno >= 0) {
+		datum = PG_GETARG_TEXT_PP(cache->argno);
+
+		if (cache->datum == NULL
+			|| VARSIZE_ANY_EXHDR(cache->datum) != VARSIZE_ANY_EXHDR(datum)
+			|| memcmp(VARDATA_ANY(cache->datum), VARDATA_ANY(datum),
+					  VARSIZE_ANY_EXHDR(datum)) != 0) {
+			if (cache->datum) {
+				pfree(cache->datum);
+				pfree(cache->vec);
+				cache->datum = NULL;
+			}
+
+			oldcxt = MemoryContextSwitchTo(flinfo->fn_mcxt);
+			cache->vec = trgm_vector_from_text(datum);
+			cache->datum = (text *)palloc(VARSIZE_ANY(datum));
+			memcpy(cache->datum, datum, VARSIZE_ANY(datum));
+			MemoryContextSwitchTo(oldcxt);
+		}
+
+		vec[cache->argno] = cache->vec;
+	}
+
+	for (i = 0; i < 2; i++)
+		if (vec[i] == NULL)
+			vec[i] = trgm_vector_from_text(PG_GETARG_TEXT_PP(i));
+
+	score = trgm_vector_similarity(vec[0]->entries, vec[0]->nentries,
+			vec[1]->entries, vec[1]->nentries);
+
+	toys_stats_end(stats, &start, TRGM_ARG_BYTES(0) + TRGM_ARG_BYTES(1),
+			vec[0]->nentries + vec[1]->nentries);
+
+	for (i = 0; i < 2; i++)
+		if (i != cache->argno)
+			pfree(vec[i]);
+
+	return score;
+}
+
+Datum trgm_sml_op(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(trgm_op_score(fcinfo, &trgm_stats_op)
+			>= trgm_sml_threshold);
+}
+
+Datum trgm_sml_dist(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_FLOAT8(1.0 - trgm_op_score(fcinfo, &trgm_stats_dist));
+}
+
+/*
+ * trgm_tag_agg counts the trigrams of all rows in a single term space,
+ * everything on the left side, living in the aggregate context. The limit
+ * is an aggregated argument, the final function only sees the state.
+ */
+typedef struct {
+	int					max;
+	struct term_space	ts;
+} TrgmTagAggState;
+
+static TrgmTagAggState *
+trgm_tag_agg_state(MemoryContext aggcxt, int max)
+{
+	TrgmTagAggState	*state;
+	MemoryContext	oldcxt;
+
+	oldcxt = MemoryContextSwitchTo(aggcxt);
+
+	state = (TrgmTagAggState *)palloc(sizeof(TrgmTagAggState));
+	state->max = max;
+	if (term_space_init(&state->ts) == -1)
+		elog(ERROR, "trgm_tag_agg: out of memory");
+
+	MemoryContextSwitchTo(oldcxt);
+
+	return state;
+}
+
+Datum trgm_tag_agg_trans(PG_FUNCTION_ARGS)
+{
+	MemoryContext	aggcxt, oldcxt;
+	TrgmTagAggState	*state;
+	text			*datum;
+	int				rc;
+
+	if (!AggCheckCallContext(fcinfo, &aggcxt))
+		elog(ERROR, "trgm_tag_agg_trans: called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		state = trgm_tag_agg_state(aggcxt,
+				PG_ARGISNULL(2) ? -1 : PG_GETARG_INT32(2));
+	else
+		state = (TrgmTagAggState *)PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	datum = PG_GETARG_TEXT_PP(1);
+
+	oldcxt = MemoryContextSwitchTo(aggcxt);
+	rc = term_space_add_trgm(&state->ts, VARDATA_ANY(datum),
+			VARSIZE_ANY_EXHDR(datum), 0);
+	MemoryContextSwitchTo(oldcxt);
+
+	if (rc == -1)
+		elog(ERROR, "trgm_tag_agg: out of memory");
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum trgm_tag_agg_combine(PG_FUNCTION_ARGS)
+{
+	MemoryContext		aggcxt, oldcxt;
+	TrgmTagAggState		*state[2];
+	struct term_vector	**v;
+
+	if (!AggCheckCallContext(fcinfo, &aggcxt))
+		elog(ERROR, "trgm_tag_agg_combine: called in non-aggregate context");
+
+	state[0] = PG_ARGISNULL(0) ? NULL : (TrgmTagAggState *)PG_GETARG_POINTER(0);
+	state[1] = PG_ARGISNULL(1) ? NULL : (TrgmTagAggState *)PG_GETARG_POINTER(1);
+
+	if (state[1] == NULL)
+		PG_RETURN_POINTER(state[0]);
+
+	if (state[0] == NULL)
+		state[0] = trgm_tag_agg_state(aggcxt, state[1]->max);
+
+	oldcxt = MemoryContextSwitchTo(aggcxt);
+
+	for (v = state[1]->ts.seq.tv; v < state[1]->ts.seq.last; v++) {
+		if (term_space_add_n(&state[0]->ts, (*v)->trgm, (*v)->len,
+					(*v)->hash, 0, (*v)->lhs) == -1)
+			elog(ERROR, "trgm_tag_agg: out of memory");
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	PG_RETURN_POINTER(state[0]);
+}
+
+/* the limit, the number of terms, then length, count and bytes of each */
+Datum trgm_tag_agg_serialize(PG_FUNCTION_ARGS)
+{
+	TrgmTagAggState		*state = (TrgmTagAggState *)PG_GETARG_POINTER(0);
+	struct term_vector	**v;
+	StringInfoData		buf;
+
+	pq_begintypsend(&buf);
+
+	pq_sendint32(&buf, state->max);
+	pq_sendint64(&buf, state->ts.seq.last - state->ts.seq.tv);
+
+	for (v = state->ts.seq.tv; v < state->ts.seq.last; v++) {
+		pq_sendint32(&buf, (uint32)(*v)->len);
+		pq_sendint64(&buf, (int64)(*v)->lhs);
+		pq_sendbytes(&buf, (*v)->trgm, (*v)->len);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+Datum trgm_tag_agg_deserialize(PG_FUNCTION_ARGS)
+{
+	bytea			*sstate = PG_GETARG_BYTEA_PP(0);
+	MemoryContext	aggcxt, oldcxt;
+	TrgmTagAggState	*state;
+	StringInfoData	buf;
+	int64			nterms, count;
+	uint32			len;
+	const char		*trgm;
+
+	if (!AggCheckCallContext(fcinfo, &aggcxt))
+		elog(ERROR, "trgm_tag_agg_deserialize: called in non-aggregate context");
+
+	initStringInfo(&buf);
+	appendBinaryStringInfo(&buf,
+			VARDATA_ANY(sstate), VARSIZE_ANY_EXHDR(sstate));
+
+	state = trgm_tag_agg_state(aggcxt, (int32)pq_getmsgint(&buf, 4));
+	nterms = pq_getmsgint64(&buf);
+
+	oldcxt = MemoryContextSwitchTo(aggcxt);
+
+	while (nterms-- > 0) {
+		len = pq_getmsgint(&buf, 4);
+		count = pq_getmsgint64(&buf);
+		trgm = pq_getmsgbytes(&buf, len);
+
+		if (term_space_add_n(&state->ts, trgm, len, trgm_hash(trgm, len),
+					0, (size_t)count) == -1)
+			elog(ERROR, "trgm_tag_agg: out of memory");
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	pq_getmsgend(&buf);
+	pfree(buf.data);
+
+	PG_RETURN_POINTER(state);
+}
+
+/* a trigram without the space that ends every word of it */
+static text *
+term_vector_text(const struct term_vector *tv)
+{
+	size_t			len = tv->len;
+
+	if (len > 0 && tv->trgm[len - 1] == ' ')
+		len--;
+
+	return cstring_to_text_with_len(tv->trgm, len);
+}
+
+/* the max most frequent trigrams of all rows as a trgm_count[] */
+Datum trgm_tag_agg_final(PG_FUNCTION_ARGS)
+{
+	TrgmTagAggState		*state;
+	struct term_vector	**v, **last;
+	Oid					rettype, elemtype;
+	TupleDesc			tupdesc;
+	Datum				*elems, values[2];
+	bool				nulls[2] = {false, false};
+	int16				typlen;
+	bool				typbyval;
+	char				typalign;
+	int					n = 0;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (TrgmTagAggState *)PG_GETARG_POINTER(0);
+
+	rettype = get_fn_expr_rettype(fcinfo->flinfo);
+	if (!OidIsValid(rettype) ||
+		!OidIsValid(elemtype = get_element_type(rettype)))
+		elog(ERROR, "trgm_tag_agg_final: could not determine result type");
+
+	tupdesc = lookup_rowtype_tupdesc_copy(elemtype, -1);
+	tupdesc = BlessTupleDesc(tupdesc);
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+
+	term_space_sort(&state->ts, state->max);
+
+	last = (state->max < 0 ||
+			state->max > state->ts.seq.last - state->ts.seq.tv) ?
+		state->ts.seq.last : state->ts.seq.tv + state->max;
+
+	elems = (Datum *)palloc(sizeof(Datum) * (last - state->ts.seq.tv + 1));
+
+	for (v = state->ts.seq.tv; v < last; v++) {
+		values[0] = PointerGetDatum(term_vector_text(*v));
+		values[1] = Int64GetDatum((int64)(*v)->lhs);
+
+		elems[n++] = HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls));
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, n, elemtype,
+				typlen, typbyval, typalign));
+}
+
+/* the max most frequent terms of a term space as trgm_count rows */
+static void
+trgm_tags_emit(ReturnSetInfo *rsinfo, struct term_space *ts, int max)
+{
+	struct term_vector	**v, **last;
+	Datum				values[2];
+	bool				nulls[2] = {false, false};
+
+	term_space_sort(ts, max);
+
+	last = (max < 0 || max > ts->seq.last - ts->seq.tv) ?
+		ts->seq.last : ts->seq.tv + max;
+
+	for (v = ts->seq.tv; v < last; v++) {
+		values[0] = PointerGetDatum(term_vector_text(*v));
+		values[1] = Int64GetDatum((int64)(*v)->lhs);
+
+		tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc,
+				values, nulls);
+	}
+}
+
+/* trgm_tag as (trigram, count) rows, most frequent first */
+Datum trgm_tags(PG_FUNCTION_ARGS)
+{
+	int					max = PG_GETARG_INT32(1);
+	ReturnSetInfo		*rsinfo;
+	struct term_space	ts;
+	instr_time			start;
+
+	toys_stats_begin(&start);
+
+	rsinfo = trgm_materialize(fcinfo, "trgm_tags: ");
+
+	if (term_space_init(&ts) == -1)
+		elog(ERROR, "trgm_tags: out of memory");
+
+	if (term_space_add_datum(&ts, PG_GETARG_DATUM(0), 0) == -1)
+		elog(ERROR, "trgm_tags: out of memory");
+
+	trgm_tags_emit(rsinfo, &ts, max);
+
+	toys_stats_end(&trgm_stats_tags, &start, TRGM_ARG_BYTES(0), ts.nused);
+
+	term_space_free(&ts);
+
+	return (Datum)0;
+}
+
+/*
+ * Characters are UTF-8 sequences in a UTF8 database and bytes in a single
+ * byte encoding, other encodings are not supported.
+ */
+static int
+trgm_char_utf8(const char *prefix, int gram)
+{
+	if (gram < 1 || gram > TRGM_MAX_GRAM)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("%sgram must be between 1 and %d",
+						prefix, TRGM_MAX_GRAM)));
+
+	if (GetDatabaseEncoding() == PG_UTF8)
+		return 1;
+
+	if (pg_database_encoding_max_length() == 1)
+		return 0;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("%scharacter n-grams need a UTF8 or single byte "
+					"database encoding", prefix)));
+	return 0;
+}
+
+/* trgm_sml over the character n-grams of the words instead of trigrams */
+Datum trgm_sml_char(PG_FUNCTION_ARGS)
+{
+	text				*a = PG_GETARG_TEXT_PP(0);
+	text				*b = PG_GETARG_TEXT_PP(1);
+	int					gram = PG_GETARG_INT32(2);
+	int					max = PG_GETARG_INT32(3);
+	int					utf8 = trgm_char_utf8("trgm_sml_char: ", gram);
+	struct term_space	ts;
+	double				score;
+	instr_time			start;
+
+	toys_stats_begin(&start);
+
+	if (term_space_init(&ts) == -1)
+		elog(ERROR, "trgm_sml_char: out of memory");
+
+	if (term_space_add_chars(&ts, VARDATA_ANY(a), VARSIZE_ANY_EXHDR(a),
+				0, gram, utf8) == -1
+		|| term_space_add_chars(&ts, VARDATA_ANY(b), VARSIZE_ANY_EXHDR(b),
+				1, gram, utf8) == -1)
+		elog(ERROR, "trgm_sml_char: out of memory");
+
+	score = term_space_score(&ts, max, NULL, NULL, NULL);
+
+	toys_stats_end(&trgm_stats_sml_char, &start,
+			VARSIZE_ANY_EXHDR(a) + VARSIZE_ANY_EXHDR(b), ts.nused);
+
+	term_space_free(&ts);
+
+	PG_RETURN_FLOAT8(score);
+}
+
+Datum trgm_tags_char(PG_FUNCTION_ARGS)
+{
+	text				*datum = PG_GETARG_TEXT_PP(0);
+	int					gram = PG_GETARG_INT32(1);
+	int					max = PG_GETARG_INT32(2);
+	int					utf8 = trgm_char_utf8("trgm_tags_char: ", gram);
+	ReturnSetInfo		*rsinfo;
+	struct term_space	ts;
+	instr_time			start;
+
+	toys_stats_begin(&start);
+
+	rsinfo = trgm_materialize(fcinfo, "trgm_tags_char: ");
+
+	if (term_space_init(&ts) == -1)
+		elog(ERROR, "trgm_tags_char: out of memory");
+
+	if (term_space_add_chars(&ts, VARDATA_ANY(datum),
+				VARSIZE_ANY_EXHDR(datum), 0, gram, utf8) == -1)
+		elog(ERROR, "trgm_tags_char: out of memory");
+
+	trgm_tags_emit(rsinfo, &ts, max);
+
+	toys_stats_end(&trgm_stats_tags_char, &start,
+			VARSIZE_ANY_EXHDR(datum), ts.nused);
+
+	term_space_free(&ts);
+
+	return (Datum)0;
 }
 
 #undef VAR_STRLEN
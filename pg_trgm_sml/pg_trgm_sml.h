@@ -0,0 +1,87 @@
+/*
+ * Text Similarity using Trigram
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ */
+
+#ifndef PG_TRGM_SML_H
+#define PG_TRGM_SML_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A trigram reduced to its hash and number of occurrences. A trgm_vector
+ * is an array of these sorted by hash, so that two vectors can be scored
+ * by a linear merge. Distinct trigrams sharing a hash are counted together.
+ */
+struct trgm_entry {
+	uint32_t	hash;
+	uint32_t	count;
+};
+
+/*
+ * Weight of the term of rank rank occurring count times in a side of doclen
+ * trigrams in all, used in place of the count when scoring.
+ */
+typedef double (*trgm_weight_fn)(uint32_t hash, size_t rank, size_t count,
+		size_t doclen, void *arg);
+
+/*
+ * Called for each of the nterms terms to be weighted, in rank order, before
+ * the first weight: what the weights need can be fetched in one go.
+ */
+typedef void (*trgm_terms_fn)(uint32_t hash, size_t rank, size_t nterms,
+		void *arg);
+
+#ifndef CLI_DEBUG
+
+#include <postgres.h>
+#include <fmgr.h>
+
+typedef struct {
+	int32				vl_len_;	/* varlena header (do not touch directly!) */
+	uint32				nentries;
+	struct trgm_entry	entries[FLEXIBLE_ARRAY_MEMBER];
+} TrgmVector;
+
+#define TRGMV_HDRSZ			offsetof(TrgmVector, entries)
+#define TRGMV_SIZE(N)		(TRGMV_HDRSZ + sizeof(struct trgm_entry) * (N))
+
+#define DatumGetTrgmVectorP(X)		((TrgmVector *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_TRGMVECTOR_P(N)	DatumGetTrgmVectorP(PG_GETARG_DATUM(N))
+#define PG_RETURN_TRGMVECTOR_P(X)	PG_RETURN_POINTER(X)
+
+/* operator strategies shared by the GiST and GIN operator classes */
+#define TrgmSimilarityStrategyNumber	1
+#define TrgmDistanceStrategyNumber		2
+
+/* trgm_sml.similarity_threshold, used by the %% operator */
+extern double trgm_sml_threshold;
+
+extern TrgmVector *trgm_vector_from_text(text *datum);
+extern double trgm_vector_similarity(const struct trgm_entry *a, size_t na,
+		const struct trgm_entry *b, size_t nb);
+extern double trgm_vector_score(const struct trgm_entry *a, size_t na,
+		const struct trgm_entry *b, size_t nb, int n);
+extern double trgm_text_score(text *a, text *b, int n,
+		trgm_terms_fn terms, trgm_weight_fn weight, void *arg);
+extern char **trgm_text_trigrams(text *datum, int *n);
+
+/* trgm_batch.c */
+extern struct ReturnSetInfo *trgm_materialize(FunctionCallInfo fcinfo,
+		const char *prefix);
+
+/* trgm_idf.c */
+extern void trgm_idf_init(void);
+
+/* trgm_dict.c */
+extern void trgm_dict_init(void);
+
+/* trgm_worker.c */
+extern void trgm_worker_init(void);
+
+#endif
+
+#endif
@@ -0,0 +1,82 @@
+create temp table sml_docs (id int primary key, doc text);
+insert into sml_docs select i, (array['postgres', 'postgresql', 'postgis', 'progress', 'mysql', 'sqlite', 'the quick brown fox', 'the quick brown dog', 'a lazy dog', 'lazy fox'])[i % 10 + 1] || ' ' || (i / 10) from generate_series(0, 999) i;
+insert into sml_docs values (1000, ''), (1001, NULL);
+select trgm_sml('postgres', 'postgresql', -1), trgm_sml('postgres', 'postgresql', 2), trgm_sml('postgres', '', -1), trgm_tag('the quick brown fox', 3);
+select to_trgm_vector('abc abc'), to_trgm_vector('');
+select '0c3f9a21:1 8a0b7d10:3 0c3f9a21:2'::trgm_vector, ''::trgm_vector, '0c3f9a21:0'::trgm_vector;
+select to_trgm_vector('postgres')::text::trgm_vector::text = to_trgm_vector('postgres')::text;
+select trgm_sml(to_trgm_vector('postgres'), to_trgm_vector('postgresql'), -1), trgm_sml('postgres'::text, 'postgresql', -1), trgm_sml(to_trgm_vector('postgres'), to_trgm_vector(''), -1);
+select 'xyz:1'::trgm_vector;
+set trgm_sml.similarity_threshold = 0.5;
+select 'postgres' %% 'postgresql', 'postgres' %% 'mysql', 'postgres' <-> 'postgresql', 1 - trgm_sml('postgres'::text, 'postgresql', -1);
+create temp table sml_seq as select id from sml_docs where doc %% 'postgres 12';
+create temp table sml_knn as select id, doc <-> 'postgis 7' as dist from sml_docs order by doc <-> 'postgis 7', id limit 20;
+select count(*) filter (where doc %% 'postgres 12') = count(*) filter (where 'postgres 12' %% doc), max(abs((doc <-> 'postgis 7') - ('postgis 7' <-> doc))) < 1e-9, count(*) filter (where doc %% doc) from sml_docs;
+create index sml_docs_gist on sml_docs using gist (doc gist_trgm_sml_ops);
+set enable_seqscan = off;
+set enable_bitmapscan = off;
+explain (costs off) select id from sml_docs where doc %% 'postgres 12';
+select count(*), count(s.id), count(d.id) from (select id from sml_docs where doc %% 'postgres 12') d full join sml_seq s using (id) where s.id is null or d.id is null;
+explain (costs off) select id from sml_docs order by doc <-> 'postgis 7' limit 20;
+select array_agg(dist order by dist) = (select array_agg(dist order by dist) from sml_knn) from (select doc <-> 'postgis 7' as dist from sml_docs order by doc <-> 'postgis 7' limit 20) t;
+drop index sml_docs_gist;
+create index sml_docs_gin on sml_docs using gin (doc gin_trgm_sml_ops);
+set enable_bitmapscan = on;
+explain (costs off) select id from sml_docs where doc %% 'postgres 12';
+select count(*), count(s.id), count(d.id) from (select id from sml_docs where doc %% 'postgres 12') d full join sml_seq s using (id) where s.id is null or d.id is null;
+select count(*) from sml_docs where doc %% '';
+set trgm_sml.similarity_threshold = 0;
+select count(*), (select count(*) from sml_docs where doc is not null) from sml_docs where doc %% 'postgres 12';
+select count(*) from sml_docs where doc %% '';
+set trgm_sml.similarity_threshold = 0.5;
+reset enable_seqscan;
+reset enable_bitmapscan;
+drop index sml_docs_gin;
+reset trgm_sml.similarity_threshold;
+select * from trgm_sml_matrix(array['postgres', 'postgresql', NULL, 'mysql', '', 'postgis'], -1) order by i, j;
+select count(*) from trgm_sml_matrix((select array_agg(doc order by id) from sml_docs where id < 100), -1) m full join (select a.id + 1 as i, b.id + 1 as j, trgm_sml(to_trgm_vector(a.doc), to_trgm_vector(b.doc), -1) as score from sml_docs a join sml_docs b on a.id < b.id where a.id < 100 and b.id < 100 and trgm_sml(to_trgm_vector(a.doc), to_trgm_vector(b.doc), -1) > 0) s using (i, j) where m.score is null or s.score is null or abs(m.score - s.score) > 1e-9;
+select * from trgm_sml_join(array['postgres', 'mysql', NULL], array['postgresql', 'postgis', 'sqlite', ''], 0.3) order by i, j;
+select count(*) from trgm_sml_join((select array_agg(doc order by id) from sml_docs where id < 100), (select array_agg(doc order by id) from sml_docs where id between 100 and 199), 0.6) m full join (select a.id + 1 as i, b.id - 99 as j, trgm_sml(to_trgm_vector(a.doc), to_trgm_vector(b.doc), -1) as score from sml_docs a, sml_docs b where a.id < 100 and b.id between 100 and 199 and trgm_sml(to_trgm_vector(a.doc), to_trgm_vector(b.doc), -1) >= 0.6) s using (i, j) where m.score is null or s.score is null or abs(m.score - s.score) > 1e-9;
+select trgm_sml_join(array['a'], array['a'], 0);
+select * from trgm_tags('the quick brown fox jumps over the lazy dog the end', 5);
+select * from trgm_tags('', 5);
+select trgm_tag_agg(doc, 5) from sml_docs;
+select array_agg(row(trgm, n)::trgm_count order by n desc, trgm) from (select trgm, sum(count)::bigint as n from sml_docs, trgm_tags(doc, -1) group by trgm order by n desc, trgm limit 5) t;
+create table sml_par as select * from sml_docs;
+set parallel_setup_cost = 0;
+set parallel_tuple_cost = 0;
+set min_parallel_table_scan_size = 0;
+set max_parallel_workers_per_gather = 2;
+explain (costs off) select trgm_tag_agg(doc, 5) from sml_par;
+select trgm_tag_agg(doc, 5) = (select trgm_tag_agg(doc, 5) from sml_docs) from sml_par;
+reset parallel_setup_cost;
+reset parallel_tuple_cost;
+reset min_parallel_table_scan_size;
+reset max_parallel_workers_per_gather;
+drop table sml_par;
+select trgm_sml_char('postgres', 'postgresql', 3, -1), trgm_sml_char('postgres', 'postgresql', 1, -1), trgm_sml_char('日本語の文章', '日本語の文', 2, -1);
+select * from trgm_tags_char('abcabc', 2, -1);
+select * from trgm_tags_char('日本日本', 2, -1);
+select trgm_sml_char('a', 'b', 0, -1);
+select a, b, th, trgm_sml_above(a, b, th), trgm_sml(a, b, -1) >= th from (values ('postgres', 'postgresql'), ('postgres', 'mysql'), ('postgres', ''), ('', ''), ('the quick brown fox', 'the quick brown dog')) t(a, b), (values (0.0::float8), (0.3), (0.5), (0.8), (1.0)) h(th);
+select count(*) from sml_docs a, sml_docs b, (values (0.2::float8), (0.5), (0.7)) h(th) where a.id < 50 and b.id < 50 and trgm_sml_above(a.doc, b.doc, th) <> (trgm_sml(a.doc, b.doc, -1) >= th);
+select to_trgm_ids('postgres');
+select to_trgm_ids('postgres', true), to_trgm_ids('postgresql', true), to_trgm_ids('mysql', true);
+select to_trgm_ids('postgres'), to_trgm_ids('unknown words');
+select trgm_ids_sml(to_trgm_ids('aaaaaa', true), to_trgm_ids('aaa', true)), trgm_sml('aaaaaa', 'aaa', -1);
+select trgm_ids_sml(to_trgm_ids('postgres'), to_trgm_ids('postgresql')), trgm_sml('postgres', 'postgresql', -1), trgm_ids_sml(to_trgm_ids('postgres'), to_trgm_ids('mysql')), trgm_sml('postgres', 'mysql', -1), trgm_ids_sml('{}', '{}');
+create temp table sml_watched (at timestamptz primary key, doc text, v trgm_vector, check (v is null or doc <> 'bad'));
+select trgm_sml_watch('sml_watched', 'doc', 'v');
+set timezone = 'America/New_York';
+set datestyle = 'SQL, DMY';
+insert into sml_watched values ('2024-03-10 01:30:00.123456', 'postgres'), ('2024-11-03 01:30:00', 'bad'), ('2024-11-03 12:00:00+00', 'postgresql');
+reset datestyle;
+set timezone = 'Asia/Tokyo';
+select trgm_sml_process_queue(100);
+select at, doc, v::text = to_trgm_vector(doc)::text from sml_watched order by at;
+update sml_watched set doc = 'postgis' where doc = 'postgres';
+select trgm_sml_process_queue(100);
+select at, doc, v::text = to_trgm_vector(doc)::text from sml_watched order by at;
+select trgm_sml_unwatch('sml_watched');
+reset timezone;
+select * from pg_toys_stats where module = 'pg_trgm_sml';
@@ -0,0 +1,497 @@
+/*
+ * Similarity over whole batches of documents
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ */
+
+#include <math.h>
+
+#include "pg_trgm_sml.h"
+
+#include <catalog/pg_type.h>
+#include <funcapi.h>
+#include <miscadmin.h>
+#include <utils/array.h>
+#include <utils/tuplestore.h>
+
+#include "pg_toys_stats.h"
+
+PG_FUNCTION_INFO_V1(trgm_sml_matrix);
+PG_FUNCTION_INFO_V1(trgm_sml_join);
+Datum trgm_sml_matrix(PG_FUNCTION_ARGS);
+Datum trgm_sml_join(PG_FUNCTION_ARGS);
+
+/* items are the pairs returned */
+static ToysStatsEntry trgm_stats_matrix = TOYS_STATS_ENTRY("trgm_sml_matrix");
+static ToysStatsEntry trgm_stats_join = TOYS_STATS_ENTRY("trgm_sml_join");
+
+/* slack for bounds computed in floating point, the exact score decides */
+#define TRGM_BOUND_EPSILON	1e-9
+
+/* the documents of a text[], NULL elements have no vector */
+typedef struct {
+	int				ndocs;
+	TrgmVector		**vec;
+	double			*norm;
+	double			*linf;		/* largest count over the norm */
+	double			*l1;		/* sum of the counts over the norm */
+} TrgmDocs;
+
+/* one (trigram, document) occurrence of an inverted index */
+typedef struct {
+	uint32			hash;
+	int32			doc;
+	uint32			count;
+	uint32			entry;		/* index of the entry in the document */
+} TrgmPosting;
+
+/* a trigram of a document of the indexed side of a join */
+typedef struct {
+	uint32			hash;
+	uint32			df;			/* documents of the side containing it */
+	uint32			count;
+} TrgmFeature;
+
+ReturnSetInfo *
+trgm_materialize(FunctionCallInfo fcinfo, const char *prefix)
+{
+	ReturnSetInfo	*rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	MemoryContext	oldcxt;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		elog(ERROR, "%scontext does not accept a set result", prefix);
+
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		elog(ERROR, "%smaterialize mode required, but it is not allowed "
+				"in this context", prefix);
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "%sreturn type must be a row type", prefix);
+
+	oldcxt = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setDesc = CreateTupleDescCopy(tupdesc);
+	rsinfo->setResult = tuplestore_begin_heap(
+			rsinfo->allowedModes & SFRM_Materialize_Random, false, work_mem);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	return rsinfo;
+}
+
+static void
+trgm_emit(ReturnSetInfo *rsinfo, int i, int j, double score)
+{
+	Datum			values[3];
+	bool			nulls[3] = {false, false, false};
+
+	values[0] = Int32GetDatum(i);
+	values[1] = Int32GetDatum(j);
+	values[2] = Float8GetDatum(score);
+
+	tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+}
+
+static void
+trgm_docs_load(TrgmDocs *docs, ArrayType *arr)
+{
+	Datum			*elems;
+	bool			*nulls;
+	int				i;
+	uint32			k;
+
+	if (ARR_NDIM(arr) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("array must be one-dimensional")));
+
+	deconstruct_array(arr, TEXTOID, -1, false, TYPALIGN_INT,
+			&elems, &nulls, &docs->ndocs);
+
+	docs->vec = (TrgmVector **)palloc0(sizeof(TrgmVector *) *
+			(docs->ndocs + 1));
+	docs->norm = (double *)palloc0(sizeof(double) * (docs->ndocs + 1));
+	docs->linf = (double *)palloc0(sizeof(double) * (docs->ndocs + 1));
+	docs->l1 = (double *)palloc0(sizeof(double) * (docs->ndocs + 1));
+
+	for (i = 0; i < docs->ndocs; i++) {
+		if (nulls[i])
+			continue;
+
+		docs->vec[i] = trgm_vector_from_text(DatumGetTextPP(elems[i]));
+
+		for (k = 0; k < docs->vec[i]->nentries; k++) {
+			double		count = docs->vec[i]->entries[k].count;
+
+			docs->norm[i] += count * count;
+			docs->l1[i] += count;
+			if (count > docs->linf[i])
+				docs->linf[i] = count;
+		}
+		docs->norm[i] = sqrt(docs->norm[i]);
+
+		if (docs->norm[i] > 0.0) {
+			docs->l1[i] /= docs->norm[i];
+			docs->linf[i] /= docs->norm[i];
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+static int
+trgm_posting_cmp(const void *lhs, const void *rhs)
+{
+	const TrgmPosting	*lp = lhs, *rp = rhs;
+
+	if (lp->hash != rp->hash)
+		return lp->hash < rp->hash ? -1 : 1;
+
+	return lp->doc < rp->doc ? -1 : (lp->doc > rp->doc);
+}
+
+/* the trigrams of all documents, grouped by trigram then document */
+static TrgmPosting *
+trgm_postings(TrgmDocs *docs, size_t *npost)
+{
+	TrgmPosting		*post;
+	size_t			n = 0, k;
+	int32			i;
+	uint32			e;
+
+	for (i = 0; i < docs->ndocs; i++)
+		if (docs->vec[i])
+			n += docs->vec[i]->nentries;
+
+	post = (TrgmPosting *)palloc_extended(sizeof(TrgmPosting) * (n + 1),
+			MCXT_ALLOC_HUGE);
+
+	for (i = 0, k = 0; i < docs->ndocs; i++) {
+		if (docs->vec[i] == NULL)
+			continue;
+
+		for (e = 0; e < docs->vec[i]->nentries; e++, k++) {
+			post[k].hash = docs->vec[i]->entries[e].hash;
+			post[k].doc = i;
+			post[k].count = docs->vec[i]->entries[e].count;
+			post[k].entry = e;
+		}
+	}
+
+	qsort(post, n, sizeof(TrgmPosting), trgm_posting_cmp);
+
+	*npost = n;
+	return post;
+}
+
+static int
+trgm_feature_cmp(const void *lhs, const void *rhs)
+{
+	const TrgmFeature	*lf = lhs, *rf = rhs;
+
+	if (lf->df != rf->df)
+		return lf->df < rf->df ? -1 : 1;
+
+	return lf->hash < rf->hash ? -1 : (lf->hash > rf->hash);
+}
+
+static int
+trgm_int_cmp(const void *lhs, const void *rhs)
+{
+	int32			l = *(const int32 *)lhs, r = *(const int32 *)rhs;
+
+	return l < r ? -1 : (l > r);
+}
+
+/*
+ * Every pair of documents sharing at least one trigram, with its score.
+ * Inner products are summed along an inverted index of the batch, so that
+ * document i only meets the documents that follow it in the posting lists
+ * of its own trigrams.
+ */
+Datum trgm_sml_matrix(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_sml_matrix: "
+
+	ArrayType		*arr = PG_GETARG_ARRAYTYPE_P(0);
+	int				max = PG_GETARG_INT32(1);
+	ReturnSetInfo	*rsinfo;
+	TrgmDocs		docs;
+	TrgmPosting		*post;
+	size_t			npost, k, **own;
+	double			*acc, score;
+	int32			*touched, ntouched, i, j, t;
+	uint32			e;
+	instr_time		start;
+
+	toys_stats_begin(&start);
+
+	rsinfo = trgm_materialize(fcinfo, EPREFIX);
+
+	trgm_docs_load(&docs, arr);
+
+	post = trgm_postings(&docs, &npost);
+	own = (size_t **)palloc0(sizeof(size_t *) * (docs.ndocs + 1));
+
+	for (i = 0; i < docs.ndocs; i++)
+		if (docs.vec[i])
+			own[i] = (size_t *)palloc(sizeof(size_t) *
+					(docs.vec[i]->nentries + 1));
+
+	for (k = 0; k < npost; k++)
+		own[post[k].doc][post[k].entry] = k;
+
+	acc = (double *)palloc0(sizeof(double) * (docs.ndocs + 1));
+	touched = (int32 *)palloc(sizeof(int32) * (docs.ndocs + 1));
+
+	for (i = 0; i < docs.ndocs; i++) {
+		if (docs.vec[i] == NULL)
+			continue;
+
+		ntouched = 0;
+
+		/* documents sort after i inside the posting list of a trigram */
+		for (e = 0; e < docs.vec[i]->nentries; e++) {
+			double		count = docs.vec[i]->entries[e].count;
+
+			for (k = own[i][e] + 1;
+				 k < npost && post[k].hash == docs.vec[i]->entries[e].hash;
+				 k++) {
+				j = post[k].doc;
+				if (acc[j] == 0.0)
+					touched[ntouched++] = j;
+				acc[j] += count * post[k].count;
+			}
+		}
+
+		qsort(touched, ntouched, sizeof(int32), trgm_int_cmp);
+
+		for (t = 0; t < ntouched; t++) {
+			j = touched[t];
+
+			if (max < 0)
+				score = acc[j] / (docs.norm[i] * docs.norm[j]);
+			else
+				score = trgm_vector_score(
+						docs.vec[i]->entries, docs.vec[i]->nentries,
+						docs.vec[j]->entries, docs.vec[j]->nentries, max);
+
+			trgm_emit(rsinfo, i + 1, j + 1, score);
+			acc[j] = 0.0;
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	toys_stats_end(&trgm_stats_matrix, &start, VARSIZE_ANY_EXHDR(arr),
+			tuplestore_tuple_count(rsinfo->setResult));
+
+	return (Datum)0;
+
+	#undef EPREFIX
+}
+
+/*
+ * Every pair (i, j) of a document of the first array and one of the second
+ * whose score reaches the threshold, in no particular order.
+ *
+ * The smaller array is indexed the All-Pairs way: trigrams of a document
+ * are taken rarest first, and the leading ones are left out of the index
+ * for as long as their share of the norm stays below the threshold, since
+ * a pair can not reach it without also sharing one of the indexed
+ * trigrams. A candidate is then dropped as soon as
+ *
+ *		cos(x, y) <= min(|x|inf * |y|1, |y|inf * |x|1)
+ *
+ * or the inner product over the indexed trigrams plus the norm of the
+ * left out ones falls short, and what remains is scored exactly.
+ */
+Datum trgm_sml_join(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_sml_join: "
+
+	ArrayType		*arr[2] = {PG_GETARG_ARRAYTYPE_P(0),
+							   PG_GETARG_ARRAYTYPE_P(1)};
+	double			threshold = PG_GETARG_FLOAT8(2);
+	ReturnSetInfo	*rsinfo;
+	TrgmDocs		side[2], *ix, *pr;
+	TrgmPosting		*post, *index;
+	TrgmFeature		**feat;
+	uint32			*key;
+	size_t			npost, nindex = 0, nkeys = 0, *start, k, lo, hi;
+	double			*acc, *rest, score;
+	int32			*seen, *touched, ntouched, x, y, t;
+	bool			*pruned, swapped;
+	uint32			e, df;
+	instr_time		start;
+
+	if (!(threshold > 0.0 && threshold <= 1.0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg(EPREFIX "threshold must be greater than 0 and "
+						"at most 1")));
+
+	toys_stats_begin(&start);
+
+	rsinfo = trgm_materialize(fcinfo, EPREFIX);
+
+	trgm_docs_load(&side[0], arr[0]);
+	trgm_docs_load(&side[1], arr[1]);
+
+	swapped = side[1].ndocs < side[0].ndocs;
+	ix = &side[swapped ? 1 : 0];
+	pr = &side[swapped ? 0 : 1];
+
+	/* order the trigrams of every indexed document rarest first */
+	post = trgm_postings(ix, &npost);
+	feat = (TrgmFeature **)palloc0(sizeof(TrgmFeature *) * (ix->ndocs + 1));
+
+	for (y = 0; y < ix->ndocs; y++)
+		if (ix->vec[y])
+			feat[y] = (TrgmFeature *)palloc(sizeof(TrgmFeature) *
+					(ix->vec[y]->nentries + 1));
+
+	for (k = 0; k < npost; k += df) {
+		for (df = 1; k + df < npost && post[k + df].hash == post[k].hash; df++)
+			;
+
+		for (e = 0; e < df; e++) {
+			TrgmPosting	*p = &post[k + e];
+
+			feat[p->doc][p->entry].hash = p->hash;
+			feat[p->doc][p->entry].df = df;
+			feat[p->doc][p->entry].count = p->count;
+		}
+	}
+
+	/* index the suffix of every document, remember the norm of its prefix */
+	index = post;
+	rest = (double *)palloc0(sizeof(double) * (ix->ndocs + 1));
+
+	for (y = 0; y < ix->ndocs; y++) {
+		double		prefix = 0.0;
+
+		if (ix->vec[y] == NULL)
+			continue;
+
+		qsort(feat[y], ix->vec[y]->nentries, sizeof(TrgmFeature),
+				trgm_feature_cmp);
+
+		for (e = 0; e < ix->vec[y]->nentries; e++) {
+			double		w = feat[y][e].count / ix->norm[y];
+
+			if (sqrt(prefix + w * w) >= threshold - TRGM_BOUND_EPSILON)
+				break;
+			prefix += w * w;
+		}
+		rest[y] = sqrt(prefix);
+
+		for (; e < ix->vec[y]->nentries; e++, nindex++) {
+			index[nindex].hash = feat[y][e].hash;
+			index[nindex].doc = y;
+			index[nindex].count = feat[y][e].count;
+			index[nindex].entry = e;
+		}
+
+		pfree(feat[y]);
+	}
+
+	qsort(index, nindex, sizeof(TrgmPosting), trgm_posting_cmp);
+
+	/* where the postings of every distinct indexed trigram start */
+	key = (uint32 *)palloc_extended(sizeof(uint32) * (nindex + 1),
+			MCXT_ALLOC_HUGE);
+	start = (size_t *)palloc_extended(sizeof(size_t) * (nindex + 2),
+			MCXT_ALLOC_HUGE);
+
+	for (k = 0; k < nindex; k++) {
+		if (k == 0 || index[k].hash != index[k - 1].hash) {
+			key[nkeys] = index[k].hash;
+			start[nkeys++] = k;
+		}
+	}
+	start[nkeys] = nindex;
+
+	acc = (double *)palloc0(sizeof(double) * (ix->ndocs + 1));
+	pruned = (bool *)palloc0(sizeof(bool) * (ix->ndocs + 1));
+	seen = (int32 *)palloc(sizeof(int32) * (ix->ndocs + 1));
+	touched = (int32 *)palloc(sizeof(int32) * (ix->ndocs + 1));
+
+	for (y = 0; y < ix->ndocs; y++)
+		seen[y] = -1;
+
+	for (x = 0; x < pr->ndocs; x++) {
+		TrgmVector	*vx = pr->vec[x];
+
+		if (vx == NULL || vx->nentries == 0)
+			continue;
+
+		ntouched = 0;
+
+		for (e = 0; e < vx->nentries; e++) {
+			double		wx = vx->entries[e].count / pr->norm[x];
+
+			for (lo = 0, hi = nkeys; lo < hi;) {
+				size_t	mid = lo + (hi - lo) / 2;
+
+				if (key[mid] < vx->entries[e].hash)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+
+			if (lo == nkeys || key[lo] != vx->entries[e].hash)
+				continue;
+
+			for (k = start[lo]; k < start[lo + 1]; k++) {
+				y = index[k].doc;
+
+				if (seen[y] != x) {
+					seen[y] = x;
+					touched[ntouched++] = y;
+					acc[y] = 0.0;
+					pruned[y] = Min(pr->linf[x] * ix->l1[y],
+									ix->linf[y] * pr->l1[x])
+						< threshold - TRGM_BOUND_EPSILON;
+				}
+
+				if (!pruned[y])
+					acc[y] += wx * index[k].count / ix->norm[y];
+			}
+		}
+
+		qsort(touched, ntouched, sizeof(int32), trgm_int_cmp);
+
+		for (t = 0; t < ntouched; t++) {
+			y = touched[t];
+
+			if (pruned[y] ||
+				acc[y] + rest[y] < threshold - TRGM_BOUND_EPSILON)
+				continue;
+
+			score = trgm_vector_similarity(
+					vx->entries, vx->nentries,
+					ix->vec[y]->entries, ix->vec[y]->nentries);
+
+			if (score >= threshold) {
+				if (swapped)
+					trgm_emit(rsinfo, x + 1, y + 1, score);
+				else
+					trgm_emit(rsinfo, y + 1, x + 1, score);
+			}
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	toys_stats_end(&trgm_stats_join, &start,
+			VARSIZE_ANY_EXHDR(arr[0]) + VARSIZE_ANY_EXHDR(arr[1]),
+			tuplestore_tuple_count(rsinfo->setResult));
+
+	return (Datum)0;
+
+	#undef EPREFIX
+}
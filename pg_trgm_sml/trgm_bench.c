@@ -0,0 +1,462 @@
+/*
+ * Benchmark of the tokenizer and scoring, without a server
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ * Builds pg_trgm_sml.c as the command line version does and runs _trgm_sml,
+ * _trgm_tag, the thresholded check, the hashed vectors or the character
+ * n-gram scoring over a synthetic corpus, e.g.
+ *
+ *   make bench && ./trgm_bench -n 20000 -w 80 -c 0.3 -m sml
+ *
+ * Words are drawn from a Zipf distribution over a generated vocabulary of
+ * latin and CJK words, a document is CJK with the probability given by -c.
+ * The same seed gives the same corpus, so that runs before and after a
+ * change compare. -d prints the corpus, one document a line, and exits.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef CLI_DEBUG
+#define CLI_DEBUG
+#endif
+#define TRGM_BENCH
+
+/* every term space and vector allocation goes through here to be counted */
+static size_t bench_nalloc = 0;
+static size_t bench_nbytes = 0;
+
+static void *bench_malloc(size_t size)
+{
+	bench_nalloc++;
+	bench_nbytes += size;
+
+	return malloc(size);
+}
+
+#define trgm_malloc(S)		bench_malloc(S)
+#define trgm_free(P)		free(P)
+
+#include "pg_trgm_sml.c"
+
+enum bench_mode {
+	BENCH_SML,
+	BENCH_TAG,
+	BENCH_ABOVE,
+	BENCH_VECTOR,
+	BENCH_CHAR
+};
+
+static const char *bench_modes[] = {"sml", "tag", "above", "vector", "char"};
+
+struct bench_opts {
+	size_t			ndocs;
+	size_t			nwords;		/* average words of a document */
+	size_t			nvocab;
+	double			cjk;		/* share of CJK documents */
+	double			zipf;
+	enum bench_mode	mode;
+	int				top;		/* n of _trgm_sml, max of _trgm_tag */
+	int				gram;
+	double			threshold;
+	int				rounds;
+	unsigned long	seed;
+	int				dump;
+};
+
+struct bench_corpus {
+	char			**docs;
+	size_t			ndocs;
+	size_t			nbytes;
+};
+
+/* xorshift64*, good enough for a corpus and reproducible everywhere */
+static uint64_t bench_state;
+
+static uint64_t bench_rand(void)
+{
+	bench_state ^= bench_state >> 12;
+	bench_state ^= bench_state << 25;
+	bench_state ^= bench_state >> 27;
+
+	return bench_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double bench_uniform(void)
+{
+	return (bench_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double bench_now(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t bench_utf8(char *p, unsigned int c)
+{
+	p[0] = 0xe0 | (c >> 12);
+	p[1] = 0x80 | ((c >> 6) & 0x3f);
+	p[2] = 0x80 | (c & 0x3f);
+
+	return 3;
+}
+
+/* 2 to 10 latin letters, or 1 to 3 characters of the CJK unified block */
+static char *bench_word(int cjk)
+{
+	char			buf[16];
+	size_t			len = 0, i, n;
+
+	if (cjk) {
+		n = 1 + bench_rand() % 3;
+		for (i = 0; i < n; i++)
+			len += bench_utf8(buf + len,
+					0x4e00 + (unsigned int)(bench_rand() % (0x9fa5 - 0x4e00)));
+	} else {
+		n = 2 + bench_rand() % 9;
+		for (i = 0; i < n; i++)
+			buf[len++] = 'a' + bench_rand() % 26;
+	}
+
+	buf[len] = '\0';
+
+	return strdup(buf);
+}
+
+/* cumulative Zipf weights of ranks 1 .. n */
+static double *bench_zipf_cdf(size_t n, double s)
+{
+	double			*cdf, sum = 0.0;
+	size_t			i;
+
+	if ((cdf = (double *)malloc(sizeof(double) * n)) == NULL)
+		return NULL;
+
+	for (i = 0; i < n; i++)
+		cdf[i] = (sum += 1.0 / pow((double)(i + 1), s));
+
+	for (i = 0; i < n; i++)
+		cdf[i] /= sum;
+
+	return cdf;
+}
+
+static size_t bench_zipf(const double *cdf, size_t n)
+{
+	double			u = bench_uniform();
+	size_t			lo = 0, hi = n - 1;
+
+	while (lo < hi) {
+		size_t		mid = lo + (hi - lo) / 2;
+
+		if (cdf[mid] < u)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int bench_corpus_make(struct bench_corpus *c,
+		const struct bench_opts *o)
+{
+	char			**vocab[2];
+	double			*cdf;
+	size_t			d, i, k;
+	int				lang;
+
+	bench_state = o->seed * 0x9e3779b97f4a7c15ULL + 1;
+
+	if ((cdf = bench_zipf_cdf(o->nvocab, o->zipf)) == NULL)
+		return -1;
+
+	for (lang = 0; lang < 2; lang++) {
+		vocab[lang] = (char **)malloc(sizeof(char *) * o->nvocab);
+		if (vocab[lang] == NULL)
+			return -1;
+		for (i = 0; i < o->nvocab; i++)
+			vocab[lang][i] = bench_word(lang);
+	}
+
+	c->ndocs = o->ndocs;
+	c->nbytes = 0;
+	if ((c->docs = (char **)malloc(sizeof(char *) * o->ndocs)) == NULL)
+		return -1;
+
+	/* half to one and a half times the average words */
+	for (d = 0; d < o->ndocs; d++) {
+		size_t		nwords = o->nwords / 2 + bench_rand() % (o->nwords + 1);
+		size_t		len = 0, cap = nwords * 10 + 1;
+		char		*doc;
+
+		lang = bench_uniform() < o->cjk;
+
+		if ((doc = (char *)malloc(cap)) == NULL)
+			return -1;
+
+		for (k = 0; k < nwords; k++) {
+			const char	*w = vocab[lang][bench_zipf(cdf, o->nvocab)];
+			size_t		wlen = strlen(w);
+
+			if (len + wlen + 2 > cap) {
+				cap = (len + wlen + 2) * 2;
+				if ((doc = (char *)realloc(doc, cap)) == NULL)
+					return -1;
+			}
+			if (k > 0)
+				doc[len++] = ' ';
+			memcpy(doc + len, w, wlen);
+			len += wlen;
+		}
+
+		doc[len] = '\0';
+		c->docs[d] = doc;
+		c->nbytes += len;
+	}
+
+	for (lang = 0; lang < 2; lang++) {
+		for (i = 0; i < o->nvocab; i++)
+			free(vocab[lang][i]);
+		free(vocab[lang]);
+	}
+	free(cdf);
+
+	return 0;
+}
+
+static int bench_above(int *above, const char *s, const char *t,
+		double threshold)
+{
+	struct term_space	ts;
+	int					retval = -1;
+
+	if (term_space_init(&ts) == -1) return -1;
+
+	if (term_space_add_trgm(&ts, s, strlen(s), 0) == 0
+		&& term_space_add_trgm(&ts, t, strlen(t), 1) == 0) {
+		*above = term_space_above(&ts, threshold);
+		retval = 0;
+	}
+
+	term_space_free(&ts);
+
+	return retval;
+}
+
+/* both vectors are built on every call, as to_trgm_vector would */
+static int bench_vector(double *score, const char *s, const char *t, int n)
+{
+	struct trgm_entry	*a, *b;
+	size_t				na = 0, nb = 0;
+	int					retval = -1;
+
+	a = _trgm_vector(s, strlen(s), &na);
+	b = _trgm_vector(t, strlen(t), &nb);
+
+	if (a && b)
+		retval = _trgm_vector_sml(score, a, na, b, nb, n);
+
+	trgm_free(a);
+	trgm_free(b);
+
+	return retval;
+}
+
+static int bench_char(double *score, const char *s, const char *t, int n,
+		int gram)
+{
+	struct term_space	ts;
+	int					retval = -1;
+
+	if (term_space_init(&ts) == -1) return -1;
+
+	if (term_space_add_chars(&ts, s, strlen(s), 0, gram, 1) == 0
+		&& term_space_add_chars(&ts, t, strlen(t), 1, gram, 1) == 0) {
+		*score = term_space_score(&ts, n, NULL, NULL, NULL);
+		retval = 0;
+	}
+
+	term_space_free(&ts);
+
+	return retval;
+}
+
+/* one document against the next, or one document alone for tags */
+static int bench_op(const struct bench_opts *o, const struct bench_corpus *c,
+		size_t d, double *check)
+{
+	const char		*s = c->docs[d];
+	const char		*t = c->docs[(d + 1) % c->ndocs];
+	double			score = 0.0;
+	char			*tag;
+	int				above = 0;
+
+	switch (o->mode) {
+		case BENCH_SML:
+			if (_trgm_sml(&score, s, t, o->top) == -1)
+				return -1;
+			*check += score;
+			break;
+		case BENCH_TAG:
+			tag = _trgm_tag(s, (size_t)o->top);
+			if (tag) {
+				*check += strlen(tag);
+				free(tag);
+			}
+			break;
+		case BENCH_ABOVE:
+			if (bench_above(&above, s, t, o->threshold) == -1)
+				return -1;
+			*check += above;
+			break;
+		case BENCH_VECTOR:
+			if (bench_vector(&score, s, t, o->top) == -1)
+				return -1;
+			*check += score;
+			break;
+		case BENCH_CHAR:
+			if (bench_char(&score, s, t, o->top, o->gram) == -1)
+				return -1;
+			*check += score;
+			break;
+	}
+
+	return 0;
+}
+
+static int bench_double_cmp(const void *lhs, const void *rhs)
+{
+	double			l = *(const double *)lhs, r = *(const double *)rhs;
+
+	return l < r ? -1 : (l > r);
+}
+
+static double bench_percentile(const double *sorted, size_t n, double p)
+{
+	return sorted[(size_t)(p * (n - 1) + 0.5)];
+}
+
+/* -h asks for it on stdout and succeeds, a bad command line fails */
+static void usage(const char *prog, int status)
+{
+	fprintf(status ? stderr : stdout,
+			"usage: %s [-n docs] [-w words] [-v vocabulary] [-c cjk share]\n"
+			"       [-z zipf] [-m sml|tag|above|vector|char] [-k top]\n"
+			"       [-g gram] [-t threshold] [-r rounds] [-s seed] [-d] [-h]\n",
+			prog);
+	exit(status);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_opts	o = {10000, 50, 5000, 0.0, 1.0, BENCH_SML,
+							 -1, 2, 0.3, 3, 1, 0};
+	struct bench_corpus	c;
+	double				*lat, start, elapsed = 0.0, check = 0.0;
+	size_t				nops, nbytes, nalloc = 0, nallocb = 0, d, i;
+	int					opt, r, m;
+
+	while ((opt = getopt(argc, argv, "n:w:v:c:z:m:k:g:t:r:s:dh")) != -1) {
+		switch (opt) {
+			case 'n': o.ndocs = strtoul(optarg, NULL, 10); break;
+			case 'w': o.nwords = strtoul(optarg, NULL, 10); break;
+			case 'v': o.nvocab = strtoul(optarg, NULL, 10); break;
+			case 'c': o.cjk = atof(optarg); break;
+			case 'z': o.zipf = atof(optarg); break;
+			case 'k': o.top = atoi(optarg); break;
+			case 'g': o.gram = atoi(optarg); break;
+			case 't': o.threshold = atof(optarg); break;
+			case 'r': o.rounds = atoi(optarg); break;
+			case 's': o.seed = strtoul(optarg, NULL, 10); break;
+			case 'd': o.dump = 1; break;
+			case 'h': usage(argv[0], 0); break;
+			case 'm':
+				for (m = 0; m <= BENCH_CHAR; m++)
+					if (strcmp(optarg, bench_modes[m]) == 0)
+						break;
+				if (m > BENCH_CHAR)
+					usage(argv[0], 2);
+				o.mode = (enum bench_mode)m;
+				break;
+			default:
+				usage(argv[0], 2);
+		}
+	}
+
+	if (o.ndocs == 0 || o.nwords == 0 || o.nvocab == 0 || o.rounds <= 0
+		|| o.gram < 1 || o.gram > TRGM_MAX_GRAM)
+		usage(argv[0], 2);
+
+	if (bench_corpus_make(&c, &o) == -1) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	if (o.dump) {
+		for (d = 0; d < c.ndocs; d++)
+			puts(c.docs[d]);
+		return 0;
+	}
+
+	nops = c.ndocs * o.rounds;
+	if ((lat = (double *)malloc(sizeof(double) * nops)) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	/* a document is read twice a round when scored against its neighbours */
+	nbytes = o.mode == BENCH_TAG ? c.nbytes : c.nbytes * 2;
+
+	/* one round untimed, to warm the caches and the allocator */
+	for (d = 0; d < c.ndocs; d++)
+		bench_op(&o, &c, d, &check);
+
+	for (r = 0, i = 0; r < o.rounds; r++) {
+		bench_nalloc = bench_nbytes = 0;
+
+		for (d = 0; d < c.ndocs; d++, i++) {
+			start = bench_now();
+			if (bench_op(&o, &c, d, &check) == -1) {
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+			lat[i] = bench_now() - start;
+			elapsed += lat[i];
+		}
+
+		nalloc += bench_nalloc;
+		nallocb += bench_nbytes;
+	}
+
+	qsort(lat, nops, sizeof(double), bench_double_cmp);
+
+	printf("mode %s, %zu docs, %.2f MB, %d rounds, checksum %.6f\n",
+			bench_modes[o.mode],
+			c.ndocs, c.nbytes / 1048576.0, o.rounds, check);
+	printf("docs/s       %12.1f\n", nops / (elapsed / 1e9));
+	printf("MB/s         %12.2f\n",
+			nbytes * (double)o.rounds / 1048576.0 / (elapsed / 1e9));
+	printf("latency us   p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+			bench_percentile(lat, nops, 0.50) / 1e3,
+			bench_percentile(lat, nops, 0.90) / 1e3,
+			bench_percentile(lat, nops, 0.99) / 1e3,
+			lat[nops - 1] / 1e3);
+	printf("allocs/doc   %12.2f\n", (double)nalloc / nops);
+	printf("bytes/doc    %12.1f\n", (double)nallocb / nops);
+
+	for (d = 0; d < c.ndocs; d++)
+		free(c.docs[d]);
+	free(c.docs);
+	free(lat);
+
+	return 0;
+}
@@ -0,0 +1,428 @@
+/*
+ * Dictionary of trigrams to dense integer ids, and similarity of id sets
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ */
+
+#include <limits.h>
+#include <math.h>
+
+#include "pg_trgm_sml.h"
+
+#include <access/xact.h>
+#include <catalog/pg_type.h>
+#include <common/hashfn.h>
+#include <executor/spi.h>
+#include <utils/array.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/hsearch.h>
+#include <utils/inval.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+
+#include "pg_toys_stats.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define TRGM_IDS_SSE2
+#endif
+
+PG_FUNCTION_INFO_V1(to_trgm_ids);
+PG_FUNCTION_INFO_V1(trgm_ids_sml);
+Datum to_trgm_ids(PG_FUNCTION_ARGS);
+Datum trgm_ids_sml(PG_FUNCTION_ARGS);
+
+static ToysStatsEntry trgm_stats_ids = TOYS_STATS_ENTRY("to_trgm_ids");
+static ToysStatsEntry trgm_stats_ids_sml = TOYS_STATS_ENTRY("trgm_ids_sml");
+
+typedef struct {
+	char			*trgm;		/* key, must be first */
+	int32			id;
+} TrgmDictEntry;
+
+/* trgm_sml.dict_cache_size */
+static int trgm_dict_cache_size = 100000;
+
+/*
+ * Ids of the dictionary seen by this backend. An id taken by an insert
+ * that rolls back, or a truncated dictionary, would make the cache lie, so
+ * it is marked stale then and dropped at the next lookup rather than under
+ * the feet of a lookup in progress.
+ */
+static MemoryContext trgm_dict_cxt = NULL;
+static HTAB *trgm_dict_hash = NULL;
+static Oid trgm_dict_relid = InvalidOid;
+static bool trgm_dict_stale = false;
+static bool trgm_dict_callbacks = false;
+
+void
+trgm_dict_init(void)
+{
+	DefineCustomIntVariable("trgm_sml.dict_cache_size",
+							"Sets the number of trigram ids a backend "
+							"keeps from trgm_sml_dict.",
+							"The cache starts over once it holds more.",
+							&trgm_dict_cache_size,
+							100000,
+							0,
+							INT_MAX / 2,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+}
+
+static void
+trgm_dict_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+		trgm_dict_stale = true;
+}
+
+static void
+trgm_dict_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+		SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		trgm_dict_stale = true;
+}
+
+static void
+trgm_dict_relcache_callback(Datum arg, Oid relid)
+{
+	if (relid == InvalidOid || relid == trgm_dict_relid)
+		trgm_dict_stale = true;
+}
+
+static uint32
+trgm_dict_keyhash(const void *key, Size keysize)
+{
+	const char		*s = *(char *const *)key;
+
+	return hash_bytes((const unsigned char *)s, strlen(s));
+}
+
+static int
+trgm_dict_keycmp(const void *lhs, const void *rhs, Size keysize)
+{
+	return strcmp(*(char *const *)lhs, *(char *const *)rhs);
+}
+
+static void *
+trgm_dict_keycopy(void *dest, const void *src, Size keysize)
+{
+	*(char **)dest = MemoryContextStrdup(trgm_dict_cxt, *(char *const *)src);
+
+	return dest;
+}
+
+/* the cache of the dictionary in the schema of the calling function */
+static void
+trgm_dict_open(FunctionCallInfo fcinfo, const char *prefix)
+{
+	Oid				nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	Oid				relid = get_relname_relid("trgm_sml_dict", nspid);
+	HASHCTL			info;
+
+	if (!OidIsValid(relid))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("%srelation \"%s.trgm_sml_dict\" does not exist",
+						prefix, get_namespace_name(nspid))));
+
+	if (!trgm_dict_callbacks) {
+		RegisterXactCallback(trgm_dict_xact_callback, NULL);
+		RegisterSubXactCallback(trgm_dict_subxact_callback, NULL);
+		CacheRegisterRelcacheCallback(trgm_dict_relcache_callback, (Datum)0);
+		trgm_dict_callbacks = true;
+	}
+
+	if (trgm_dict_hash != NULL
+		&& (trgm_dict_stale || relid != trgm_dict_relid
+			|| hash_get_num_entries(trgm_dict_hash) > trgm_dict_cache_size)) {
+		MemoryContextDelete(trgm_dict_cxt);
+		trgm_dict_cxt = NULL;
+		trgm_dict_hash = NULL;
+	}
+
+	trgm_dict_stale = false;
+	trgm_dict_relid = relid;
+
+	if (trgm_dict_hash != NULL)
+		return;
+
+	trgm_dict_cxt = AllocSetContextCreate(CacheMemoryContext,
+			"pg_trgm_sml dict", ALLOCSET_DEFAULT_SIZES);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(char *);
+	info.entrysize = sizeof(TrgmDictEntry);
+	info.hash = trgm_dict_keyhash;
+	info.match = trgm_dict_keycmp;
+	info.keycopy = trgm_dict_keycopy;
+	info.hcxt = trgm_dict_cxt;
+
+	trgm_dict_hash = hash_create("pg_trgm_sml dict", 1024, &info,
+			HASH_ELEM | HASH_FUNCTION | HASH_COMPARE | HASH_KEYCOPY
+			| HASH_CONTEXT);
+}
+
+/* run a (trgm, id) query over $1 and cache what comes back */
+static void
+trgm_dict_query(const char *query, ArrayType *arr, const char *prefix)
+{
+	Oid				argtypes[1] = {TEXTARRAYOID};
+	Datum			values[1];
+	uint64			row;
+	bool			isnull;
+	int				rc;
+
+	values[0] = PointerGetDatum(arr);
+
+	rc = SPI_execute_with_args(query, 1, argtypes, values, NULL, false, 0);
+	if (rc != SPI_OK_SELECT && rc != SPI_OK_INSERT_RETURNING)
+		elog(ERROR, "%sSPI_execute_with_args(\"%s\") failed", prefix, query);
+
+	for (row = 0; row < SPI_processed; row++) {
+		HeapTuple		tuple = SPI_tuptable->vals[row];
+		TupleDesc		tupdesc = SPI_tuptable->tupdesc;
+		char			*trgm;
+		int32			id;
+		TrgmDictEntry	*entry;
+
+		trgm = TextDatumGetCString(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		id = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+
+		entry = (TrgmDictEntry *)hash_search(trgm_dict_hash, &trgm,
+				HASH_ENTER, NULL);
+		entry->id = id;
+	}
+
+	SPI_freetuptable(SPI_tuptable);
+}
+
+/*
+ * Look the missing trigrams up in the dictionary, adding them first if
+ * asked to. An insert skips the trigrams that others add concurrently and
+ * the snapshot of the statement does not show, so what is still missing
+ * after it is looked up once more.
+ */
+static void
+trgm_dict_fetch(char **trgm, int *miss, int nmiss, bool add,
+		const char *prefix)
+{
+	char			*rel;
+	char			*select, *insert;
+	Datum			*elems;
+	ArrayType		*arr;
+	int				i;
+
+	rel = quote_qualified_identifier(get_namespace_name(
+				get_rel_namespace(trgm_dict_relid)), "trgm_sml_dict");
+
+	select = psprintf("select trgm, id from %s where trgm = any($1)", rel);
+	insert = psprintf("with ins as (insert into %s (trgm) select unnest($1) "
+			"on conflict (trgm) do nothing returning trgm, id) "
+			"select trgm, id from ins union all %s", rel, select);
+
+	elems = (Datum *)palloc(sizeof(Datum) * nmiss);
+	for (i = 0; i < nmiss; i++)
+		elems[i] = CStringGetTextDatum(trgm[miss[i]]);
+
+	arr = construct_array(elems, nmiss, TEXTOID, -1, false, TYPALIGN_INT);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "%sSPI_connect failed", prefix);
+
+	trgm_dict_query(add ? insert : select, arr, prefix);
+
+	if (add) {
+		for (i = 0; i < nmiss; i++)
+			if (hash_search(trgm_dict_hash, &trgm[miss[i]],
+						HASH_FIND, NULL) == NULL)
+				break;
+
+		if (i < nmiss)
+			trgm_dict_query(select, arr, prefix);
+	}
+
+	SPI_finish();
+}
+
+static int
+trgm_id_cmp(const void *lhs, const void *rhs)
+{
+	int32			l = *(const int32 *)lhs, r = *(const int32 *)rhs;
+
+	return l < r ? -1 : (l > r);
+}
+
+/*
+ * The trigram ids of a text as a sorted int4[] without duplicates. A
+ * trigram missing from trgm_sml_dict is added with add, otherwise it gets
+ * a negative id from its hash, so that it still counts in the similarity
+ * and matches the same trigram of another text.
+ *
+ * A negative id only matches arrays made while the trigram was missing:
+ * once it is added, later arrays carry its real id and never match the
+ * earlier ones on it. Arrays that are stored should be made with add.
+ */
+Datum to_trgm_ids(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "to_trgm_ids: "
+
+	text			*datum = PG_GETARG_TEXT_PP(0);
+	bool			add = PG_NARGS() > 1 && PG_GETARG_BOOL(1);
+	char			**trgm;
+	int32			*ids;
+	int				*miss;
+	int				n, nmiss = 0, i, k;
+	Datum			*elems;
+	TrgmDictEntry	*entry;
+	instr_time		start;
+
+	toys_stats_begin(&start);
+
+	trgm = trgm_text_trigrams(datum, &n);
+
+	if (n == 0) {
+		toys_stats_end(&trgm_stats_ids, &start, VARSIZE_ANY_EXHDR(datum), 0);
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT4OID));
+	}
+
+	trgm_dict_open(fcinfo, EPREFIX);
+
+	ids = (int32 *)palloc(sizeof(int32) * n);
+	miss = (int *)palloc(sizeof(int) * n);
+
+	for (i = 0; i < n; i++) {
+		entry = (TrgmDictEntry *)hash_search(trgm_dict_hash, &trgm[i],
+				HASH_FIND, NULL);
+		if (entry)
+			ids[i] = entry->id;
+		else
+			miss[nmiss++] = i;
+	}
+
+	if (nmiss > 0) {
+		trgm_dict_fetch(trgm, miss, nmiss, add, EPREFIX);
+
+		for (k = 0; k < nmiss; k++) {
+			i = miss[k];
+			entry = (TrgmDictEntry *)hash_search(trgm_dict_hash, &trgm[i],
+					HASH_FIND, NULL);
+			if (entry)
+				ids[i] = entry->id;
+			else
+				ids[i] = -(int32)(hash_bytes((const unsigned char *)trgm[i],
+							strlen(trgm[i])) & 0x7fffffff) - 1;
+		}
+	}
+
+	qsort(ids, n, sizeof(int32), trgm_id_cmp);
+
+	elems = (Datum *)palloc(sizeof(Datum) * n);
+	for (i = 0, k = 0; i < n; i++)
+		if (k == 0 || ids[i] != DatumGetInt32(elems[k - 1]))
+			elems[k++] = Int32GetDatum(ids[i]);
+
+	toys_stats_end(&trgm_stats_ids, &start, VARSIZE_ANY_EXHDR(datum), k);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, k, INT4OID,
+				sizeof(int32), true, TYPALIGN_INT));
+
+	#undef EPREFIX
+}
+
+/*
+ * Number of values common to two sorted arrays without duplicates. The
+ * scalar merge advances by comparison results instead of branching on
+ * them; with SSE2 blocks of four are compared all against all, and the
+ * block with the smaller last value moves on.
+ */
+static int
+trgm_ids_common(const int32 *a, int na, const int32 *b, int nb)
+{
+	int				i = 0, j = 0, n = 0;
+
+#ifdef TRGM_IDS_SSE2
+	while (i + 4 <= na && j + 4 <= nb) {
+		__m128i		va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i		vb = _mm_loadu_si128((const __m128i *)(b + j));
+		__m128i		eq;
+		int32		amax = a[i + 3], bmax = b[j + 3];
+
+		eq = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi32(va, vb),
+					_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x39))),
+				_mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x4e)),
+					_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x93))));
+
+		n += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(eq)));
+
+		i += (amax <= bmax) << 2;
+		j += (bmax <= amax) << 2;
+	}
+#endif
+
+	while (i < na && j < nb) {
+		int32		x = a[i], y = b[j];
+
+		n += (x == y);
+		i += (x <= y);
+		j += (y <= x);
+	}
+
+	return n;
+}
+
+static int32 *
+trgm_ids_values(ArrayType *arr, int *n)
+{
+	if (ARR_NDIM(arr) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("array must be one-dimensional")));
+
+	if (array_contains_nulls(arr))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("array must not contain nulls")));
+
+	*n = ArrayGetNItems(ARR_NDIM(arr), ARR_DIMS(arr));
+
+	return (int32 *)ARR_DATA_PTR(arr);
+}
+
+/*
+ * Ochiai coefficient, the cosine of two sets, of arrays as made by
+ * to_trgm_ids. Unsorted arrays give a meaningless result. Counts are not
+ * kept in the arrays, so a trigram occurring twice weighs as much as one
+ * occurring once and the score differs from trgm_sml(a, b, -1) on any
+ * text repeating a trigram.
+ */
+Datum trgm_ids_sml(PG_FUNCTION_ARGS)
+{
+	ArrayType		*a = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType		*b = PG_GETARG_ARRAYTYPE_P(1);
+	int32			*va, *vb;
+	int				na, nb;
+	double			score = 0.0;
+	instr_time		start;
+
+	toys_stats_begin(&start);
+
+	va = trgm_ids_values(a, &na);
+	vb = trgm_ids_values(b, &nb);
+
+	if (na > 0 && nb > 0)
+		score = trgm_ids_common(va, na, vb, nb) / sqrt((double)na * nb);
+
+	toys_stats_end(&trgm_stats_ids_sml, &start,
+			VARSIZE_ANY_EXHDR(a) + VARSIZE_ANY_EXHDR(b), na + nb);
+
+	PG_RETURN_FLOAT8(score);
+}
@@ -0,0 +1,118 @@
+/*
+ * GIN support for the %% operator of pg_trgm_sml
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ */
+
+#include <math.h>
+
+#include "pg_trgm_sml.h"
+
+#include <access/gin.h>
+
+PG_FUNCTION_INFO_V1(gin_extract_value_trgm_sml);
+PG_FUNCTION_INFO_V1(gin_extract_query_trgm_sml);
+PG_FUNCTION_INFO_V1(gin_trgm_sml_consistent);
+Datum gin_extract_value_trgm_sml(PG_FUNCTION_ARGS);
+Datum gin_extract_query_trgm_sml(PG_FUNCTION_ARGS);
+Datum gin_trgm_sml_consistent(PG_FUNCTION_ARGS);
+
+/*
+ * Index keys are the trigram hashes of a document, the counts are lost.
+ */
+Datum gin_extract_value_trgm_sml(PG_FUNCTION_ARGS)
+{
+	text			*datum = PG_GETARG_TEXT_PP(0);
+	int32			*nentries = (int32 *)PG_GETARG_POINTER(1);
+	TrgmVector		*vec;
+	Datum			*keys = NULL;
+	uint32			i;
+
+	vec = trgm_vector_from_text(datum);
+
+	*nentries = vec->nentries;
+	if (vec->nentries > 0) {
+		keys = (Datum *)palloc(sizeof(Datum) * vec->nentries);
+		for (i = 0; i < vec->nentries; i++)
+			keys[i] = Int32GetDatum((int32)vec->entries[i].hash);
+	}
+
+	pfree(vec);
+
+	PG_RETURN_POINTER(keys);
+}
+
+/*
+ * Every query key carries the share of the query norm it stands for,
+ * count^2 / sum(count^2), as extra data for the consistent function. At a
+ * threshold of 0 every document matches, also those sharing no trigram
+ * with the query, so the whole index is scanned.
+ */
+Datum gin_extract_query_trgm_sml(PG_FUNCTION_ARGS)
+{
+	text			*datum = PG_GETARG_TEXT_PP(0);
+	int32			*nentries = (int32 *)PG_GETARG_POINTER(1);
+	/* StrategyNumber strategy = PG_GETARG_UINT16(2); */
+	/* bool		  **pmatch = (bool **) PG_GETARG_POINTER(3); */
+	Pointer			**extra_data = (Pointer **)PG_GETARG_POINTER(4);
+	/* bool		  **nullFlags = (bool **) PG_GETARG_POINTER(5); */
+	int32			*searchMode = (int32 *)PG_GETARG_POINTER(6);
+	TrgmVector		*vec;
+	Datum			*keys = NULL;
+	float8			*weight;
+	double			norm = 0.0;
+	uint32			i;
+
+	vec = trgm_vector_from_text(datum);
+
+	*nentries = vec->nentries;
+	if (vec->nentries > 0) {
+		keys = (Datum *)palloc(sizeof(Datum) * vec->nentries);
+		weight = (float8 *)palloc(sizeof(float8) * vec->nentries);
+		*extra_data = (Pointer *)palloc(sizeof(Pointer) * vec->nentries);
+
+		for (i = 0; i < vec->nentries; i++)
+			norm += (double)vec->entries[i].count * vec->entries[i].count;
+
+		for (i = 0; i < vec->nentries; i++) {
+			keys[i] = Int32GetDatum((int32)vec->entries[i].hash);
+			weight[i] = (double)vec->entries[i].count * vec->entries[i].count
+				/ norm;
+			(*extra_data)[i] = (Pointer)&weight[i];
+		}
+	}
+
+	pfree(vec);
+
+	if (trgm_sml_threshold <= 0.0)
+		*searchMode = GIN_SEARCH_MODE_ALL;
+
+	PG_RETURN_POINTER(keys);
+}
+
+/*
+ * Whatever the counts of the document are, its cosine with the query can
+ * not exceed sqrt(sum of the matched weights), which is what a document
+ * made of exactly the matched query trigrams would score.
+ */
+Datum gin_trgm_sml_consistent(PG_FUNCTION_ARGS)
+{
+	bool			*check = (bool *)PG_GETARG_POINTER(0);
+	/* StrategyNumber strategy = PG_GETARG_UINT16(1); */
+	/* text		   *query = PG_GETARG_TEXT_P(2); */
+	int32			nkeys = PG_GETARG_INT32(3);
+	Pointer			*extra_data = (Pointer *)PG_GETARG_POINTER(4);
+	bool			*recheck = (bool *)PG_GETARG_POINTER(5);
+	double			bound = 0.0;
+	int32			i;
+
+	for (i = 0; i < nkeys; i++)
+		if (check[i])
+			bound += *(float8 *)extra_data[i];
+
+	*recheck = true;
+
+	/* leave some room for rounding, the recheck has the last word */
+	PG_RETURN_BOOL(sqrt(bound) + 1e-9 >= trgm_sml_threshold);
+}
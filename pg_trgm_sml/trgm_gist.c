@@ -0,0 +1,514 @@
+/*
+ * GiST support for the %% and <-> operators of pg_trgm_sml
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ */
+
+#include <math.h>
+
+#include "pg_trgm_sml.h"
+
+#include <access/gist.h>
+#include <port/pg_bitutils.h>
+
+PG_FUNCTION_INFO_V1(gtrgm_sml_in);
+PG_FUNCTION_INFO_V1(gtrgm_sml_out);
+PG_FUNCTION_INFO_V1(gtrgm_sml_consistent);
+PG_FUNCTION_INFO_V1(gtrgm_sml_distance);
+PG_FUNCTION_INFO_V1(gtrgm_sml_compress);
+PG_FUNCTION_INFO_V1(gtrgm_sml_decompress);
+PG_FUNCTION_INFO_V1(gtrgm_sml_penalty);
+PG_FUNCTION_INFO_V1(gtrgm_sml_picksplit);
+PG_FUNCTION_INFO_V1(gtrgm_sml_union);
+PG_FUNCTION_INFO_V1(gtrgm_sml_same);
+Datum gtrgm_sml_in(PG_FUNCTION_ARGS);
+Datum gtrgm_sml_out(PG_FUNCTION_ARGS);
+Datum gtrgm_sml_consistent(PG_FUNCTION_ARGS);
+Datum gtrgm_sml_distance(PG_FUNCTION_ARGS);
+Datum gtrgm_sml_compress(PG_FUNCTION_ARGS);
+Datum gtrgm_sml_decompress(PG_FUNCTION_ARGS);
+Datum gtrgm_sml_penalty(PG_FUNCTION_ARGS);
+Datum gtrgm_sml_picksplit(PG_FUNCTION_ARGS);
+Datum gtrgm_sml_union(PG_FUNCTION_ARGS);
+Datum gtrgm_sml_same(PG_FUNCTION_ARGS);
+
+/*
+ * Leaf keys keep the (hash, count) entries of the document, so the score
+ * of a leaf is exact. Documents with too many trigrams and all inner keys
+ * are a bit signature of the hashes instead, which only gives an upper
+ * bound of the score.
+ */
+#define GTRGM_ARRAY			0x01
+#define GTRGM_SIGN			0x02
+#define GTRGM_ALLTRUE		0x04
+
+#define GTRGM_MAXARRAY		200
+#define SIGLEN				256
+#define SIGLENBIT			(SIGLEN * 8)
+
+typedef unsigned char BITVEC[SIGLEN];
+
+typedef struct {
+	int32			vl_len_;	/* varlena header (do not touch directly!) */
+	int32			flag;
+	char			data[FLEXIBLE_ARRAY_MEMBER];
+} TrgmGistKey;
+
+#define GTHDRSZ				offsetof(TrgmGistKey, data)
+#define GTRGM_ISARRAY(K)	(((TrgmGistKey *)(K))->flag & GTRGM_ARRAY)
+#define GTRGM_ISSIGN(K)		(((TrgmGistKey *)(K))->flag & GTRGM_SIGN)
+#define GTRGM_ISALLTRUE(K)	(((TrgmGistKey *)(K))->flag & GTRGM_ALLTRUE)
+#define GTRGM_ENTRIES(K)	((struct trgm_entry *)((K)->data))
+#define GTRGM_NENTRIES(K)	\
+	((VARSIZE(K) - GTHDRSZ) / sizeof(struct trgm_entry))
+#define GTRGM_SIGN_P(K)		((unsigned char *)((K)->data))
+
+#define HASHBIT(H)			((H) % SIGLENBIT)
+#define SETBIT(S, B)		((S)[(B) >> 3] |= (1 << ((B) & 7)))
+#define GETBIT(S, B)		(((S)[(B) >> 3] >> ((B) & 7)) & 1)
+
+/* the query side of a scan, cached across the calls on one index scan */
+typedef struct {
+	text			*query;
+	TrgmVector		*vec;
+	double			*weight;	/* count^2 / sum(count^2) of every entry */
+} TrgmGistQuery;
+
+Datum gtrgm_sml_in(PG_FUNCTION_ARGS)
+{
+	elog(ERROR, "gtrgm_sml_in: not implemented");
+	PG_RETURN_NULL();
+}
+
+Datum gtrgm_sml_out(PG_FUNCTION_ARGS)
+{
+	elog(ERROR, "gtrgm_sml_out: not implemented");
+	PG_RETURN_NULL();
+}
+
+static TrgmGistKey *
+gtrgm_make(int32 flag, size_t datalen)
+{
+	TrgmGistKey		*key;
+
+	key = (TrgmGistKey *)palloc0(GTHDRSZ + datalen);
+	SET_VARSIZE(key, GTHDRSZ + datalen);
+	key->flag = flag;
+
+	return key;
+}
+
+static void
+gtrgm_sign_vector(unsigned char *sign, const TrgmVector *vec)
+{
+	uint32			i;
+
+	for (i = 0; i < vec->nentries; i++)
+		SETBIT(sign, HASHBIT(vec->entries[i].hash));
+}
+
+/* OR the signature of any key into sign, false if the key is all true */
+static bool
+gtrgm_sign_union(unsigned char *sign, TrgmGistKey *key)
+{
+	struct trgm_entry	*e;
+	size_t				i, n;
+
+	if (GTRGM_ISALLTRUE(key))
+		return false;
+
+	if (GTRGM_ISARRAY(key)) {
+		e = GTRGM_ENTRIES(key);
+		n = GTRGM_NENTRIES(key);
+		for (i = 0; i < n; i++)
+			SETBIT(sign, HASHBIT(e[i].hash));
+	} else {
+		for (i = 0; i < SIGLEN; i++)
+			sign[i] |= GTRGM_SIGN_P(key)[i];
+	}
+
+	return true;
+}
+
+static bool
+gtrgm_sign_full(const unsigned char *sign)
+{
+	size_t			i;
+
+	for (i = 0; i < SIGLEN; i++)
+		if (sign[i] != 0xff)
+			return false;
+
+	return true;
+}
+
+static TrgmGistKey *
+gtrgm_from_sign(const unsigned char *sign)
+{
+	TrgmGistKey		*key;
+
+	if (gtrgm_sign_full(sign))
+		return gtrgm_make(GTRGM_SIGN | GTRGM_ALLTRUE, 0);
+
+	key = gtrgm_make(GTRGM_SIGN, SIGLEN);
+	memcpy(GTRGM_SIGN_P(key), sign, SIGLEN);
+
+	return key;
+}
+
+static int
+gtrgm_sign_popcount(const unsigned char *sign)
+{
+	return (int)pg_popcount((const char *)sign, SIGLEN);
+}
+
+/* number of bits of b that are not set in a */
+static int
+gtrgm_sign_growth(const unsigned char *a, const unsigned char *b)
+{
+	int				i, n = 0;
+
+	for (i = 0; i < SIGLEN; i++)
+		n += pg_number_of_ones[b[i] & ~a[i]];
+
+	return n;
+}
+
+static int
+gtrgm_sign_hemdist(const unsigned char *a, const unsigned char *b)
+{
+	int				i, n = 0;
+
+	for (i = 0; i < SIGLEN; i++)
+		n += pg_number_of_ones[a[i] ^ b[i]];
+
+	return n;
+}
+
+static TrgmGistQuery *
+gtrgm_query(FunctionCallInfo fcinfo, text *query)
+{
+	TrgmGistQuery	*cache = (TrgmGistQuery *)fcinfo->flinfo->fn_extra;
+	MemoryContext	oldcxt;
+	double			norm = 0.0;
+	uint32			i;
+
+	if (cache != NULL
+		&& VARSIZE(cache->query) == VARSIZE(query)
+		&& memcmp(cache->query, query, VARSIZE(query)) == 0)
+		return cache;
+
+	if (cache != NULL) {
+		pfree(cache->query);
+		pfree(cache->vec);
+		pfree(cache->weight);
+		pfree(cache);
+	}
+
+	oldcxt = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	cache = (TrgmGistQuery *)palloc(sizeof(TrgmGistQuery));
+	cache->query = (text *)palloc(VARSIZE(query));
+	memcpy(cache->query, query, VARSIZE(query));
+	cache->vec = trgm_vector_from_text(query);
+	cache->weight = (double *)palloc(sizeof(double) *
+			(cache->vec->nentries + 1));
+
+	for (i = 0; i < cache->vec->nentries; i++)
+		norm += (double)cache->vec->entries[i].count
+			* cache->vec->entries[i].count;
+
+	for (i = 0; i < cache->vec->nentries; i++)
+		cache->weight[i] = (double)cache->vec->entries[i].count
+			* cache->vec->entries[i].count / norm;
+
+	MemoryContextSwitchTo(oldcxt);
+
+	fcinfo->flinfo->fn_extra = cache;
+
+	return cache;
+}
+
+/*
+ * Score of a key against the query. For a signature it is the best score
+ * any document under it could reach: the cosine is bounded by the norm of
+ * the query trigrams whose bit is set.
+ */
+static double
+gtrgm_score(TrgmGistKey *key, TrgmGistQuery *q, bool *exact)
+{
+	double			bound = 0.0;
+	uint32			i;
+
+	*exact = false;
+
+	if (q->vec->nentries == 0) {
+		*exact = true;
+		return 0.0;
+	}
+
+	if (GTRGM_ISALLTRUE(key))
+		return 1.0;
+
+	if (GTRGM_ISARRAY(key)) {
+		*exact = true;
+		return trgm_vector_similarity(GTRGM_ENTRIES(key), GTRGM_NENTRIES(key),
+				q->vec->entries, q->vec->nentries);
+	}
+
+	for (i = 0; i < q->vec->nentries; i++)
+		if (GETBIT(GTRGM_SIGN_P(key), HASHBIT(q->vec->entries[i].hash)))
+			bound += q->weight[i];
+
+	return Min(sqrt(bound) + 1e-9, 1.0);
+}
+
+Datum gtrgm_sml_consistent(PG_FUNCTION_ARGS)
+{
+	GISTENTRY		*entry = (GISTENTRY *)PG_GETARG_POINTER(0);
+	text			*query = PG_GETARG_TEXT_P(1);
+	StrategyNumber	strategy = (StrategyNumber)PG_GETARG_UINT16(2);
+	/* Oid		subtype = PG_GETARG_OID(3); */
+	bool			*recheck = (bool *)PG_GETARG_POINTER(4);
+	TrgmGistKey		*key = (TrgmGistKey *)DatumGetPointer(entry->key);
+	TrgmGistQuery	*q;
+	bool			exact;
+	double			score;
+
+	if (strategy != TrgmSimilarityStrategyNumber)
+		elog(ERROR, "gtrgm_sml_consistent: unrecognized strategy number: %d",
+				strategy);
+
+	q = gtrgm_query(fcinfo, query);
+	score = gtrgm_score(key, q, &exact);
+
+	*recheck = !exact;
+
+	PG_RETURN_BOOL(score >= trgm_sml_threshold);
+}
+
+Datum gtrgm_sml_distance(PG_FUNCTION_ARGS)
+{
+	GISTENTRY		*entry = (GISTENTRY *)PG_GETARG_POINTER(0);
+	text			*query = PG_GETARG_TEXT_P(1);
+	StrategyNumber	strategy = (StrategyNumber)PG_GETARG_UINT16(2);
+	/* Oid		subtype = PG_GETARG_OID(3); */
+	bool			*recheck = (bool *)PG_GETARG_POINTER(4);
+	TrgmGistKey		*key = (TrgmGistKey *)DatumGetPointer(entry->key);
+	TrgmGistQuery	*q;
+	bool			exact;
+	double			score;
+
+	if (strategy != TrgmDistanceStrategyNumber)
+		elog(ERROR, "gtrgm_sml_distance: unrecognized strategy number: %d",
+				strategy);
+
+	q = gtrgm_query(fcinfo, query);
+	score = gtrgm_score(key, q, &exact);
+
+	/* a signature gives a lower bound of the distance */
+	*recheck = !exact;
+
+	PG_RETURN_FLOAT8(1.0 - score);
+}
+
+Datum gtrgm_sml_compress(PG_FUNCTION_ARGS)
+{
+	GISTENTRY		*entry = (GISTENTRY *)PG_GETARG_POINTER(0);
+	GISTENTRY		*retval = entry;
+	TrgmGistKey		*key;
+	TrgmVector		*vec;
+
+	if (entry->leafkey) {
+		vec = trgm_vector_from_text(DatumGetTextPP(entry->key));
+
+		if (vec->nentries <= GTRGM_MAXARRAY) {
+			key = gtrgm_make(GTRGM_ARRAY,
+					sizeof(struct trgm_entry) * vec->nentries);
+			memcpy(GTRGM_ENTRIES(key), vec->entries,
+					sizeof(struct trgm_entry) * vec->nentries);
+		} else {
+			BITVEC		sign;
+
+			memset(sign, 0, SIGLEN);
+			gtrgm_sign_vector(sign, vec);
+			key = gtrgm_from_sign(sign);
+		}
+
+		pfree(vec);
+
+		retval = (GISTENTRY *)palloc(sizeof(GISTENTRY));
+		gistentryinit(*retval, PointerGetDatum(key),
+				entry->rel, entry->page, entry->offset, false);
+	} else {
+		key = (TrgmGistKey *)DatumGetPointer(entry->key);
+
+		if (GTRGM_ISSIGN(key) && !GTRGM_ISALLTRUE(key)
+			&& gtrgm_sign_full(GTRGM_SIGN_P(key))) {
+			retval = (GISTENTRY *)palloc(sizeof(GISTENTRY));
+			gistentryinit(*retval,
+					PointerGetDatum(gtrgm_make(GTRGM_SIGN | GTRGM_ALLTRUE, 0)),
+					entry->rel, entry->page, entry->offset, false);
+		}
+	}
+
+	PG_RETURN_POINTER(retval);
+}
+
+Datum gtrgm_sml_decompress(PG_FUNCTION_ARGS)
+{
+	GISTENTRY		*entry = (GISTENTRY *)PG_GETARG_POINTER(0);
+	GISTENTRY		*retval;
+	TrgmGistKey		*key;
+
+	key = (TrgmGistKey *)PG_DETOAST_DATUM(entry->key);
+
+	if (key != (TrgmGistKey *)DatumGetPointer(entry->key)) {
+		retval = (GISTENTRY *)palloc(sizeof(GISTENTRY));
+		gistentryinit(*retval, PointerGetDatum(key),
+				entry->rel, entry->page, entry->offset, entry->leafkey);
+		PG_RETURN_POINTER(retval);
+	}
+
+	PG_RETURN_POINTER(entry);
+}
+
+Datum gtrgm_sml_union(PG_FUNCTION_ARGS)
+{
+	GistEntryVector	*entryvec = (GistEntryVector *)PG_GETARG_POINTER(0);
+	int				*size = (int *)PG_GETARG_POINTER(1);
+	TrgmGistKey		*key = NULL;
+	BITVEC			sign;
+	int32			i;
+
+	memset(sign, 0, SIGLEN);
+
+	for (i = 0; i < entryvec->n; i++) {
+		if (!gtrgm_sign_union(sign,
+					(TrgmGistKey *)DatumGetPointer(entryvec->vector[i].key))) {
+			key = gtrgm_make(GTRGM_SIGN | GTRGM_ALLTRUE, 0);
+			break;
+		}
+	}
+
+	if (key == NULL)
+		key = gtrgm_from_sign(sign);
+
+	*size = VARSIZE(key);
+
+	PG_RETURN_POINTER(key);
+}
+
+Datum gtrgm_sml_same(PG_FUNCTION_ARGS)
+{
+	TrgmGistKey		*a = (TrgmGistKey *)PG_GETARG_POINTER(0);
+	TrgmGistKey		*b = (TrgmGistKey *)PG_GETARG_POINTER(1);
+	bool			*result = (bool *)PG_GETARG_POINTER(2);
+
+	*result = (VARSIZE(a) == VARSIZE(b)
+			&& memcmp(a, b, VARSIZE(a)) == 0);
+
+	PG_RETURN_POINTER(result);
+}
+
+/* penalty is the number of bits the new key would add to the original */
+Datum gtrgm_sml_penalty(PG_FUNCTION_ARGS)
+{
+	GISTENTRY		*origentry = (GISTENTRY *)PG_GETARG_POINTER(0);
+	GISTENTRY		*newentry = (GISTENTRY *)PG_GETARG_POINTER(1);
+	float			*penalty = (float *)PG_GETARG_POINTER(2);
+	TrgmGistKey		*orig = (TrgmGistKey *)DatumGetPointer(origentry->key);
+	TrgmGistKey		*newkey = (TrgmGistKey *)DatumGetPointer(newentry->key);
+	BITVEC			osign, nsign;
+
+	if (GTRGM_ISALLTRUE(orig)) {
+		*penalty = 0.0;
+		PG_RETURN_POINTER(penalty);
+	}
+
+	memset(osign, 0, SIGLEN);
+	memset(nsign, 0, SIGLEN);
+	gtrgm_sign_union(osign, orig);
+
+	if (!gtrgm_sign_union(nsign, newkey))
+		*penalty = (float)(SIGLENBIT - gtrgm_sign_popcount(osign));
+	else
+		*penalty = (float)gtrgm_sign_growth(osign, nsign);
+
+	PG_RETURN_POINTER(penalty);
+}
+
+/*
+ * Guttman's quadratic split on the signatures: the two keys that differ
+ * most become the seeds and every other key goes to the side it grows less.
+ */
+Datum gtrgm_sml_picksplit(PG_FUNCTION_ARGS)
+{
+	GistEntryVector	*entryvec = (GistEntryVector *)PG_GETARG_POINTER(0);
+	GIST_SPLITVEC	*v = (GIST_SPLITVEC *)PG_GETARG_POINTER(1);
+	OffsetNumber	maxoff = entryvec->n - 1;
+	OffsetNumber	k, j, seed_1 = 0, seed_2 = 0;
+	BITVEC			*signs, left, right;
+	int				i, d, waste = -1, dl, dr;
+
+	v->spl_left = (OffsetNumber *)palloc(sizeof(OffsetNumber) * (maxoff + 1));
+	v->spl_right = (OffsetNumber *)palloc(sizeof(OffsetNumber) * (maxoff + 1));
+	v->spl_nleft = v->spl_nright = 0;
+
+	signs = (BITVEC *)palloc0(sizeof(BITVEC) * (maxoff + 1));
+	for (k = FirstOffsetNumber; k <= maxoff; k = OffsetNumberNext(k))
+		if (!gtrgm_sign_union(signs[k],
+					(TrgmGistKey *)DatumGetPointer(entryvec->vector[k].key)))
+			memset(signs[k], 0xff, SIGLEN);
+
+	for (k = FirstOffsetNumber; k < maxoff; k = OffsetNumberNext(k)) {
+		for (j = OffsetNumberNext(k); j <= maxoff; j = OffsetNumberNext(j)) {
+			d = gtrgm_sign_hemdist(signs[k], signs[j]);
+			if (d > waste) {
+				waste = d;
+				seed_1 = k;
+				seed_2 = j;
+			}
+		}
+	}
+
+	if (seed_1 == 0 || seed_2 == 0) {
+		seed_1 = 1;
+		seed_2 = 2;
+	}
+
+	memcpy(left, signs[seed_1], SIGLEN);
+	memcpy(right, signs[seed_2], SIGLEN);
+
+	for (k = FirstOffsetNumber; k <= maxoff; k = OffsetNumberNext(k)) {
+		if (k == seed_1) {
+			v->spl_left[v->spl_nleft++] = k;
+			continue;
+		}
+		if (k == seed_2) {
+			v->spl_right[v->spl_nright++] = k;
+			continue;
+		}
+
+		dl = gtrgm_sign_growth(left, signs[k]);
+		dr = gtrgm_sign_growth(right, signs[k]);
+
+		if (dl < dr || (dl == dr && v->spl_nleft < v->spl_nright)) {
+			for (i = 0; i < SIGLEN; i++)
+				left[i] |= signs[k][i];
+			v->spl_left[v->spl_nleft++] = k;
+		} else {
+			for (i = 0; i < SIGLEN; i++)
+				right[i] |= signs[k][i];
+			v->spl_right[v->spl_nright++] = k;
+		}
+	}
+
+	v->spl_ldatum = PointerGetDatum(gtrgm_from_sign(left));
+	v->spl_rdatum = PointerGetDatum(gtrgm_from_sign(right));
+
+	pfree(signs);
+
+	PG_RETURN_POINTER(v);
+}
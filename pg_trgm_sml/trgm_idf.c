@@ -0,0 +1,393 @@
+/*
+ * Document frequencies of trigrams in shared memory, for weighted scoring
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ */
+
+#include <limits.h>
+#include <math.h>
+
+#include "pg_trgm_sml.h"
+
+#include <catalog/pg_type.h>
+#include <executor/spi.h>
+#include <miscadmin.h>
+#include <storage/ipc.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/hsearch.h>
+#include <utils/lsyscache.h>
+
+#include "pg_toys_stats.h"
+
+PG_FUNCTION_INFO_V1(trgm_sml_idf_refresh);
+PG_FUNCTION_INFO_V1(trgm_sml_weighted);
+Datum trgm_sml_idf_refresh(PG_FUNCTION_ARGS);
+Datum trgm_sml_weighted(PG_FUNCTION_ARGS);
+
+static ToysStatsEntry trgm_stats_weighted =
+	TOYS_STATS_ENTRY("trgm_sml_weighted");
+
+/* rows fetched from the corpus at a time by a refresh */
+#define TRGM_IDF_FETCH		1000
+
+/* BM25 parameters, the usual ones */
+#define TRGM_BM25_K1		1.2
+#define TRGM_BM25_B			0.75
+
+typedef struct {
+	uint32			hash;		/* key, must be first */
+	uint32			df;
+} TrgmIdfEntry;
+
+typedef struct {
+	LWLock			*lock;		/* protects the whole cache */
+	int64			ndocs;		/* documents of the corpus */
+	double			avgdl;		/* average trigrams per document */
+} TrgmIdfShared;
+
+/* the cache as seen by one call, copied out under the lock */
+typedef struct {
+	int64			ndocs;
+	double			avgdl;
+	bool			bm25;
+	uint32			*hash;		/* the ranked terms */
+	uint32			*df;		/* and their document frequencies */
+} TrgmIdfWeight;
+
+/* trgm_sml.max_terms */
+static int trgm_idf_max_terms = 100000;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/* both stay NULL unless loaded by shared_preload_libraries */
+static TrgmIdfShared *trgm_idf_shared = NULL;
+static HTAB *trgm_idf_hash = NULL;
+
+static Size
+trgm_idf_memsize(void)
+{
+	return add_size(MAXALIGN(sizeof(TrgmIdfShared)),
+			hash_estimate_size(trgm_idf_max_terms, sizeof(TrgmIdfEntry)));
+}
+
+static void
+trgm_idf_shmem_request(void)
+{
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+
+	RequestAddinShmemSpace(trgm_idf_memsize());
+	RequestNamedLWLockTranche("pg_trgm_sml", 1);
+}
+
+static void
+trgm_idf_shmem_startup(void)
+{
+	HASHCTL			info;
+	bool			found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	trgm_idf_shared = ShmemInitStruct("pg_trgm_sml idf",
+			sizeof(TrgmIdfShared), &found);
+
+	if (!found) {
+		trgm_idf_shared->lock = &(GetNamedLWLockTranche("pg_trgm_sml"))->lock;
+		trgm_idf_shared->ndocs = 0;
+		trgm_idf_shared->avgdl = 0.0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(uint32);
+	info.entrysize = sizeof(TrgmIdfEntry);
+
+	trgm_idf_hash = ShmemInitHash("pg_trgm_sml idf hash",
+			trgm_idf_max_terms, trgm_idf_max_terms,
+			&info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Called from _PG_init. Shared memory can only be had at postmaster start,
+ * so without shared_preload_libraries the weighted functions stay off.
+ */
+void
+trgm_idf_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("trgm_sml.max_terms",
+							"Sets the number of trigrams whose document "
+							"frequency is kept in shared memory.",
+							"Less frequent trigrams beyond that count as "
+							"never seen.",
+							&trgm_idf_max_terms,
+							100000,
+							1000,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = trgm_idf_shmem_request;
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = trgm_idf_shmem_startup;
+}
+
+static void
+trgm_idf_check(const char *prefix)
+{
+	if (trgm_idf_shared == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("%spg_trgm_sml must be loaded via "
+						"shared_preload_libraries", prefix)));
+}
+
+static int
+trgm_idf_entry_cmp(const void *lhs, const void *rhs)
+{
+	const TrgmIdfEntry	*le = lhs, *re = rhs;
+
+	if (le->df != re->df)
+		return le->df > re->df ? -1 : 1;
+
+	return le->hash < re->hash ? -1 : (le->hash > re->hash);
+}
+
+/*
+ * Count the documents of a text column containing each trigram and replace
+ * the shared cache with the result, the most frequent trigrams first when
+ * there are more than trgm_sml.max_terms. Returns the number of documents.
+ */
+Datum trgm_sml_idf_refresh(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_sml_idf_refresh: "
+
+	Oid				relid = PG_GETARG_OID(0);
+	char			*column = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char			*relname, *query;
+	HTAB			*local;
+	HASHCTL			info;
+	HASH_SEQ_STATUS	scan;
+	TrgmIdfEntry	*entry, *sorted;
+	SPIPlanPtr		plan;
+	Portal			portal;
+	int64			ndocs = 0, ntokens = 0, nterms, k;
+	uint64			row;
+	bool			found, isnull;
+	uint32			e;
+
+	trgm_idf_check(EPREFIX);
+
+	relname = get_rel_name(relid);
+	if (relname == NULL)
+		elog(ERROR, EPREFIX "relation with OID %u does not exist", relid);
+
+	query = psprintf("select %s from %s", quote_identifier(column),
+			quote_qualified_identifier(
+				get_namespace_name(get_rel_namespace(relid)), relname));
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(uint32);
+	info.entrysize = sizeof(TrgmIdfEntry);
+	info.hcxt = CurrentMemoryContext;
+
+	local = hash_create("pg_trgm_sml idf refresh", 1024, &info,
+			HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, EPREFIX "SPI_connect failed");
+
+	if ((plan = SPI_prepare(query, 0, NULL)) == NULL)
+		elog(ERROR, EPREFIX "SPI_prepare(\"%s\") failed", query);
+
+	portal = SPI_cursor_open(NULL, plan, NULL, NULL, true);
+
+	for (;;) {
+		SPI_cursor_fetch(portal, true, TRGM_IDF_FETCH);
+		if (SPI_processed == 0)
+			break;
+
+		if (SPI_gettypeid(SPI_tuptable->tupdesc, 1) != TEXTOID)
+			elog(ERROR, EPREFIX "column \"%s\" is not of type text", column);
+
+		for (row = 0; row < SPI_processed; row++) {
+			Datum		datum;
+			TrgmVector	*vec;
+
+			datum = SPI_getbinval(SPI_tuptable->vals[row],
+					SPI_tuptable->tupdesc, 1, &isnull);
+			if (isnull)
+				continue;
+
+			vec = trgm_vector_from_text(DatumGetTextPP(datum));
+
+			for (e = 0; e < vec->nentries; e++) {
+				entry = (TrgmIdfEntry *)hash_search(local,
+						&vec->entries[e].hash, HASH_ENTER, &found);
+				entry->df = found ? entry->df + 1 : 1;
+				ntokens += vec->entries[e].count;
+			}
+			ndocs++;
+
+			pfree(vec);
+		}
+
+		SPI_freetuptable(SPI_tuptable);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	SPI_cursor_close(portal);
+	SPI_finish();
+
+	nterms = hash_get_num_entries(local);
+	sorted = (TrgmIdfEntry *)palloc_extended(
+			sizeof(TrgmIdfEntry) * (nterms + 1), MCXT_ALLOC_HUGE);
+
+	k = 0;
+	hash_seq_init(&scan, local);
+	while ((entry = (TrgmIdfEntry *)hash_seq_search(&scan)) != NULL)
+		sorted[k++] = *entry;
+
+	qsort(sorted, nterms, sizeof(TrgmIdfEntry), trgm_idf_entry_cmp);
+	if (nterms > trgm_idf_max_terms)
+		nterms = trgm_idf_max_terms;
+
+	LWLockAcquire(trgm_idf_shared->lock, LW_EXCLUSIVE);
+
+	hash_seq_init(&scan, trgm_idf_hash);
+	while ((entry = (TrgmIdfEntry *)hash_seq_search(&scan)) != NULL)
+		hash_search(trgm_idf_hash, &entry->hash, HASH_REMOVE, NULL);
+
+	for (k = 0; k < nterms; k++) {
+		entry = (TrgmIdfEntry *)hash_search(trgm_idf_hash,
+				&sorted[k].hash, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+			break;
+		entry->df = sorted[k].df;
+	}
+
+	trgm_idf_shared->ndocs = ndocs;
+	trgm_idf_shared->avgdl = ndocs > 0 ? (double)ntokens / ndocs : 0.0;
+
+	LWLockRelease(trgm_idf_shared->lock);
+
+	hash_destroy(local);
+	pfree(sorted);
+
+	PG_RETURN_INT64(ndocs);
+
+	#undef EPREFIX
+}
+
+/*
+ * Collect the ranked terms and, at the last of them, look them all up with
+ * the shared lock held for just that. A missing trigram has df 0.
+ */
+static void
+trgm_idf_terms(uint32_t hash, size_t rank, size_t nterms, void *arg)
+{
+	TrgmIdfWeight	*w = (TrgmIdfWeight *)arg;
+	TrgmIdfEntry	*entry;
+	size_t			i;
+
+	if (rank == 0) {
+		w->hash = (uint32 *)palloc(sizeof(uint32) * nterms);
+		w->df = (uint32 *)palloc0(sizeof(uint32) * nterms);
+	}
+
+	w->hash[rank] = hash;
+
+	if (rank + 1 < nterms)
+		return;
+
+	LWLockAcquire(trgm_idf_shared->lock, LW_SHARED);
+
+	w->ndocs = trgm_idf_shared->ndocs;
+	w->avgdl = trgm_idf_shared->avgdl;
+
+	for (i = 0; i < nterms; i++) {
+		entry = (TrgmIdfEntry *)hash_search(trgm_idf_hash, &w->hash[i],
+				HASH_FIND, NULL);
+		if (entry)
+			w->df[i] = entry->df;
+	}
+
+	LWLockRelease(trgm_idf_shared->lock);
+}
+
+static double
+trgm_idf_weight(uint32_t hash, size_t rank, size_t count, size_t doclen,
+		void *arg)
+{
+	TrgmIdfWeight	*w = (TrgmIdfWeight *)arg;
+	double			df, idf, norm;
+
+	df = Min(w->df[rank], w->ndocs);
+
+	if (!w->bm25) {
+		idf = log((w->ndocs + 1.0) / (df + 1.0)) + 1.0;
+		return count * idf;
+	}
+
+	idf = log(1.0 + (w->ndocs - df + 0.5) / (df + 0.5));
+	norm = w->avgdl > 0.0 ?
+		1.0 - TRGM_BM25_B + TRGM_BM25_B * doclen / w->avgdl : 1.0;
+
+	return idf * count * (TRGM_BM25_K1 + 1.0) / (count + TRGM_BM25_K1 * norm);
+}
+
+/*
+ * trgm_sml with the counts of the n most frequent trigrams replaced by
+ * their TF-IDF or BM25 weights over the corpus of the last refresh.
+ */
+Datum trgm_sml_weighted(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_sml_weighted: "
+
+	text			*a = PG_GETARG_TEXT_PP(0);
+	text			*b = PG_GETARG_TEXT_PP(1);
+	int				max = PG_GETARG_INT32(2);
+	char			*scheme = text_to_cstring(PG_GETARG_TEXT_PP(3));
+	TrgmIdfWeight	w = {0};
+	double			score;
+	instr_time		start;
+
+	trgm_idf_check(EPREFIX);
+
+	if (pg_strcasecmp(scheme, "tfidf") == 0)
+		w.bm25 = false;
+	else if (pg_strcasecmp(scheme, "bm25") == 0)
+		w.bm25 = true;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg(EPREFIX "unrecognized scheme \"%s\"", scheme),
+				 errhint("Valid schemes are \"tfidf\" and \"bm25\".")));
+
+	toys_stats_begin(&start);
+
+	/* tokenized and ranked without the lock, see trgm_idf_terms */
+	score = trgm_text_score(a, b, max, trgm_idf_terms, trgm_idf_weight, &w);
+
+	toys_stats_end(&trgm_stats_weighted, &start,
+			VARSIZE_ANY_EXHDR(a) + VARSIZE_ANY_EXHDR(b), 0);
+
+	PG_RETURN_FLOAT8(score);
+
+	#undef EPREFIX
+}
@@ -0,0 +1,170 @@
+/*
+ * MinHash signatures and LSH band keys over word trigrams
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ */
+
+#include "pg_trgm_sml.h"
+
+#include <catalog/pg_type.h>
+#include <utils/array.h>
+
+#include "pg_toys_stats.h"
+
+PG_FUNCTION_INFO_V1(trgm_minhash);
+PG_FUNCTION_INFO_V1(trgm_lsh_bands);
+Datum trgm_minhash(PG_FUNCTION_ARGS);
+Datum trgm_lsh_bands(PG_FUNCTION_ARGS);
+
+static ToysStatsEntry trgm_stats_minhash = TOYS_STATS_ENTRY("trgm_minhash");
+
+/* the finalizer of MurmurHash3, a bijection on 32 bits */
+static inline uint32_t trgm_fmix32(uint32_t h)
+{
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/* FNV-1a step over the four bytes of v, low byte first */
+static inline uint64 trgm_fnv64(uint64 h, uint32 v)
+{
+	int				i;
+
+	for (i = 0; i < 4; i++, v >>= 8)
+		h = (h ^ (v & 0xff)) * UINT64CONST(1099511628211);
+
+	return h;
+}
+
+/*
+ * k independent minima over the distinct trigram hashes of the text. The
+ * i-th permutation is fmix32(hash ^ seed(i)), so that two signatures agree
+ * at each position with a probability equal to the Jaccard similarity of
+ * the trigram sets. A text without a trigram has an empty signature.
+ */
+Datum trgm_minhash(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_minhash: "
+
+	text			*datum = PG_GETARG_TEXT_PP(0);
+	int32			k = PG_GETARG_INT32(1);
+	TrgmVector		*vec;
+	uint32			*seed, *sig, h, e;
+	Datum			*elems;
+	int32			i;
+	instr_time		start;
+
+	if (k <= 0)
+		elog(ERROR, EPREFIX "number of hashes must be positive");
+
+	toys_stats_begin(&start);
+
+	vec = trgm_vector_from_text(datum);
+
+	if (vec->nentries == 0) {
+		toys_stats_end(&trgm_stats_minhash, &start,
+				VARSIZE_ANY_EXHDR(datum), 0);
+		pfree(vec);
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT4OID));
+	}
+
+	seed = (uint32 *)palloc(sizeof(uint32) * k);
+	sig = (uint32 *)palloc(sizeof(uint32) * k);
+
+	for (i = 0; i < k; i++) {
+		seed[i] = trgm_fmix32(0x9e3779b9u * (uint32)(i + 1));
+		sig[i] = UINT32_MAX;
+	}
+
+	/* hashes outside, seeds inside, the inner loop vectorizes */
+	for (e = 0; e < vec->nentries; e++) {
+		uint32		hash = vec->entries[e].hash;
+
+		for (i = 0; i < k; i++) {
+			h = trgm_fmix32(hash ^ seed[i]);
+			if (h < sig[i])
+				sig[i] = h;
+		}
+	}
+
+	elems = (Datum *)palloc(sizeof(Datum) * k);
+	for (i = 0; i < k; i++)
+		elems[i] = Int32GetDatum((int32)sig[i]);
+
+	toys_stats_end(&trgm_stats_minhash, &start, VARSIZE_ANY_EXHDR(datum),
+			vec->nentries);
+
+	pfree(vec);
+	pfree(seed);
+	pfree(sig);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, k, INT4OID,
+				sizeof(int32), true, TYPALIGN_INT));
+
+	#undef EPREFIX
+}
+
+/*
+ * Cut a signature into bands of equal rows and hash every band, with its
+ * index, to a bigint. Two signatures share a key only when a whole band
+ * agrees, so with b bands of r rows a pair of Jaccard similarity s becomes
+ * a candidate with probability 1 - (1 - s^r)^b.
+ */
+Datum trgm_lsh_bands(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_lsh_bands: "
+
+	ArrayType		*arr = PG_GETARG_ARRAYTYPE_P(0);
+	int32			bands = PG_GETARG_INT32(1);
+	Datum			*elems, *keys;
+	bool			*nulls;
+	int				nelems, rows, b, r, i;
+	uint64			h;
+
+	if (ARR_NDIM(arr) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("array must be one-dimensional")));
+
+	if (array_contains_nulls(arr))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("array must not contain nulls")));
+
+	if (bands <= 0)
+		elog(ERROR, EPREFIX "number of bands must be positive");
+
+	deconstruct_array(arr, INT4OID, sizeof(int32), true, TYPALIGN_INT,
+			&elems, &nulls, &nelems);
+
+	if (nelems == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT8OID));
+
+	if (nelems % bands != 0)
+		elog(ERROR, EPREFIX "a signature of %d hashes can not be cut "
+				"into %d bands", nelems, bands);
+
+	rows = nelems / bands;
+	keys = (Datum *)palloc(sizeof(Datum) * bands);
+
+	/* the band index goes first, equal rows in other bands differ */
+	for (b = 0, i = 0; b < bands; b++) {
+		h = trgm_fnv64(UINT64CONST(14695981039346656037), (uint32)b);
+
+		for (r = 0; r < rows; r++)
+			h = trgm_fnv64(h, (uint32)DatumGetInt32(elems[i++]));
+
+		keys[b] = Int64GetDatum((int64)h);
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(keys, bands, INT8OID,
+				sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+
+	#undef EPREFIX
+}
@@ -0,0 +1,286 @@
+/*
+ * Planner support: costs by argument width, selectivity from statistics
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ */
+
+#include "pg_trgm_sml.h"
+
+#include <access/detoast.h>
+#include <access/htup_details.h>
+#include <catalog/pg_statistic.h>
+#include <catalog/pg_type.h>
+#include <nodes/nodeFuncs.h>
+#include <nodes/supportnodes.h>
+#include <optimizer/optimizer.h>
+#include <utils/lsyscache.h>
+#include <utils/selfuncs.h>
+
+PG_FUNCTION_INFO_V1(trgm_sml_support);
+PG_FUNCTION_INFO_V1(trgm_sml_sel);
+Datum trgm_sml_support(PG_FUNCTION_ARGS);
+Datum trgm_sml_sel(PG_FUNCTION_ARGS);
+
+/* bytes of argument tokenized and hashed for the price of an operator */
+#define TRGM_COST_BYTES		16.0
+
+/* guessed without statistics, a similarity threshold keeps few rows */
+#define TRGM_DEFAULT_SEL	0.01
+
+/* a histogram of fewer entries says too little to count matches in */
+#define TRGM_MIN_HIST		10
+
+/*
+ * Average width of an argument: a constant as it is, a column from its
+ * statistics, otherwise a guess by type. The statistics have the stored
+ * width, which for a toasted value is that of the compressed data or of the
+ * toast pointer, so long documents tend to look cheaper than they are.
+ */
+static double
+trgm_arg_width(PlannerInfo *root, Node *arg)
+{
+	VariableStatData	vardata;
+	int32				width = 0;
+
+	if (root)
+		arg = estimate_expression_value(root, arg);
+
+	if (IsA(arg, Const)) {
+		Const		*c = (Const *)arg;
+
+		if (c->constisnull)
+			return 0.0;
+
+		return toast_raw_datum_size(c->constvalue) - VARHDRSZ;
+	}
+
+	if (root) {
+		examine_variable(root, arg, 0, &vardata);
+		if (HeapTupleIsValid(vardata.statsTuple))
+			width = ((Form_pg_statistic)
+					GETSTRUCT(vardata.statsTuple))->stawidth;
+		ReleaseVariableStats(vardata);
+	}
+
+	if (width <= 0)
+		width = get_typavgwidth(exprType(arg), exprTypmod(arg));
+
+	return width;
+}
+
+/* every varlena argument is read whole on every call */
+static Node *
+trgm_support_cost(SupportRequestCost *req)
+{
+	List			*args;
+	ListCell		*lc;
+	double			width = 0.0;
+
+	if (req->node == NULL)
+		return NULL;
+
+	if (IsA(req->node, FuncExpr))
+		args = ((FuncExpr *)req->node)->args;
+	else if (IsA(req->node, OpExpr))
+		args = ((OpExpr *)req->node)->args;
+	else
+		return NULL;
+
+	foreach(lc, args) {
+		Node		*arg = (Node *)lfirst(lc);
+
+		if (get_typlen(exprType(arg)) == -1)
+			width += trgm_arg_width(req->root, arg);
+	}
+
+	req->startup = 0;
+	req->per_tuple = cpu_operator_cost * (1.0 + width / TRGM_COST_BYTES);
+
+	return (Node *)req;
+}
+
+static double
+trgm_sample_similarity(TrgmVector *query, Datum value)
+{
+	TrgmVector		*vec = trgm_vector_from_text(DatumGetTextPP(value));
+	double			score;
+
+	score = trgm_vector_similarity(query->entries, query->nentries,
+			vec->entries, vec->nentries);
+	pfree(vec);
+
+	return score;
+}
+
+/*
+ * Share of the column scoring at least threshold against query, counted
+ * over the most common values by their frequencies and over the histogram
+ * bounds as a sample of the rest. ANALYZE leaves values wider than 1 kB out
+ * of both, the estimate is for the shorter ones. The function funcid is not
+ * leakproof and the estimate shows in EXPLAIN, so the values are only
+ * looked at when the user may read the column, as eqsel does.
+ */
+static Selectivity
+trgm_stats_selectivity(VariableStatData *vardata, Oid funcid, Datum query,
+		double threshold)
+{
+	Form_pg_statistic	stats;
+	AttStatsSlot		sslot;
+	TrgmVector			*qvec;
+	double				mcvsel = 0.0, sumcommon = 0.0;
+	double				histsel = TRGM_DEFAULT_SEL;
+	int					i, nmatch;
+
+	if (!HeapTupleIsValid(vardata->statsTuple)
+		|| !statistic_proc_security_check(vardata, funcid))
+		return TRGM_DEFAULT_SEL;
+
+	stats = (Form_pg_statistic)GETSTRUCT(vardata->statsTuple);
+	qvec = trgm_vector_from_text(DatumGetTextPP(query));
+
+	if (get_attstatsslot(&sslot, vardata->statsTuple, STATISTIC_KIND_MCV,
+				InvalidOid, ATTSTATSSLOT_VALUES | ATTSTATSSLOT_NUMBERS)) {
+		for (i = 0; i < sslot.nvalues; i++) {
+			sumcommon += sslot.numbers[i];
+			if (trgm_sample_similarity(qvec, sslot.values[i]) >= threshold)
+				mcvsel += sslot.numbers[i];
+		}
+		free_attstatsslot(&sslot);
+	}
+
+	if (get_attstatsslot(&sslot, vardata->statsTuple,
+				STATISTIC_KIND_HISTOGRAM, InvalidOid, ATTSTATSSLOT_VALUES)) {
+		if (sslot.nvalues >= TRGM_MIN_HIST) {
+			for (i = 0, nmatch = 0; i < sslot.nvalues; i++)
+				if (trgm_sample_similarity(qvec, sslot.values[i]) >= threshold)
+					nmatch++;
+			histsel = (double)nmatch / sslot.nvalues;
+		}
+		free_attstatsslot(&sslot);
+	}
+
+	pfree(qvec);
+
+	return mcvsel + histsel * Max(0.0, 1.0 - sumcommon - stats->stanullfrac);
+}
+
+/* a text column against a constant, scoring at least threshold by funcid */
+static Selectivity
+trgm_clause_selectivity(PlannerInfo *root, Oid funcid, List *args,
+		int varRelid, double threshold)
+{
+	VariableStatData	vardata;
+	Node				*other;
+	bool				varonleft;
+	Selectivity			sel = TRGM_DEFAULT_SEL;
+
+	if (!get_restriction_variable(root, args, varRelid,
+				&vardata, &other, &varonleft))
+		return TRGM_DEFAULT_SEL;
+
+	if (IsA(other, Const) && ((Const *)other)->constisnull)
+		sel = 0.0;
+	else if (IsA(other, Const) && (vardata.atttype == TEXTOID
+				|| vardata.atttype == VARCHAROID
+				|| vardata.atttype == BPCHAROID))
+		sel = trgm_stats_selectivity(&vardata, funcid,
+				((Const *)other)->constvalue, threshold);
+
+	ReleaseVariableStats(vardata);
+
+	CLAMP_PROBABILITY(sel);
+
+	return sel;
+}
+
+/*
+ * trgm_sml_op(a, b) at trgm_sml.similarity_threshold, or
+ * trgm_sml_above(a, b, threshold) with a constant threshold.
+ */
+static Node *
+trgm_support_selectivity(SupportRequestSelectivity *req)
+{
+	List			*args = req->args;
+	double			threshold = trgm_sml_threshold;
+
+	if (req->is_join)
+		return NULL;
+
+	if (list_length(args) == 3) {
+		Node		*arg = estimate_expression_value(req->root, lthird(args));
+
+		if (!IsA(arg, Const) || ((Const *)arg)->consttype != FLOAT8OID)
+			return NULL;
+
+		if (((Const *)arg)->constisnull) {
+			req->selectivity = 0.0;
+			return (Node *)req;
+		}
+
+		threshold = DatumGetFloat8(((Const *)arg)->constvalue);
+		args = list_make2(linitial(args), lsecond(args));
+	} else if (list_length(args) != 2) {
+		return NULL;
+	}
+
+	req->selectivity = trgm_clause_selectivity(req->root, req->funcid, args,
+			req->varRelid, threshold);
+
+	return (Node *)req;
+}
+
+/* trgm_tags(t, max) and trgm_tags_char(t, gram, max) return max rows at most */
+static Node *
+trgm_support_rows(SupportRequestRows *req)
+{
+	List			*args;
+	Node			*arg;
+
+	if (req->node == NULL || !IsA(req->node, FuncExpr))
+		return NULL;
+
+	args = ((FuncExpr *)req->node)->args;
+	if (list_length(args) < 2)
+		return NULL;
+
+	arg = (Node *)llast(args);
+	if (req->root)
+		arg = estimate_expression_value(req->root, arg);
+
+	if (!IsA(arg, Const) || ((Const *)arg)->consttype != INT4OID
+		|| ((Const *)arg)->constisnull
+		|| DatumGetInt32(((Const *)arg)->constvalue) < 0)
+		return NULL;
+
+	req->rows = Max(1, DatumGetInt32(((Const *)arg)->constvalue));
+
+	return (Node *)req;
+}
+
+Datum trgm_sml_support(PG_FUNCTION_ARGS)
+{
+	Node			*rawreq = (Node *)PG_GETARG_POINTER(0);
+	Node			*ret = NULL;
+
+	if (IsA(rawreq, SupportRequestCost))
+		ret = trgm_support_cost((SupportRequestCost *)rawreq);
+	else if (IsA(rawreq, SupportRequestSelectivity))
+		ret = trgm_support_selectivity((SupportRequestSelectivity *)rawreq);
+	else if (IsA(rawreq, SupportRequestRows))
+		ret = trgm_support_rows((SupportRequestRows *)rawreq);
+
+	PG_RETURN_POINTER(ret);
+}
+
+/* restriction estimator of %% */
+Datum trgm_sml_sel(PG_FUNCTION_ARGS)
+{
+	PlannerInfo		*root = (PlannerInfo *)PG_GETARG_POINTER(0);
+	Oid				operator = PG_GETARG_OID(1);
+	List			*args = (List *)PG_GETARG_POINTER(2);
+	int				varRelid = PG_GETARG_INT32(3);
+
+	PG_RETURN_FLOAT8(trgm_clause_selectivity(root, get_opcode(operator), args,
+				varRelid, trgm_sml_threshold));
+}
@@ -0,0 +1,946 @@
+/*
+ * Background worker keeping trigram columns of watched tables up to date
+ *
+ * Copyright (C) Jianing Yang <detrox@gmai.com>, 2008
+ *
+ * trgm_sml_watch(table, src, dst) puts a trigger on the table that queues
+ * the primary key of every row whose src changes. The worker, started when
+ * trgm_sml.worker_database is set, takes the queue in batches and stores
+ * to_trgm_vector(src), or to_trgm_ids(src, true) for an int4[] column, in
+ * dst. Writers pay an insert into the queue, the tokenizing is done later
+ * and in bulk; until then dst is NULL for new rows and stale for changed
+ * ones.
+ *
+ * The worker connects as the bootstrap superuser but runs nothing as it:
+ * it only calls trgm_sml_process_queue functions of this library, as the
+ * owner of the trgm_sml_targets next to them, and the rows of a table are
+ * updated as the owner of the table.
+ *
+ * Every queue and every table update runs in a subtransaction. A table
+ * whose update fails is retried row by row, and the rows failing on their
+ * own are dropped from the queue with a warning, so that one bad row does
+ * not hold up the others.
+ */
+
+#include <limits.h>
+
+#include "pg_trgm_sml.h"
+
+#include <access/genam.h>
+#include <access/htup_details.h>
+#include <access/relation.h>
+#include <access/xact.h>
+#include <catalog/pg_type.h>
+#include <commands/trigger.h>
+#include <executor/spi.h>
+#include <miscadmin.h>
+#include <pgstat.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <storage/latch.h>
+#include <utils/builtins.h>
+#include <utils/datum.h>
+#include <utils/guc.h>
+#include <utils/array.h>
+#include <utils/lsyscache.h>
+#include <utils/rel.h>
+#include <utils/relcache.h>
+#include <utils/resowner.h>
+#include <utils/snapmgr.h>
+#include <utils/syscache.h>
+
+PG_FUNCTION_INFO_V1(trgm_sml_enqueue);
+PG_FUNCTION_INFO_V1(trgm_sml_watch);
+PG_FUNCTION_INFO_V1(trgm_sml_unwatch);
+PG_FUNCTION_INFO_V1(trgm_sml_process_queue);
+Datum trgm_sml_enqueue(PG_FUNCTION_ARGS);
+Datum trgm_sml_watch(PG_FUNCTION_ARGS);
+Datum trgm_sml_unwatch(PG_FUNCTION_ARGS);
+Datum trgm_sml_process_queue(PG_FUNCTION_ARGS);
+
+PGDLLEXPORT void trgm_sml_worker_main(Datum main_arg);
+
+/*
+ * Every database may have the functions in another schema, or none. Only
+ * C functions are candidates, whether they are this library is checked on
+ * the function address.
+ */
+#define TRGM_WORKER_QUEUES \
+	"select p.oid, p.proowner, c.relowner, n.nspname " \
+	"from pg_catalog.pg_proc p " \
+	"join pg_catalog.pg_namespace n on n.oid = p.pronamespace " \
+	"join pg_catalog.pg_class c on c.relnamespace = p.pronamespace " \
+	"and c.relname = 'trgm_sml_targets' and c.relkind = 'r' " \
+	"where p.proname = 'trgm_sml_process_queue' " \
+	"and p.prosrc = 'trgm_sml_process_queue' and p.prolang = " \
+	"(select oid from pg_catalog.pg_language where lanname = 'c')"
+
+/* trgm_sml.worker_database, trgm_sml.worker_naptime, ... */
+static char *trgm_worker_database = NULL;
+static int trgm_worker_naptime = 1000;
+static int trgm_worker_batch_size = 1000;
+
+/* the insert of trgm_sml_enqueue, prepared once per backend */
+static SPIPlanPtr trgm_enqueue_plan = NULL;
+static Oid trgm_enqueue_nspid = InvalidOid;
+
+/*
+ * Run fn(arg) in a subtransaction. An error rolls it back and is returned
+ * in *error instead of being thrown, the caller goes on as it sees fit.
+ */
+static bool
+trgm_try(void (*fn)(void *arg), void *arg, ErrorData **error)
+{
+	MemoryContext	oldcxt = CurrentMemoryContext;
+	ResourceOwner	oldowner = CurrentResourceOwner;
+	bool			ok = true;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcxt);
+
+	PG_TRY();
+	{
+		fn(arg);
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcxt);
+		CurrentResourceOwner = oldowner;
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcxt);
+		*error = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcxt);
+		CurrentResourceOwner = oldowner;
+
+		ok = false;
+	}
+	PG_END_TRY();
+
+	return ok;
+}
+
+/*
+ * Keys travel through the queue as text, written by the trigger of the
+ * writer and read back by the worker. The settings the output and input
+ * of dates, times, intervals, floats and money depend on are fixed while
+ * either is done; returns the nest level to restore with AtEOXact_GUC.
+ */
+static int
+trgm_key_settings(void)
+{
+	static const char *const settings[][2] = {
+		{"DateStyle", "ISO, YMD"},
+		{"IntervalStyle", "postgres"},
+		{"TimeZone", "UTC"},
+		{"extra_float_digits", "1"},
+		{"lc_monetary", "C"},
+	};
+	int				nestlevel = NewGUCNestLevel();
+	int				i;
+
+	for (i = 0; i < lengthof(settings); i++)
+		(void)set_config_option(settings[i][0], settings[i][1], PGC_USERSET,
+				PGC_S_SESSION, GUC_ACTION_SAVE, true, 0, false);
+
+	return nestlevel;
+}
+
+/*
+ * Called from _PG_init. A worker can only be registered at postmaster
+ * start, so without shared_preload_libraries the queue is only taken by
+ * calls of trgm_sml_process_queue.
+ */
+void
+trgm_worker_init(void)
+{
+	BackgroundWorker	worker;
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomStringVariable("trgm_sml.worker_database",
+							   "Sets the database whose watched columns "
+							   "the background worker maintains.",
+							   "Empty starts no worker.",
+							   &trgm_worker_database,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("trgm_sml.worker_naptime",
+							"Sets the time the background worker sleeps "
+							"when the queue is empty.",
+							NULL,
+							&trgm_worker_naptime,
+							1000,
+							10,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("trgm_sml.worker_batch_size",
+							"Sets the number of queued rows the background "
+							"worker takes in a transaction.",
+							NULL,
+							&trgm_worker_batch_size,
+							1000,
+							1,
+							INT_MAX / 2,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	if (trgm_worker_database == NULL || trgm_worker_database[0] == '\0')
+		return;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS
+		| BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 10;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_trgm_sml");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "trgm_sml_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "pg_trgm_sml worker");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_trgm_sml worker");
+
+	RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * The function storing src into dst: to_trgm_vector for a trgm_vector of
+ * the schema nspid, to_trgm_ids for an int4[]. NULL if the columns do not
+ * fit, with the reason in *why.
+ */
+static const char *
+trgm_watch_function(Oid relid, const char *src, const char *dst, Oid nspid,
+		const char **why)
+{
+	AttrNumber		srcatt = get_attnum(relid, src);
+	AttrNumber		dstatt = get_attnum(relid, dst);
+	Oid				srctype, dsttype;
+
+	if (srcatt <= 0 || dstatt <= 0) {
+		*why = "column does not exist";
+		return NULL;
+	}
+
+	srctype = get_atttype(relid, srcatt);
+	if (srctype != TEXTOID && srctype != VARCHAROID && srctype != BPCHAROID) {
+		*why = "source column is not of type text";
+		return NULL;
+	}
+
+	dsttype = get_atttype(relid, dstatt);
+	if (dsttype == INT4ARRAYOID)
+		return "to_trgm_ids";
+
+	if (dsttype == GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid,
+				CStringGetDatum("trgm_vector"), ObjectIdGetDatum(nspid)))
+		return "to_trgm_vector";
+
+	*why = "destination column is not of type trgm_vector or int4[]";
+
+	return NULL;
+}
+
+/*
+ * The columns of the primary key of rel in index order, NULL if it has
+ * none. The queue knows a row by the text of their values, which unlike its
+ * tid survives updates, VACUUM FULL and CLUSTER.
+ */
+static AttrNumber *
+trgm_watch_key(Relation rel, int *nkeys)
+{
+	Oid				pkoid = RelationGetPrimaryKeyIndex(rel);
+	Relation		index;
+	AttrNumber		*keys;
+	int				i;
+
+	if (!OidIsValid(pkoid))
+		return NULL;
+
+	index = index_open(pkoid, AccessShareLock);
+
+	*nkeys = IndexRelationGetNumberOfKeyAttributes(index);
+	keys = palloc(sizeof(AttrNumber) * *nkeys);
+	for (i = 0; i < *nkeys; i++)
+		keys[i] = index->rd_index->indkey.values[i];
+
+	index_close(index, AccessShareLock);
+
+	return keys;
+}
+
+/*
+ * AFTER INSERT OR UPDATE FOR EACH ROW trigger made by trgm_sml_watch, with
+ * the source and destination columns as arguments. A row is queued when
+ * its src is new or changed, when it still waits for its dst, or when its
+ * key changed under a queued entry. The update of dst by the worker queues
+ * nothing.
+ */
+Datum trgm_sml_enqueue(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_sml_enqueue: "
+
+	TriggerData			*trigdata = (TriggerData *)fcinfo->context;
+	Oid					nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	TupleDesc			tupdesc;
+	Form_pg_attribute	attr;
+	HeapTuple			tuple;
+	AttrNumber			*keys;
+	Datum				src, old;
+	Datum				values[2];
+	Datum				*keyvals;
+	Oid					argtypes[2] = {OIDOID, TEXTARRAYOID};
+	int					srcatt, dstatt, nkeys, i;
+	bool				srcnull, oldnull, dstnull, unchanged;
+	char				*query;
+	int					nestlevel;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, EPREFIX "not called by trigger manager");
+
+	if (!TRIGGER_FIRED_AFTER(trigdata->tg_event)
+		|| !TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+		elog(ERROR, EPREFIX "must be fired after a row is written");
+
+	if (trigdata->tg_trigger->tgnargs != 2)
+		elog(ERROR, EPREFIX "source and destination columns expected");
+
+	tupdesc = RelationGetDescr(trigdata->tg_relation);
+	srcatt = SPI_fnumber(tupdesc, trigdata->tg_trigger->tgargs[0]);
+	dstatt = SPI_fnumber(tupdesc, trigdata->tg_trigger->tgargs[1]);
+
+	if (srcatt <= 0 || dstatt <= 0)
+		elog(ERROR, EPREFIX "column \"%s\" does not exist",
+				trigdata->tg_trigger->tgargs[srcatt <= 0 ? 0 : 1]);
+
+	if ((keys = trgm_watch_key(trigdata->tg_relation, &nkeys)) == NULL)
+		elog(ERROR, EPREFIX "%s has no primary key",
+				RelationGetRelationName(trigdata->tg_relation));
+
+	if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event)) {
+		tuple = trigdata->tg_newtuple;
+		attr = TupleDescAttr(tupdesc, srcatt - 1);
+
+		src = heap_getattr(tuple, srcatt, tupdesc, &srcnull);
+		old = heap_getattr(trigdata->tg_trigtuple, srcatt, tupdesc, &oldnull);
+		(void)heap_getattr(tuple, dstatt, tupdesc, &dstnull);
+
+		unchanged = srcnull == oldnull && (srcnull
+					|| datumIsEqual(src, old, attr->attbyval, attr->attlen))
+			&& (srcnull || !dstnull);
+
+		/* key columns are never NULL */
+		for (i = 0; unchanged && i < nkeys; i++) {
+			attr = TupleDescAttr(tupdesc, keys[i] - 1);
+			src = heap_getattr(tuple, keys[i], tupdesc, &srcnull);
+			old = heap_getattr(trigdata->tg_trigtuple, keys[i], tupdesc,
+					&oldnull);
+			unchanged = datumIsEqual(src, old, attr->attbyval, attr->attlen);
+		}
+
+		if (unchanged)
+			return PointerGetDatum(NULL);
+	} else if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event)) {
+		tuple = trigdata->tg_trigtuple;
+
+		(void)heap_getattr(tuple, srcatt, tupdesc, &srcnull);
+		if (srcnull)
+			return PointerGetDatum(NULL);
+	} else {
+		elog(ERROR, EPREFIX "must be fired by INSERT or UPDATE");
+	}
+
+	keyvals = palloc(sizeof(Datum) * nkeys);
+	nestlevel = trgm_key_settings();
+	for (i = 0; i < nkeys; i++)
+		keyvals[i] = CStringGetTextDatum(SPI_getvalue(tuple, tupdesc,
+					keys[i]));
+	AtEOXact_GUC(false, nestlevel);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, EPREFIX "SPI_connect failed");
+
+	if (trgm_enqueue_plan == NULL || trgm_enqueue_nspid != nspid) {
+		if (trgm_enqueue_plan != NULL)
+			SPI_freeplan(trgm_enqueue_plan);
+		trgm_enqueue_plan = NULL;
+
+		query = psprintf("insert into %s (relid, key) values ($1, $2)",
+				quote_qualified_identifier(get_namespace_name(nspid),
+					"trgm_sml_queue"));
+
+		if ((trgm_enqueue_plan = SPI_prepare(query, 2, argtypes)) == NULL)
+			elog(ERROR, EPREFIX "SPI_prepare(\"%s\") failed", query);
+
+		SPI_keepplan(trgm_enqueue_plan);
+		trgm_enqueue_nspid = nspid;
+	}
+
+	values[0] = ObjectIdGetDatum(RelationGetRelid(trigdata->tg_relation));
+	values[1] = PointerGetDatum(construct_array(keyvals, nkeys, TEXTOID,
+				-1, false, TYPALIGN_INT));
+
+	if (SPI_execute_plan(trgm_enqueue_plan, values, NULL, false, 0)
+			!= SPI_OK_INSERT)
+		elog(ERROR, EPREFIX "SPI_execute_plan failed");
+
+	SPI_finish();
+
+	return PointerGetDatum(NULL);
+
+	#undef EPREFIX
+}
+
+static void
+trgm_watch_execute(const char *query, int nargs, Oid *argtypes, Datum *values,
+		int expected, const char *prefix)
+{
+	int				rc;
+
+	if (nargs > 0)
+		rc = SPI_execute_with_args(query, nargs, argtypes, values, NULL,
+				false, 0);
+	else
+		rc = SPI_execute(query, false, 0);
+
+	if (rc != expected)
+		elog(ERROR, "%sSPI_execute(\"%s\") failed", prefix, query);
+}
+
+/*
+ * Have dst of the table kept as the trigrams of src, replacing what was
+ * watched of it before. The table needs a primary key. All present rows
+ * are queued, their number is returned.
+ */
+Datum trgm_sml_watch(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_sml_watch: "
+
+	Oid				relid = PG_GETARG_OID(0);
+	Name			src = PG_GETARG_NAME(1);
+	Name			dst = PG_GETARG_NAME(2);
+	Oid				nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	Oid				argtypes[3] = {OIDOID, NAMEOID, NAMEOID};
+	Datum			values[3];
+	Relation		rel;
+	AttrNumber		*keys;
+	StringInfoData	key;
+	const char		*why = NULL;
+	char			*nsp, *relname;
+	int64			nrows;
+	int				nkeys, nestlevel, i;
+
+	if (get_rel_name(relid) == NULL)
+		elog(ERROR, EPREFIX "relation with OID %u does not exist", relid);
+
+	if (trgm_watch_function(relid, NameStr(*src), NameStr(*dst), nspid,
+				&why) == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg(EPREFIX "cannot store \"%s\" into \"%s\" of %s: %s",
+						NameStr(*src), NameStr(*dst),
+						get_rel_name(relid), why)));
+
+	rel = relation_open(relid, AccessShareLock);
+
+	if ((keys = trgm_watch_key(rel, &nkeys)) == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg(EPREFIX "cannot watch %s: it has no primary key",
+						RelationGetRelationName(rel))));
+
+	/* the text of the key as the trigger makes it, by the output function */
+	initStringInfo(&key);
+	for (i = 0; i < nkeys; i++)
+		appendStringInfo(&key, "%spg_catalog.format('%%s', %s)",
+				i > 0 ? ", " : "",
+				quote_identifier(NameStr(TupleDescAttr(RelationGetDescr(rel),
+							keys[i] - 1)->attname)));
+
+	nsp = get_namespace_name(nspid);
+	relname = quote_qualified_identifier(
+			get_namespace_name(RelationGetNamespace(rel)),
+			RelationGetRelationName(rel));
+
+	relation_close(rel, NoLock);
+
+	values[0] = ObjectIdGetDatum(relid);
+	values[1] = NameGetDatum(src);
+	values[2] = NameGetDatum(dst);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, EPREFIX "SPI_connect failed");
+
+	trgm_watch_execute(psprintf("insert into %s (relid, src, dst) "
+				"values ($1, $2, $3) on conflict (relid) do update "
+				"set src = excluded.src, dst = excluded.dst",
+				quote_qualified_identifier(nsp, "trgm_sml_targets")),
+			3, argtypes, values, SPI_OK_INSERT, EPREFIX);
+
+	trgm_watch_execute(psprintf("drop trigger if exists trgm_sml_enqueue "
+				"on %s", relname), 0, NULL, NULL, SPI_OK_UTILITY, EPREFIX);
+
+	trgm_watch_execute(psprintf("create trigger trgm_sml_enqueue "
+				"after insert or update on %s for each row execute function "
+				"%s(%s, %s)", relname,
+				quote_qualified_identifier(nsp, "trgm_sml_enqueue"),
+				quote_literal_cstr(NameStr(*src)),
+				quote_literal_cstr(NameStr(*dst))),
+			0, NULL, NULL, SPI_OK_UTILITY, EPREFIX);
+
+	nestlevel = trgm_key_settings();
+
+	trgm_watch_execute(psprintf("insert into %s (relid, key) "
+				"select $1, array[%s] from %s",
+				quote_qualified_identifier(nsp, "trgm_sml_queue"), key.data,
+				relname),
+			1, argtypes, values, SPI_OK_INSERT, EPREFIX);
+
+	nrows = (int64)SPI_processed;
+
+	AtEOXact_GUC(false, nestlevel);
+
+	SPI_finish();
+
+	PG_RETURN_INT64(nrows);
+
+	#undef EPREFIX
+}
+
+/* rows of the table still queued are dropped by the next batch */
+Datum trgm_sml_unwatch(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_sml_unwatch: "
+
+	Oid				relid = PG_GETARG_OID(0);
+	Oid				nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	Oid				argtypes[1] = {OIDOID};
+	Datum			values[1];
+
+	if (get_rel_name(relid) == NULL)
+		elog(ERROR, EPREFIX "relation with OID %u does not exist", relid);
+
+	values[0] = ObjectIdGetDatum(relid);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, EPREFIX "SPI_connect failed");
+
+	trgm_watch_execute(psprintf("delete from %s where relid = $1",
+				quote_qualified_identifier(get_namespace_name(nspid),
+					"trgm_sml_targets")),
+			1, argtypes, values, SPI_OK_DELETE, EPREFIX);
+
+	trgm_watch_execute(psprintf("drop trigger if exists trgm_sml_enqueue "
+				"on %s", quote_qualified_identifier(
+					get_namespace_name(get_rel_namespace(relid)),
+					get_rel_name(relid))),
+			0, NULL, NULL, SPI_OK_UTILITY, EPREFIX);
+
+	SPI_finish();
+
+	PG_RETURN_VOID();
+
+	#undef EPREFIX
+}
+
+/* an UPDATE of trgm_queue_update, for trgm_try */
+typedef struct {
+	Oid				owner;
+	const char		*query;
+	int				nargs;
+	Oid				*argtypes;
+	Datum			*values;
+	const char		*prefix;
+} TrgmQueueRun;
+
+/*
+ * The update runs as the owner of the table, like ANALYZE does, so that
+ * the triggers of the table get no more rights than their owner has.
+ */
+static void
+trgm_queue_run(void *arg)
+{
+	TrgmQueueRun	*run = (TrgmQueueRun *)arg;
+	Oid				save_userid;
+	int				save_sec_context, save_nestlevel;
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(run->owner,
+			save_sec_context | SECURITY_LOCAL_USERID_CHANGE
+			| SECURITY_RESTRICTED_OPERATION);
+	save_nestlevel = trgm_key_settings();
+
+	trgm_watch_execute(run->query, run->nargs, run->argtypes, run->values,
+			SPI_OK_UPDATE, run->prefix);
+
+	AtEOXact_GUC(false, save_nestlevel);
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+}
+
+/* the keys in rows from to to of batch, as a text[] for each key column */
+static void
+trgm_queue_keys(SPITupleTable *batch, uint64 from, uint64 to, int nkeys,
+		Datum *values)
+{
+	ArrayBuildState		*cols[INDEX_MAX_KEYS];
+	Datum				*elems;
+	bool				*nulls;
+	int					nelems, i;
+	uint64				row;
+	bool				isnull;
+
+	for (i = 0; i < nkeys; i++)
+		cols[i] = initArrayResult(TEXTOID, CurrentMemoryContext, false);
+
+	/* keys queued before the primary key changed are dropped */
+	for (row = from; row < to; row++) {
+		deconstruct_array(DatumGetArrayTypeP(SPI_getbinval(batch->vals[row],
+						batch->tupdesc, 4, &isnull)),
+				TEXTOID, -1, false, TYPALIGN_INT, &elems, &nulls, &nelems);
+
+		if (nelems != nkeys)
+			continue;
+
+		for (i = 0; i < nkeys; i++)
+			cols[i] = accumArrayResult(cols[i], elems[i], nulls[i], TEXTOID,
+					CurrentMemoryContext);
+	}
+
+	for (i = 0; i < nkeys; i++)
+		values[i] = makeArrayResult(cols[i], CurrentMemoryContext);
+}
+
+/*
+ * Store the trigrams of the rows of relid whose keys are in rows from to
+ * to of batch, with one UPDATE joining the keys to the primary key. When
+ * it fails the rows are updated one at a time, and those failing on their
+ * own are dropped with a warning.
+ */
+static void
+trgm_queue_update(Oid relid, const char *src, const char *dst, Oid nspid,
+		SPITupleTable *batch, uint64 from, uint64 to, const char *prefix)
+{
+	Relation			rel = try_relation_open(relid, AccessShareLock);
+	TupleDesc			tupdesc;
+	Form_pg_attribute	attr;
+	AttrNumber			*keys = NULL;
+	Oid					argtypes[INDEX_MAX_KEYS];
+	Datum				values[INDEX_MAX_KEYS];
+	StringInfoData		query;
+	TrgmQueueRun		run;
+	ErrorData			*error;
+	const char			*fn, *why = NULL;
+	int					nkeys, i;
+	uint64				row;
+
+	if (rel == NULL)
+		return;
+
+	fn = trgm_watch_function(relid, src, dst, nspid, &why);
+	if (fn != NULL && (keys = trgm_watch_key(rel, &nkeys)) == NULL)
+		why = "it has no primary key";
+
+	if (keys == NULL) {
+		ereport(WARNING,
+				(errmsg("%srows of %s dropped: %s", prefix,
+						RelationGetRelationName(rel), why)));
+		relation_close(rel, AccessShareLock);
+		return;
+	}
+
+	tupdesc = RelationGetDescr(rel);
+
+	initStringInfo(&query);
+	appendStringInfo(&query, "update %s t set %s = %s(t.%s%s) from unnest(",
+			quote_qualified_identifier(
+				get_namespace_name(RelationGetNamespace(rel)),
+				RelationGetRelationName(rel)),
+			quote_identifier(dst),
+			quote_qualified_identifier(get_namespace_name(nspid), fn),
+			quote_identifier(src),
+			strcmp(fn, "to_trgm_ids") == 0 ? ", true" : "");
+
+	for (i = 0; i < nkeys; i++) {
+		appendStringInfo(&query, "%s$%d", i > 0 ? ", " : "", i + 1);
+		argtypes[i] = TEXTARRAYOID;
+	}
+
+	appendStringInfoString(&query, ") q(");
+	for (i = 0; i < nkeys; i++)
+		appendStringInfo(&query, "%sk%d", i > 0 ? ", " : "", i + 1);
+
+	appendStringInfoString(&query, ") where ");
+	for (i = 0; i < nkeys; i++) {
+		attr = TupleDescAttr(tupdesc, keys[i] - 1);
+		appendStringInfo(&query, "%st.%s = q.k%d::%s", i > 0 ? " and " : "",
+				quote_identifier(NameStr(attr->attname)), i + 1,
+				format_type_be_qualified(attr->atttypid));
+	}
+
+	run.owner = rel->rd_rel->relowner;
+	run.query = query.data;
+	run.nargs = nkeys;
+	run.argtypes = argtypes;
+	run.values = values;
+	run.prefix = prefix;
+
+	trgm_queue_keys(batch, from, to, nkeys, values);
+
+	if (trgm_try(trgm_queue_run, &run, &error)) {
+		relation_close(rel, NoLock);
+		return;
+	}
+
+	/* the error of a single row is its own */
+	if (to - from > 1) {
+		FreeErrorData(error);
+		error = NULL;
+	}
+
+	for (row = from; row < to; row++) {
+		if (error == NULL) {
+			trgm_queue_keys(batch, row, row + 1, nkeys, values);
+			if (trgm_try(trgm_queue_run, &run, &error))
+				continue;
+		}
+
+		ereport(WARNING,
+				(errmsg("%srow of %s with key %s dropped: %s", prefix,
+						RelationGetRelationName(rel),
+						SPI_getvalue(batch->vals[row], batch->tupdesc, 4),
+						error->message)));
+
+		FreeErrorData(error);
+		error = NULL;
+	}
+
+	relation_close(rel, NoLock);
+}
+
+/*
+ * Take up to limit rows off the queue and store the trigrams of the rows
+ * still there, one UPDATE a table. Rows taken by a concurrent call are
+ * skipped rather than waited for. Rows of tables no longer watched, or
+ * whose columns no longer fit, and rows failing to update are dropped with
+ * a warning. Returns the number of queue entries taken.
+ */
+Datum trgm_sml_process_queue(PG_FUNCTION_ARGS)
+{
+	#define EPREFIX "trgm_sml_process_queue: "
+
+	int32			limit = PG_GETARG_INT32(0);
+	Oid				nspid = get_func_namespace(fcinfo->flinfo->fn_oid);
+	char			*nsp = get_namespace_name(nspid);
+	char			*queue;
+	SPITupleTable	*batch;
+	uint64			nbatch, row, end;
+	Oid				argtypes[1] = {INT4OID};
+	Datum			values[1];
+	int64			ntaken = 0;
+	bool			isnull;
+
+	if (limit <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg(EPREFIX "limit must be greater than 0")));
+
+	queue = quote_qualified_identifier(nsp, "trgm_sml_queue");
+
+	values[0] = Int32GetDatum(limit);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, EPREFIX "SPI_connect failed");
+
+	trgm_watch_execute(psprintf("with q as (delete from %s where ctid = any("
+				"array(select ctid from %s limit $1 for update skip locked)) "
+				"returning relid, key) "
+				"select q.relid, t.src, t.dst, q.key, count(*) "
+				"from q left join %s t on t.relid = q.relid "
+				"group by 1, 2, 3, 4 order by 1",
+				queue, queue,
+				quote_qualified_identifier(nsp, "trgm_sml_targets")),
+			1, argtypes, values, SPI_OK_SELECT, EPREFIX);
+
+	batch = SPI_tuptable;
+	nbatch = SPI_processed;
+
+	for (row = 0; row < nbatch; row = end) {
+		HeapTuple		tuple = batch->vals[row];
+		Oid				relid;
+		Datum			src, dst;
+		bool			srcnull, dstnull;
+
+		relid = DatumGetObjectId(SPI_getbinval(tuple, batch->tupdesc, 1,
+					&isnull));
+		src = SPI_getbinval(tuple, batch->tupdesc, 2, &srcnull);
+		dst = SPI_getbinval(tuple, batch->tupdesc, 3, &dstnull);
+
+		for (end = row; end < nbatch; end++) {
+			if (DatumGetObjectId(SPI_getbinval(batch->vals[end],
+							batch->tupdesc, 1, &isnull)) != relid)
+				break;
+
+			ntaken += DatumGetInt64(SPI_getbinval(batch->vals[end],
+						batch->tupdesc, 5, &isnull));
+		}
+
+		if (srcnull || dstnull)
+			continue;
+
+		trgm_queue_update(relid, NameStr(*DatumGetName(src)),
+				NameStr(*DatumGetName(dst)), nspid, batch, row, end, EPREFIX);
+	}
+
+	SPI_finish();
+
+	PG_RETURN_INT64(ntaken);
+
+	#undef EPREFIX
+}
+
+/* a call of trgm_sml_process_queue by the worker, for trgm_try */
+typedef struct {
+	FmgrInfo		flinfo;
+	Oid				owner;
+	int64			ntaken;
+} TrgmWorkerCall;
+
+static void
+trgm_worker_call(void *arg)
+{
+	TrgmWorkerCall	*call = (TrgmWorkerCall *)arg;
+	Oid				save_userid;
+	int				save_sec_context;
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(call->owner,
+			save_sec_context | SECURITY_LOCAL_USERID_CHANGE
+			| SECURITY_RESTRICTED_OPERATION);
+
+	call->ntaken = DatumGetInt64(FunctionCall1(&call->flinfo,
+				Int32GetDatum(trgm_worker_batch_size)));
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+}
+
+/*
+ * One batch for each schema having the functions, in a transaction. A
+ * trgm_sml_process_queue is only called when it is a C function of this
+ * library owned by a superuser, and it runs as the owner of its
+ * trgm_sml_targets: whoever can create functions or tables in some schema
+ * gets nothing run by the worker. A queue failing as a whole, on a lock
+ * timeout say, keeps its rows for the next round and holds up no other.
+ */
+static int64
+trgm_worker_round(void)
+{
+	SPITupleTable	*queues;
+	uint64			nqueues, row;
+	int64			ntaken = 0;
+	ErrorData		*error;
+	bool			isnull;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "pg_trgm_sml worker: SPI_connect failed");
+
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, TRGM_WORKER_QUEUES);
+
+	if (SPI_execute(TRGM_WORKER_QUEUES, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "pg_trgm_sml worker: SPI_execute(\"%s\") failed",
+				TRGM_WORKER_QUEUES);
+
+	queues = SPI_tuptable;
+	nqueues = SPI_processed;
+
+	for (row = 0; row < nqueues; row++) {
+		HeapTuple		tuple = queues->vals[row];
+		TrgmWorkerCall	call;
+		Oid				procoid, proowner;
+		char			*nsp;
+
+		procoid = DatumGetObjectId(SPI_getbinval(tuple, queues->tupdesc, 1,
+					&isnull));
+		proowner = DatumGetObjectId(SPI_getbinval(tuple, queues->tupdesc, 2,
+					&isnull));
+		call.owner = DatumGetObjectId(SPI_getbinval(tuple, queues->tupdesc, 3,
+					&isnull));
+		nsp = SPI_getvalue(tuple, queues->tupdesc, 4);
+
+		if (!superuser_arg(proowner))
+			continue;
+
+		fmgr_info(procoid, &call.flinfo);
+		if (call.flinfo.fn_addr != trgm_sml_process_queue)
+			continue;
+
+		pgstat_report_activity(STATE_RUNNING,
+				psprintf("%s.trgm_sml_process_queue(%d)",
+					quote_identifier(nsp), trgm_worker_batch_size));
+
+		if (trgm_try(trgm_worker_call, &call, &error)) {
+			ntaken += call.ntaken;
+			continue;
+		}
+
+		ereport(WARNING,
+				(errmsg("pg_trgm_sml worker: queue of schema %s failed: %s",
+						nsp, error->message)));
+		FreeErrorData(error);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+
+	pgstat_report_stat(true);
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return ntaken;
+}
+
+/* sleeps only when a round found less than a full batch */
+void
+trgm_sml_worker_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(trgm_worker_database, NULL, 0);
+	pgstat_report_appname("pg_trgm_sml worker");
+
+	for (;;) {
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending) {
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		if (trgm_worker_round() >= trgm_worker_batch_size)
+			continue;
+
+		(void)WaitLatch(MyLatch,
+				WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+				trgm_worker_naptime, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+	}
+}
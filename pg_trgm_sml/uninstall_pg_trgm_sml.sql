@@ -1,3 +1,70 @@
 set search_path = public;
 drop function trgm_sml(text, text, int);
 drop function trgm_tag(text, int);
+drop function trgm_sml(trgm_vector, trgm_vector, int);
+drop function to_trgm_vector(text);
+drop function trgm_sml_matrix(text[], int);
+drop function trgm_sml_join(text[], text[], float8);
+drop function trgm_minhash(text, int);
+drop function trgm_lsh_bands(int4[], int);
+drop function trgm_sml_idf_refresh(regclass, text);
+drop function trgm_sml_weighted(text, text, int, text);
+drop aggregate trgm_tag_agg(text, int);
+drop function trgm_tag_agg_trans(internal, text, int);
+drop function trgm_tag_agg_combine(internal, internal);
+drop function trgm_tag_agg_serialize(internal);
+drop function trgm_tag_agg_deserialize(bytea, internal);
+drop function trgm_tag_agg_final(internal);
+drop function trgm_tags(text, int);
+drop function trgm_sml_char(text, text, int, int);
+drop function trgm_tags_char(text, int, int);
+drop function trgm_sml_above(text, text, float8);
+drop function to_trgm_ids(text);
+drop function to_trgm_ids(text, bool);
+drop function trgm_ids_sml(int4[], int4[]);
+drop table trgm_sml_dict;
+drop function trgm_sml_enqueue() cascade;
+drop function trgm_sml_watch(regclass, name, name);
+drop function trgm_sml_unwatch(regclass);
+drop function trgm_sml_process_queue(int);
+drop table trgm_sml_queue;
+drop table trgm_sml_targets;
+drop view if exists pg_toys_stats;
+drop function pg_trgm_sml_stats();
+drop function pg_trgm_sml_stats_reset();
+drop type trgm_count;
+drop type trgm_vector cascade;
+drop operator class gin_trgm_sml_ops using gin;
+drop operator class gist_trgm_sml_ops using gist;
+drop function gin_extract_value_trgm_sml(text, internal);
+drop function gin_extract_query_trgm_sml(text, internal, int2, internal, internal, internal, internal);
+drop function gin_trgm_sml_consistent(internal, int2, text, int4, internal, internal, internal, internal);
+drop function gtrgm_sml_consistent(internal, text, smallint, oid, internal);
+drop function gtrgm_sml_distance(internal, text, smallint, oid, internal);
+drop function gtrgm_sml_compress(internal);
+drop function gtrgm_sml_decompress(internal);
+drop function gtrgm_sml_penalty(internal, internal, internal);
+drop function gtrgm_sml_picksplit(internal, internal);
+drop function gtrgm_sml_union(internal, internal);
+drop function gtrgm_sml_same(gtrgm_sml, gtrgm_sml, internal);
+drop type gtrgm_sml cascade;
+drop operator <-> (text, text);
+drop operator %% (text, text);
+drop function trgm_sml_dist(text, text);
+drop function trgm_sml_op(text, text);
+drop function trgm_sml_sel(internal, oid, internal, int4);
+drop function trgm_sml_support(internal);
+
+-- pg_toys_stats unions the <module>_stats() of the toy modules installed
+do $$
+declare
+	q text;
+begin
+	select string_agg(format('select * from public.%I()', proname), ' union all ' order by proname) into q
+		from pg_proc where pronamespace = 'public'::regnamespace and proname in ('pg_netop_stats', 'pg_strip_tags_stats', 'pg_trgm_sml_stats');
+	drop view if exists pg_toys_stats;
+	if q is not null then
+		execute 'create view pg_toys_stats as ' || q;
+	end if;
+end
+$$;